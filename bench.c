@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image.h"
+#include "vector.h"
+#include "scene.h"
+#include "render.h"
+#include "stats.h"
+
+#define RESOLUTION 1
+#define ANTIALIAS  2
+#define THRESHOLD  0.05f
+
+#define BENCH_MAX_RESULTS 64
+#define BENCH_LINE_SIZE   1024
+
+static char* reference_scenes[] = {
+  "scenes/default.scene",
+  "scenes/spheres.scene"
+};
+static int reference_sizes[] = { 256, 512 };
+
+/**
+ * Measures of the rendering of a scene at a size.
+ */
+typedef struct {
+  char scene[256];
+  int width, height;
+  double seconds;         /**< wall time of the render */
+  double rays_per_second;
+  STATS stats;
+} RESULT;
+
+/**
+ * Loads, renders and writes a scene, measuring every phase.
+ */
+static void bench(RESULT* result, char* filename, int size, size_t n_threads, char* output) {
+  double start;
+  SCENE* scene;
+  RENDER settings = {
+    NULL, NULL,
+    { { 0.0f } },
+    RESOLUTION, ANTIALIAS, THRESHOLD, 1, 0,
+    RENDER_TILE_SIZE, n_threads,
+    NULL,
+    NULL, 0, 0,
+    NULL
+  };
+
+  stats_reset();
+  snprintf(result->scene, sizeof(result->scene), "%s", filename);
+  result->width = result->height = size;
+
+  start = stats_clock();
+  scene = scene_load(filename);
+  stats_time(STATS_LOAD, start);
+
+  start = stats_clock();
+  scene_prepare(scene);
+  stats_time(STATS_PREPARE, start);
+
+  settings.scene = scene;
+  camera_scene(&settings.camera, scene, scene->eye);
+  settings.image = image(size, size);
+  image_accumulation(settings.image);
+
+  start = stats_clock();
+  render(&settings);
+  result->seconds = stats_clock() - start;
+
+  start = stats_clock();
+  image_write(settings.image, output, image_write_ppm);
+  stats_time(STATS_IMAGE, start);
+
+  image_free(settings.image);
+  scene_free(scene);
+
+  stats_merge();
+  stats_total(&result->stats);
+  // the other counters are intersection tests, not rays
+  result->rays_per_second = (double)(result->stats.counters[STATS_PRIMARY_RAYS] +
+                                     result->stats.counters[STATS_SHADOW_RAYS] +
+                                     result->stats.counters[STATS_REFLECTION_RAYS]) / result->seconds;
+}
+
+static void print_result(RESULT* result) {
+  STATS* s = &result->stats;
+
+  printf("%-28s %4dx%-4d %8.3fs %10llu %10llu %10llu %10.0f %8.3fs %8.3fs %8.3fs %8.3fs %8.3fs\n",
+    result->scene, result->width, result->height, result->seconds,
+    s->counters[STATS_PRIMARY_RAYS], s->counters[STATS_SHADOW_RAYS], s->counters[STATS_REFLECTION_RAYS],
+    result->rays_per_second,
+    s->times[STATS_CAST], s->times[STATS_TRACE] - s->times[STATS_CAST],
+    s->times[STATS_IMAGE], s->times[STATS_LOAD], s->times[STATS_PREPARE]);
+}
+
+/**
+ * Writes the results as JSON, one result per line.
+ */
+static void write_results(RESULT* results, int n, const char* filename) {
+  FILE* file = fopen(filename, "w");
+  STATS* s;
+  int i, k;
+
+  if(file == NULL) {
+    fprintf(stderr, "Error while opening file '%s'\n", filename);
+    exit(1);
+  }
+  fprintf(file, "{\n  \"results\": [\n");
+  for(i = 0; i < n; i++) {
+    s = &results[i].stats;
+    fprintf(file, "    {\"scene\": \"%s\", \"width\": %d, \"height\": %d, \"seconds\": %.6f, \"rays_per_second\": %.1f",
+      results[i].scene, results[i].width, results[i].height, results[i].seconds, results[i].rays_per_second);
+    for(k = 0; k < STATS_COUNTERS; k++)
+      fprintf(file, ", \"%s\": %llu", stats_counter_name(k), s->counters[k]);
+    for(k = 0; k < STATS_TIMERS; k++)
+      fprintf(file, ", \"%s_seconds\": %.6f", stats_timer_name(k), s->times[k]);
+    fprintf(file, "}%s\n", (i < n - 1) ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  fclose(file);
+}
+
+/**
+ * Finds the number following a key in a JSON line.
+ */
+static double json_number(const char* line, const char* key) {
+  char pattern[64];
+  const char* p;
+
+  snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+  p = strstr(line, pattern);
+  return p ? strtod(p + strlen(pattern), NULL) : 0.0;
+}
+
+/**
+ * Compares the results with the ones of a baseline written by
+ * write_results.
+ * @param tolerance Fraction of the baseline rays per second a result may lose
+ * @return Number of results slower than the baseline by more than the tolerance
+ */
+static int compare_results(RESULT* results, int n, const char* filename, double tolerance) {
+  FILE* file = fopen(filename, "r");
+  char line[BENCH_LINE_SIZE];
+  char scene[256];
+  char* p;
+  double baseline, change;
+  int i, regressions = 0;
+
+  if(file == NULL) {
+    fprintf(stderr, "Error while opening file '%s'\n", filename);
+    exit(1);
+  }
+
+  printf("\n%-28s %9s %12s %12s %8s\n", "compared to baseline", "size", "baseline", "rays/s", "change");
+  while(fgets(line, sizeof(line), file)) {
+    if((p = strstr(line, "\"scene\": \"")) == NULL)
+      continue;
+    p += strlen("\"scene\": \"");
+    snprintf(scene, sizeof(scene), "%.*s", (int)strcspn(p, "\""), p);
+
+    for(i = 0; i < n; i++) {
+      if(strcmp(results[i].scene, scene) != 0 ||
+         results[i].width != (int)json_number(line, "width") ||
+         results[i].height != (int)json_number(line, "height"))
+        continue;
+      baseline = json_number(line, "rays_per_second");
+      change = results[i].rays_per_second/baseline - 1.0;
+      printf("%-28s %4dx%-4d %12.0f %12.0f %+7.1f%%%s\n", scene, results[i].width, results[i].height,
+        baseline, results[i].rays_per_second, change*100.0, (change < -tolerance) ? "  REGRESSION" : "");
+      if(change < -tolerance)
+        regressions++;
+    }
+  }
+  fclose(file);
+  return regressions;
+}
+
+/**
+ * Usage: raytracer_bench [-t threads] [-n repetitions] [-o results.json]
+ *                        [-b baseline.json] [-r tolerance] [scene...]
+ * Renders each scene, the reference scenes by default, at each reference
+ * size and reports the ray counts, rays per second and the time spent in
+ * each phase, keeping the fastest of 3 repetitions. Shading time is the
+ * rendering time not spent casting rays.
+ * Exits with 1 when a result is slower than the baseline by more than the
+ * tolerance, 0.15 by default.
+ */
+int main(int argc, char** argv) {
+  RESULT results[BENCH_MAX_RESULTS];
+  char** scenes = reference_scenes;
+  int n_scenes = sizeof(reference_scenes)/sizeof(char*);
+  int n_sizes = sizeof(reference_sizes)/sizeof(int);
+  RESULT run;
+  size_t n_threads = 1;
+  int repetitions = 3;
+  char* output = NULL;
+  char* baseline = NULL;
+  double tolerance = 0.15;
+  int opt, i, j, r, n = 0;
+
+  while((opt = getopt(argc, argv, "t:n:o:b:r:")) != -1) {
+    switch(opt) {
+      case 't':
+        n_threads = strtoul(optarg, NULL, 10);
+        break;
+      case 'n':
+        repetitions = atoi(optarg);
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      case 'b':
+        baseline = optarg;
+        break;
+      case 'r':
+        tolerance = strtod(optarg, NULL);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-t threads] [-n repetitions] [-o results.json] [-b baseline.json] [-r tolerance] [scene...]\n", argv[0]);
+        return 1;
+    }
+  }
+  if(optind < argc) {
+    scenes = &argv[optind];
+    n_scenes = argc - optind;
+  }
+
+  printf("%-28s %9s %9s %10s %10s %10s %10s %9s %9s %9s %9s %9s\n",
+    "scene", "size", "render", "primary", "shadow", "reflection", "rays/s",
+    "cast", "shade", "image", "load", "prepare");
+  for(i = 0; i < n_scenes; i++)
+  for(j = 0; j < n_sizes && n < BENCH_MAX_RESULTS; j++, n++) {
+    for(r = 0; r < repetitions; r++) {
+      bench(&run, scenes[i], reference_sizes[j], n_threads, "img/bench.ppm");
+      if(r == 0 || run.seconds < results[n].seconds)
+        results[n] = run;
+    }
+    print_result(&results[n]);
+  }
+
+  if(output != NULL)
+    write_results(results, n, output);
+  if(baseline != NULL && compare_results(results, n, baseline, tolerance) > 0)
+    return 1;
+  return 0;
+}
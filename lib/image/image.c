@@ -1,67 +1,131 @@
 #include <stdio.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <memory.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "image.h"
 
+/**
+ * Allocates the contiguous pixel data of an image.
+ */
+static void image_alloc(IMAGE* img) {
+  size_t size = sizeof(u_int) * img->width * img->height;
+
+  // round up so the whole block can be processed a vector at a time
+  size = (size + IMAGE_ALIGNMENT - 1) & ~(size_t)(IMAGE_ALIGNMENT - 1);
+  if(posix_memalign((void**)&img->data, IMAGE_ALIGNMENT, size) != 0) {
+    fprintf(stderr, "Error while allocating a %dx%d image\n", img->width, img->height);
+    exit(1);
+  }
+  img->accumulation = NULL;
+  img->weights = NULL;
+}
+
 IMAGE* image(int width, int height) {
-  int y;
   IMAGE* img = (IMAGE*)malloc(sizeof(IMAGE));
   img->width = width;
   img->height = height;
 
-  img->data = (u_int**)malloc(sizeof(u_int*) * img->height);
-
-  for(y = 0; y < img->height; y++) {
-    img->data[y] = (u_int*)malloc(sizeof(u_int)*img->width);
-    memset(img->data[y], 0, sizeof(u_int)*img->width);
-  }
+  image_alloc(img);
+  memset(img->data, 0, sizeof(u_int) * width * height);
 
   return img;
 }
 void image_free(IMAGE* img) {
-  int y;
-  for(y = 0; y < img->height; y++) {
-    free(img->data[y]);
-  }
   free(img->data);
+  free(img->accumulation);
   free(img);
 }
 
+void image_accumulation(IMAGE* img) {
+  size_t n = (size_t)img->width * img->height;
+
+  // colors and weights live in the same block
+  if(img->accumulation == NULL) {
+    if(posix_memalign((void**)&img->accumulation, IMAGE_ALIGNMENT, sizeof(float) * n * 4) != 0) {
+      fprintf(stderr, "Error while allocating a %dx%d accumulation buffer\n", img->width, img->height);
+      exit(1);
+    }
+    img->weights = img->accumulation + n*3;
+  }
+  memset(img->accumulation, 0, sizeof(float) * n * 4);
+}
+void image_accumulate(IMAGE* img, int x, int y, size_t n, const float* rgb, float weight) {
+  int yy = y + n;
+  int xx = x + n;
+  float* p;
+  for(; y < yy; y++) {
+    for(x = xx - n; x < xx; x++) {
+      p = &img->accumulation[(y*img->width + x)*3];
+      p[0] += rgb[0];
+      p[1] += rgb[1];
+      p[2] += rgb[2];
+      img->weights[y*img->width + x] += weight;
+    }
+  }
+}
+void image_resolve(IMAGE* img) {
+  size_t i, n = (size_t)img->width * img->height;
+  float* p = img->accumulation;
+  float c[3];
+  float scale;
+  int k;
+
+  for(i = 0; i < n; i++, p += 3) {
+    if(img->weights[i] <= 0.0f)
+      continue;
+    // average the samples and convert them to the [0, 255] range
+    scale = 255.0f/img->weights[i];
+    for(k = 0; k < 3; k++) {
+      c[k] = p[k]*scale;
+      c[k] = (c[k] < 0.0f) ? 0.0f : (c[k] > 255.0f) ? 255.0f : c[k];
+    }
+    img->data[i] = ((u_int)(u_char)c[0] << 16) | ((u_int)(u_char)c[1] << 8) | (u_char)c[2];
+  }
+}
+
 void image_setpixel(IMAGE* img, int x, int y, u_char r, u_char g, u_char b) {
-  img->data[y][x] = (r << 16) | (g << 8) | b;
+  image_pixel(img, x, y) = (r << 16) | (g << 8) | b;
 }
 void image_setpixels_square(IMAGE* img, int x, int y, size_t n, u_char r, u_char g, u_char b) {
   int yy = y + n;
   int xx = x + n;
   u_int p = (r << 16) | (g << 8) | (u_int)b;
+  u_int* row;
   for(; y < yy; y++) {
+    row = &image_pixel(img, 0, y);
     for(x = xx - n; x < xx; x++)
-      img->data[y][x] = p;
+      row[x] = p;
   }
 }
 void image_getpixel(IMAGE* img, int x, int y, u_char* r, u_char* g, u_char* b) {
-  *r = (img->data[y][x] & 0xFF0000) >> 16;
-  *g = (img->data[y][x] & 0xFF00) >> 8;
-  *b = img->data[y][x] & 0xFF;
+  u_int p = image_pixel(img, x, y);
+  *r = (p & 0xFF0000) >> 16;
+  *g = (p & 0xFF00) >> 8;
+  *b = p & 0xFF;
 }
 void image_getpixelv(IMAGE* img, int x, int y, u_char* rgb) {
   image_getpixel(img, x, y, &rgb[0], &rgb[1], &rgb[2]);
 }
 void image_getpixelf(IMAGE* img, int x, int y, float* rgb) {
-  rgb[0] = (float)((img->data[y][x] & 0xFF0000) >> 16) / 255.0f;
-  rgb[1] = (float)((img->data[y][x] & 0xFF00) >> 8) / 255.0f;
-  rgb[2] = (float)(img->data[y][x] & 0xFF) / 255.0f;
+  u_int p = image_pixel(img, x, y);
+  rgb[0] = (float)((p & 0xFF0000) >> 16) / 255.0f;
+  rgb[1] = (float)((p & 0xFF00) >> 8) / 255.0f;
+  rgb[2] = (float)(p & 0xFF) / 255.0f;
 }
 
 IMAGE* image_read(char* filename, void(*read)(FILE*, IMAGE*)) {
   FILE* file;
   IMAGE* img;
 
-  file = fopen(filename, "r");
+  file = fopen(filename, "rb");
 
   if(file) {
     img = (IMAGE*)malloc(sizeof(IMAGE));
     read(file, img);
+    fclose(file);
   } else {
     fprintf(stderr, "Error while opening file '%s'", filename);
     exit(1);
@@ -72,47 +136,288 @@ IMAGE* image_read(char* filename, void(*read)(FILE*, IMAGE*)) {
 void image_write(IMAGE* img, char* filename, void(*write)(FILE*, IMAGE*)) {
   FILE* file;
 
-  file = fopen(filename, "w");
+  file = fopen(filename, "wb");
 
   if(file) {
     write(file, img);
+    if(fclose(file) != 0) {
+      fprintf(stderr, "Error while writing file '%s'", filename);
+      exit(1);
+    }
   } else {
     fprintf(stderr, "Error while opening file '%s'", filename);
     exit(1);
   }
 }
 
+/**
+ * Skips whitespace and comment lines of a PNM header.
+ */
+static size_t ppm_skip(const u_char* data, size_t size, size_t i) {
+  while(i < size) {
+    if(data[i] == '#') {
+      while(i < size && data[i] != '\n')
+        i++;
+    } else if(data[i] == ' ' || data[i] == '\t' || data[i] == '\n' || data[i] == '\r') {
+      i++;
+    } else {
+      break;
+    }
+  }
+  return i;
+}
+
+/**
+ * Reads an unsigned decimal number of a PNM header, up to INT_MAX.
+ */
+static size_t ppm_number(const u_char* data, size_t size, size_t i, int* n) {
+  i = ppm_skip(data, size, i);
+  if(i >= size || data[i] < '0' || data[i] > '9') {
+    fprintf(stderr, "Malformed PPM header\n");
+    exit(1);
+  }
+  for(*n = 0; i < size && data[i] >= '0' && data[i] <= '9'; i++) {
+    if(*n > (INT_MAX - (data[i] - '0'))/10) {
+      fprintf(stderr, "Malformed PPM header\n");
+      exit(1);
+    }
+    *n = *n*10 + (data[i] - '0');
+  }
+  return i;
+}
+
+/**
+ * Scales a sample to [0, 255], samples above max being clamped to it.
+ */
+static inline u_int ppm_sample(u_int sample, int max) {
+  return ((sample > (u_int)max) ? (u_int)max : sample)*255/max;
+}
+
 void image_read_ppm(FILE* file, IMAGE* img) {
-  int x, y;
-  u_char r, g, b;
-  int max;
-  char buffer[255];
-
-  fgets(buffer, 255, file); // P6
-  fgets(buffer, 255, file); // HEADER
-  fscanf(file, "%d %d", &img->width, &img->height);
-  fscanf(file, "%d", &max);
-  fscanf(file, "%c", buffer);
-
-  img->data = (u_int**)malloc(sizeof(u_int*) * img->height);
-
-  for(y = 0; y < img->height; y++) {
-    img->data[y] = (u_int*)malloc(sizeof(u_int) * img->width);
-    for(x = 0; x < img->width; x++) {
-      fscanf(file, "%c%c%c", &r, &g, &b);
-      image_setpixel(img, x, y, r, g, b);
+  struct stat st;
+  u_char* data;
+  size_t size, i, n;
+  int mapped;
+  int max, bytes;
+  u_int* p;
+  const u_char* src;
+
+  // map the whole file, or read it if it cannot be mapped (e.g. a pipe)
+  mapped = 0;
+  data = NULL;
+  size = 0;
+  if(fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    size = st.st_size;
+    data = (u_char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    mapped = (data != MAP_FAILED);
+  }
+  if(!mapped) {
+    size_t capacity = 1 << 16;
+    data = (u_char*)malloc(capacity);
+    size = 0;
+    while((n = fread(data + size, 1, capacity - size, file)) > 0) {
+      size += n;
+      if(size == capacity)
+        data = (u_char*)realloc(data, capacity *= 2);
     }
   }
+
+  if(size < 2 || data[0] != 'P' || data[1] != '6') {
+    fprintf(stderr, "Only binary PPM (P6) images are supported\n");
+    exit(1);
+  }
+  i = ppm_number(data, size, 2, &img->width);
+  i = ppm_number(data, size, i, &img->height);
+  i = ppm_number(data, size, i, &max);
+  // a single whitespace separates the header from the pixels
+  i++;
+
+  bytes = (max > 255) ? 2 : 1;
+  // the pixels must fit in what is left of the file, divided so that large
+  // sizes cannot wrap around
+  if(img->width <= 0 || img->height <= 0 || max <= 0 || max > 65535 || i > size ||
+     (size_t)img->width > (size - i)/img->height/3/bytes) {
+    fprintf(stderr, "Malformed PPM image\n");
+    exit(1);
+  }
+
+  image_alloc(img);
+
+  src = data + i;
+  n = (size_t)img->width * img->height;
+  p = img->data;
+  if(max == 255) {
+    for(i = 0; i < n; i++, src += 3)
+      p[i] = (src[0] << 16) | (src[1] << 8) | src[2];
+  } else if(bytes == 1) {
+    for(i = 0; i < n; i++, src += 3)
+      p[i] = (ppm_sample(src[0], max) << 16) | (ppm_sample(src[1], max) << 8) | ppm_sample(src[2], max);
+  } else {
+    // 16 bit samples are big endian
+    for(i = 0; i < n; i++, src += 6)
+      p[i] = (ppm_sample((src[0] << 8) | src[1], max) << 16)
+           | (ppm_sample((src[2] << 8) | src[3], max) << 8)
+           |  ppm_sample((src[4] << 8) | src[5], max);
+  }
+
+  if(mapped)
+    munmap(data, size);
+  else
+    free(data);
 }
 void image_write_ppm(FILE* file, IMAGE* img) {
-  int x, y;
+  size_t i, n = (size_t)img->width*img->height;
   u_int p;
+  u_char* buffer = (u_char*)malloc(n*3);
+  u_char* dst = buffer;
+
+  // convert the whole image to packed RGB, then write it at once
+  for(i = 0; i < n; i++, dst += 3) {
+    p = img->data[i];
+    dst[0] = p >> 16;
+    dst[1] = (p >> 8)&0xFF;
+    dst[2] = p&0xFF;
+  }
 
   fprintf(file, "P6\n# RAYTRACER\n%d %d 255\n", img->width, img->height);
-  for(y = 0; y < img->height; y++) {
-    for(x = 0; x < img->width; x++) {
-      p = img->data[y][x];
-      fprintf(file, "%c%c%c", p >> 16, (p >> 8)&0xFF, p&0xFF);
+  if(fwrite(buffer, 1, n*3, file) != n*3) {
+    fprintf(stderr, "Error while writing a PPM image\n");
+    exit(1);
+  }
+  free(buffer);
+}
+
+IMAGE_STREAM* image_stream(char* filename, int width, int height) {
+  IMAGE_STREAM* stream = (IMAGE_STREAM*)malloc(sizeof(IMAGE_STREAM));
+
+  stream->file = fopen(filename, "wb");
+  if(stream->file == NULL) {
+    fprintf(stderr, "Error while opening file '%s'", filename);
+    exit(1);
+  }
+  stream->filename = strdup(filename);
+  stream->width = width;
+  stream->height = height;
+  stream->rows = 0;
+  stream->buffer = (u_char*)malloc((size_t)width*3);
+  fprintf(stream->file, "P6\n# RAYTRACER\n%d %d 255\n", width, height);
+  return stream;
+}
+void image_stream_rows(IMAGE_STREAM* stream, IMAGE* img, int rows) {
+  int x, y;
+  u_int p;
+  u_char* dst;
+
+  if(rows > stream->height - stream->rows)
+    rows = stream->height - stream->rows;
+  for(y = 0; y < rows; y++) {
+    dst = stream->buffer;
+    for(x = 0; x < stream->width; x++, dst += 3) {
+      p = image_pixel(img, x, y);
+      dst[0] = p >> 16;
+      dst[1] = (p >> 8)&0xFF;
+      dst[2] = p&0xFF;
+    }
+    if(fwrite(stream->buffer, 1, (size_t)stream->width*3, stream->file) != (size_t)stream->width*3) {
+      fprintf(stderr, "Error while writing file '%s'", stream->filename);
+      exit(1);
     }
   }
-}
\ No newline at end of file
+  // the rows are handed to the system as soon as they are done
+  fflush(stream->file);
+  stream->rows += rows;
+}
+void image_stream_close(IMAGE_STREAM* stream) {
+  if(stream->rows != stream->height || fclose(stream->file) != 0) {
+    fprintf(stderr, "Error while writing file '%s'", stream->filename);
+    exit(1);
+  }
+  free(stream->buffer);
+  free(stream->filename);
+  free(stream);
+}
+
+void image_write_tiles(FILE* file, int width, int height) {
+  char magic[8] = IMAGE_TILES_MAGIC;
+  int32_t size[2] = { width, height };
+
+  if(fwrite(magic, sizeof(magic), 1, file) != 1 || fwrite(size, sizeof(size), 1, file) != 1) {
+    fprintf(stderr, "Error while writing a tile file\n");
+    exit(1);
+  }
+}
+void image_write_tile(FILE* file, IMAGE* img, int x, int y, int width, int height, int top) {
+  int32_t rect[4] = { x, y, width, height };
+  size_t n = (size_t)width*3;
+  u_char* row = (u_char*)malloc(n);
+  u_char* dst;
+  u_int p;
+  int xx, yy;
+
+  if(fwrite(rect, sizeof(rect), 1, file) != 1) {
+    fprintf(stderr, "Error while writing a tile file\n");
+    exit(1);
+  }
+  for(yy = y - top; yy < y - top + height; yy++) {
+    dst = row;
+    for(xx = x; xx < x + width; xx++, dst += 3) {
+      p = image_pixel(img, xx, yy);
+      dst[0] = p >> 16;
+      dst[1] = (p >> 8)&0xFF;
+      dst[2] = p&0xFF;
+    }
+    if(fwrite(row, 1, n, file) != n) {
+      fprintf(stderr, "Error while writing a tile file\n");
+      exit(1);
+    }
+  }
+  free(row);
+}
+void image_read_tiles(FILE* file, int* width, int* height) {
+  char magic[8];
+  int32_t size[2];
+
+  if(fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, IMAGE_TILES_MAGIC, sizeof(magic)) != 0 ||
+     fread(size, sizeof(size), 1, file) != 1 || size[0] <= 0 || size[1] <= 0) {
+    fprintf(stderr, "Malformed tile file\n");
+    exit(1);
+  }
+  *width = size[0];
+  *height = size[1];
+}
+bool image_read_tile(FILE* file, IMAGE* img, int* x, int* y, int* width, int* height) {
+  int32_t rect[4];
+  size_t n, read;
+  u_char* row;
+  const u_char* src;
+  int xx, yy;
+
+  // the end of the file may only come between two tiles
+  read = fread(rect, 1, sizeof(rect), file);
+  if(read == 0 && feof(file))
+    return false;
+  if(read != sizeof(rect) || rect[0] < 0 || rect[1] < 0 || rect[2] <= 0 || rect[3] <= 0 ||
+     rect[0] + rect[2] > img->width || rect[1] + rect[3] > img->height) {
+    fprintf(stderr, "Malformed tile file\n");
+    exit(1);
+  }
+
+  n = (size_t)rect[2]*3;
+  row = (u_char*)malloc(n);
+  for(yy = rect[1]; yy < rect[1] + rect[3]; yy++) {
+    if(fread(row, 1, n, file) != n) {
+      fprintf(stderr, "Truncated tile file\n");
+      exit(1);
+    }
+    src = row;
+    for(xx = rect[0]; xx < rect[0] + rect[2]; xx++, src += 3)
+      image_pixel(img, xx, yy) = (src[0] << 16) | (src[1] << 8) | src[2];
+  }
+  free(row);
+
+  *x = rect[0];
+  *y = rect[1];
+  *width = rect[2];
+  *height = rect[3];
+  return true;
+}
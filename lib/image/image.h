@@ -5,6 +5,7 @@
 #define IMAGE_H_
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <sys/types.h>
 
 /**
@@ -12,15 +13,42 @@
  */
 typedef unsigned char u_char;
 
+#define IMAGE_ALIGNMENT 32
+
 /**
  * Image data type, contains its width, height and pixel data.
+ * Pixels are stored row after row in a single aligned block. Renderers may
+ * also accumulate samples in floating point, which are converted to pixels
+ * once by image_resolve.
  */
 typedef struct IMAGE {
   int width;
   int height;
-  u_int** data; /* stores pixel data as an u_int representing 3 u_char {r, g, b} */
+  u_int* data;         /* stores pixel data as an u_int representing 3 u_char {r, g, b} */
+  float* accumulation; /* sums of the {r, g, b} samples of each pixel, or NULL */
+  float* weights;      /* sums of the sample weights of each pixel */
 } IMAGE;
 
+/**
+ * Image file written row by row, so that an image larger than the memory
+ * can be rendered a band of rows at a time.
+ */
+typedef struct IMAGE_STREAM {
+  FILE* file;
+  char* filename;
+  int width;
+  int height;
+  int rows;        /* number of rows written so far */
+  u_char* buffer;  /* packed {r, g, b} row being written */
+} IMAGE_STREAM;
+
+#define IMAGE_TILES_MAGIC "RTTILES"
+
+/**
+ * Pixel at the given coordinates, as an lvalue.
+ */
+#define image_pixel(img, x, y) ((img)->data[(size_t)(y)*(img)->width + (x)])
+
 /**
  * Creates an empty image for a given width and height.
  * @param width Width of the image
@@ -35,6 +63,30 @@ IMAGE* image(int width, int height);
  */
 void image_free(IMAGE* img);
 
+/**
+ * Allocates the floating point accumulation buffer of an image, or clears
+ * it if it already exists.
+ * @param img Image pointer
+ */
+void image_accumulation(IMAGE* img);
+
+/**
+ * Adds a color sample to a squared group of pixels of the accumulation buffer.
+ * @param img    Image pointer
+ * @param x,y    Coordinates of the pixel
+ * @param n      Length of the pixel square
+ * @param rgb    Sum of the sample colors, between 0.0f and 1.0f each
+ * @param weight Sum of the sample weights
+ */
+void image_accumulate(IMAGE* img, int x, int y, size_t n, const float* rgb, float weight);
+
+/**
+ * Converts the accumulated samples to pixels, each being the weighted
+ * average of its samples. Pixels without samples are left untouched.
+ * @param img Image pointer
+ */
+void image_resolve(IMAGE* img);
+
 /**
  * Sets a pixel of the image to the specified color.
  * @param img   Image pointer
@@ -92,13 +144,77 @@ IMAGE* image_read(char* filename, void(*read)(FILE*, IMAGE*));
 void image_write(IMAGE* img, char* filename, void(*write)(FILE*, IMAGE*));
 
 /**
- * Reads an image from a PPM source file.
+ * Opens a binary PPM image file to be written row by row, and writes its
+ * header.
+ * @param filename      Name of the image file
+ * @param width,height  Size of the whole image
+ * @return Pointer to the allocated stream
+ */
+IMAGE_STREAM* image_stream(char* filename, int width, int height);
+
+/**
+ * Writes the next rows of a stream.
+ * @param stream Stream
+ * @param img    Image as wide as the stream, holding the rows
+ * @param rows   Number of rows of the image to be written, from its first row
+ */
+void image_stream_rows(IMAGE_STREAM* stream, IMAGE* img, int rows);
+
+/**
+ * Closes a stream once every row of the image has been written, and
+ * destroys it.
+ * @param stream Stream
+ */
+void image_stream_close(IMAGE_STREAM* stream);
+
+/**
+ * Writes the header of a tile file, which holds rectangles of pixels of
+ * an image rendered separately, to be assembled later. The header holds
+ * the size of the whole image, each tile its position and size followed
+ * by its packed {r, g, b} pixels, row by row.
+ * @param file          File pointer
+ * @param width,height  Size of the whole image
+ */
+void image_write_tiles(FILE* file, int width, int height);
+
+/**
+ * Writes a tile of an image to a tile file.
+ * @param file          File pointer
+ * @param img           Image holding the tile, or a band of rows of the whole image
+ * @param x,y           Top left pixel of the tile in the whole image
+ * @param width,height  Size of the tile
+ * @param top           Row of the whole image held by the first row of img
+ */
+void image_write_tile(FILE* file, IMAGE* img, int x, int y, int width, int height, int top);
+
+/**
+ * Reads the header of a tile file. Exits if it is not a tile file.
+ * @param file          File pointer
+ * @param width,height  Set to the size of the whole image
+ */
+void image_read_tiles(FILE* file, int* width, int* height);
+
+/**
+ * Reads the next tile of a tile file into the whole image. Exits if the
+ * tile is truncated or does not fit in the image.
+ * @param file          File pointer
+ * @param img           Whole image
+ * @param x,y           Set to the top left pixel of the tile
+ * @param width,height  Set to the size of the tile
+ * @return A tile was read, false at the end of the file
+ */
+bool image_read_tile(FILE* file, IMAGE* img, int* x, int* y, int* width, int* height);
+
+/**
+ * Reads an image from a binary PPM (P6) source file. The file is mapped
+ * in memory when possible. Comment lines are skipped and samples are
+ * rescaled to [0, 255] for any maxval, including 16 bit ones.
  * @param file File pointer
  * @param img  Image pointer
  */
 void image_read_ppm(FILE* file, IMAGE* img);
 /**
- * Writes an image to a PPM source file.
+ * Writes an image to a binary PPM source file with a single write.
  * @param file File pointer
  * @param img  Image pointer
  */
@@ -4,78 +4,226 @@
 #include "ray.h"
 #include "light.h"
 #include "vector.h"
-#include "image.h"
+#include "simd.h"
+#include "texture.h"
 
-float* Lambert(MATERIAL* material, RAY_INTERSECTION* intersection, LIGHT* light, float* color) {
-  float dist[3]; // distance to light
-  float diffuse; // diffuse component
-  // material parameters
-  const float* diffuse_color = material->parameters;
-  float kd = material->parameters[3];
-  float sq;
+/**
+ * Light seen from a hit, shared by the diffuse and specular terms.
+ */
+typedef struct {
+  float dist[3];  /**< Normalized direction to the light */
+  float sq;       /**< Squared distance to the light, its attenuation for directional lights */
+  double cosine;  /**< Cosine between the normal and the direction to the light, clamped to [0, 1] */
+} INCIDENCE;
 
+/**
+ * Computes the incidence of a light on a hit.
+ */
+static inline void incidence(const LIGHT* light, const float* point, const float* normal, INCIDENCE* in) {
   if(light->type == DIRECTIONAL) {
-    v_mul(-1, light->position, dist);
-    sq = 10.0f;
+    v_copy(in->dist, light->direction);
+    in->sq = light->attenuation;
   } else {
-    v_sub(light->position, intersection->point, dist);
-    sq = v_dot(dist, dist);
+    v_sub(light->position, point, in->dist);
+    in->sq = v_dot(in->dist, in->dist);
+    v_normalize(in->dist, in->dist);
   }
-  v_normalize(dist, dist);
-  diffuse = v_dot_(intersection->normal, dist)/sq * light->intensity * kd;
+  in->cosine = v_dot_(normal, in->dist);
+}
+
+/**
+ * Lambert term: diffuse color lit by the light.
+ */
+static inline void diffuse(const MATERIAL_PARAMETERS* p, const LIGHT* light, const INCIDENCE* in, float* color) {
+  float diffuse = in->cosine/in->sq * p->kd;
 
-  v_mulv(diffuse_color, light->color, color);
+  v_mulv(p->diffuse_color, light->radiance, color);
   v_mul(diffuse, color, color);
+}
+
+/**
+ * Specular highlight of a light, added to the color.
+ * @param sq        Squared distance to the light
+ * @param alignment Cosine between the reflected direction of the light and the view, clamped to [0, 1]
+ */
+static inline void highlight(const MATERIAL_PARAMETERS* p, const LIGHT* light, float sq, double alignment, float* color) {
+  float term[3];
+  float specular = (p->ks > 0) ? pow(alignment, p->ks) : 0;
+
+  v_mul(specular/sq * light->intensity * sqrtf(p->ks), p->specular_color, term);
+  v_add(color, term, color);
+}
+
+/**
+ * Phong term: specular highlight of the light, added to the color.
+ * @param direction Direction of the ray which hit
+ */
+static inline void specular(const MATERIAL_PARAMETERS* p, const LIGHT* light, const INCIDENCE* in,
+                            const float* normal, const float* direction, float* color) {
+  float view[3];       // distance to eye
+  float reflection[3]; // reflected ray
+
+  v_mul(-1, direction, view);
 
-  if(material->texture != NULL && material->texture->data != NULL) {
-    float texture_color[3];
-    image_getpixelf(material->texture,
-      material->texture->width*intersection->texture[0], 
-      material->texture->height*intersection->texture[1],
-      texture_color);
-    //v_mul(1.0f/255, texture_color, texture_color);
-    v_clamp(texture_color, 0.0f, 1.0f, texture_color);
-    //v_mul(1.0f/4.0f, texture_color, texture_color);
+  // reflection = normalize(2*cosine*normal - dist)
+  v_mul(2*in->cosine, normal, reflection);
+  v_sub(reflection, in->dist, reflection);
+  v_normalize(reflection, reflection);
+
+  highlight(p, light, in->sq, v_dot_(reflection, view), color);
+}
+
+/**
+ * Shades a hit, specialized for each shading model by a constant phong.
+ */
+static inline float* shade(MATERIAL* material, RAY_INTERSECTION* intersection, LIGHT* light, float* color, bool phong) {
+  float texture_color[3];
+  INCIDENCE in;
+
+  incidence(light, intersection->point, intersection->normal, &in);
+  diffuse(material->parameters, light, &in, color);
+
+  if(material->texture != NULL) {
+    // the level of detail follows the width of the ray footprint
+    texture_sample(material->texture, intersection->texture[0], intersection->texture[1],
+                   texture_lod(material->texture, intersection->texture[2]), texture_color);
     v_mulv(color, texture_color, color);
-    //v_copy(color, texture_color);
   }
 
+  // the highlight is not textured
+  if(phong)
+    specular(material->parameters, light, &in, intersection->normal, intersection->ray->direction, color);
   return color;
 }
 
-float* Phong(MATERIAL* material, RAY_INTERSECTION* intersection, LIGHT* light, float* color) {
-  float dist[3];       // distance to light
-  float view[3];       // distance to eye
-  float reflection[3]; // reflected ray
-  float diffuse;       // diffuse component
-  float specular;      // specular component
-  // material parameters
-  float* specular_color = &material->parameters[4];
-  float ks = material->parameters[7]; // specular coeficient
-  float sq;
+float* material_shade(MATERIAL* material, RAY_INTERSECTION* intersection, LIGHT* light, float* color) {
+  switch(material->kind) {
+    case MATERIAL_PHONG:
+      return shade(material, intersection, light, color, true);
+    case MATERIAL_LAMBERT:
+    default:
+      return shade(material, intersection, light, color, false);
+  }
+}
 
-  Lambert(material, intersection, light, color);
+void material_batch_add(MATERIAL_BATCH* batch, RAY_INTERSECTION* intersection) {
+  int i = batch->n++;
+  int k;
 
-  if(light->type == DIRECTIONAL) {
-    v_mul(-1, light->position, dist);
-    sq = 10.0f;
-  } else {
-    v_sub(light->position, intersection->point, dist);
-    sq = v_dot(dist, dist);
+  for(k = 0; k < 3; k++) {
+    batch->point[k][i] = intersection->point[k];
+    batch->normal[k][i] = intersection->normal[k];
+    batch->direction[k][i] = intersection->ray->direction[k];
+    batch->texture[k][i] = intersection->texture[k];
   }
-  v_normalize(dist, dist);
-  diffuse = v_dot_(intersection->normal, dist);
+  batch->textured = false;
+}
 
-  v_mul(-1, intersection->ray->direction, view);
+/**
+ * Incidence of a light on the hits of a batch.
+ */
+typedef struct {
+  float sq[MATERIAL_BATCH_SIZE];        /**< Squared distances to the light */
+  float cosine[MATERIAL_BATCH_SIZE];    /**< Cosines between the normals and the directions to the light, clamped to [0, 1] */
+  float alignment[MATERIAL_BATCH_SIZE]; /**< Cosines between the reflected directions of the light and the views, clamped to [0, 1] */
+} INCIDENCE_BATCH;
 
-  // reflection = normalize(2*diffuse*normal - dist)
-  v_mul(2*diffuse, intersection->normal, reflection);
-  v_sub(reflection, dist, reflection);
-  v_normalize(reflection, reflection);
+/**
+ * Computes the incidence of a light on the hits of a batch, SIMD_WIDTH
+ * hits at a time, with the same float operations as incidence and
+ * specular. The lanes past the last hit stay in the arrays of the batch,
+ * MATERIAL_BATCH_SIZE being a multiple of SIMD_WIDTH, and are ignored.
+ * @param phong Computes the alignments of the reflections with the views
+ */
+static inline void incidence_batch(const LIGHT* light, const MATERIAL_BATCH* batch, bool phong, INCIDENCE_BATCH* in) {
+  SIMD_FLOAT zero = s_set1(0.0f);
+  SIMD_FLOAT one = s_set1(1.0f);
+  SIMD_FLOAT normal[3], dist[3], view[3], reflection[3];
+  SIMD_FLOAT sq, cosine, inverse;
+  int i, k;
 
-  specular = (ks > 0) ? pow(v_dot_(reflection, view), ks) : 0;
+  for(i = 0; i < batch->n; i += SIMD_WIDTH) {
+    for(k = 0; k < 3; k++)
+      normal[k] = s_load(&batch->normal[k][i]);
+    if(light->type == DIRECTIONAL) {
+      for(k = 0; k < 3; k++)
+        dist[k] = s_set1(light->direction[k]);
+      sq = s_set1(light->attenuation);
+    } else {
+      for(k = 0; k < 3; k++)
+        dist[k] = s_sub(s_set1(light->position[k]), s_load(&batch->point[k][i]));
+      sq = s_dot(dist, dist);
+      inverse = s_div(one, s_sqrt(sq));
+      for(k = 0; k < 3; k++)
+        dist[k] = s_mul(dist[k], inverse);
+    }
+    cosine = s_max(s_min(s_dot(normal, dist), one), zero);
+    s_store(&in->sq[i], sq);
+    s_store(&in->cosine[i], cosine);
 
-  v_mul(specular/sq * light->intensity * sqrtf(ks), specular_color, dist);
-  v_add(color, dist, color);
-  return color;
+    if(phong) {
+      // reflection = normalize(2*cosine*normal - dist)
+      for(k = 0; k < 3; k++) {
+        view[k] = s_mul(s_load(&batch->direction[k][i]), s_set1(-1.0f));
+        reflection[k] = s_sub(s_mul(normal[k], s_add(cosine, cosine)), dist[k]);
+      }
+      inverse = s_div(one, s_sqrt(s_dot(reflection, reflection)));
+      for(k = 0; k < 3; k++)
+        reflection[k] = s_mul(reflection[k], inverse);
+      s_store(&in->alignment[i], s_max(s_min(s_dot(reflection, view), one), zero));
+    }
+  }
+}
+
+/**
+ * Shades every hit of a batch, specialized for each shading model by a
+ * constant phong. The incidences are computed SIMD_WIDTH hits at a time,
+ * the diffuse and specular terms, which take double precision, hit by hit.
+ */
+static inline void shade_batch(MATERIAL* material, MATERIAL_BATCH* batch, LIGHT* light, bool phong) {
+  const MATERIAL_PARAMETERS* p = material->parameters;
+  float color[3];
+  INCIDENCE_BATCH incidences;
+  INCIDENCE in;
+  int i, k;
+
+  // the texture colors do not depend on the light
+  if(material->texture != NULL && !batch->textured) {
+    for(i = 0; i < batch->n; i++) {
+      texture_sample(material->texture, batch->texture[0][i], batch->texture[1][i],
+                     texture_lod(material->texture, batch->texture[2][i]), color);
+      for(k = 0; k < 3; k++)
+        batch->texel[k][i] = color[k];
+    }
+    batch->textured = true;
+  }
+
+  incidence_batch(light, batch, phong, &incidences);
+  for(i = 0; i < batch->n; i++) {
+    in.sq = incidences.sq[i];
+    in.cosine = incidences.cosine[i];
+    diffuse(p, light, &in, color);
+
+    if(material->texture != NULL) {
+      for(k = 0; k < 3; k++)
+        color[k] *= batch->texel[k][i];
+    }
+
+    if(phong)
+      highlight(p, light, in.sq, incidences.alignment[i], color);
+    for(k = 0; k < 3; k++)
+      batch->color[k][i] = color[k];
+  }
+}
+
+void material_shade_batch(MATERIAL* material, MATERIAL_BATCH* batch, LIGHT* light) {
+  switch(material->kind) {
+    case MATERIAL_PHONG:
+      shade_batch(material, batch, light, true);
+      break;
+    case MATERIAL_LAMBERT:
+    default:
+      shade_batch(material, batch, light, false);
+      break;
+  }
 }
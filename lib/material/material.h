@@ -1,5 +1,5 @@
 /**!
- * Defines a simple Material structure and some material shading functions.
+ * Defines a simple Material structure and the material shading kernels.
  */
 #ifndef MATERIAL_H_
 #define MATERIAL_H_
@@ -7,40 +7,86 @@
 #include "light.h"
 #include "ray.h"
 
-struct IMAGE;
+struct TEXTURE;
 
 /**
- * Simple Material structure that contains the material parameters
- * and a material shading function.
+ * Shading models of the materials.
+ */
+typedef enum {
+  MATERIAL_LAMBERT, /**< diffuse only */
+  MATERIAL_PHONG,   /**< diffuse and specular */
+  MATERIAL_KINDS
+} MATERIAL_KIND;
+
+/**
+ * Parameters of the shading models. Lambert only uses the diffuse ones,
+ * and a scene gives them in this order.
+ */
+typedef struct {
+  float diffuse_color[3];
+  float kd;                /**< diffuse coefficient */
+  float specular_color[3];
+  float ks;                /**< specular exponent */
+} MATERIAL_PARAMETERS;
+
+/**
+ * Simple Material structure that contains the shading model of a material
+ * and its parameters.
  */
 typedef struct MATERIAL {
+  MATERIAL_KIND kind;
   float reflectance;
-  float* parameters;
-  struct IMAGE* texture;
-  float*(*function)(struct MATERIAL*, RAY_INTERSECTION*, LIGHT*, float*); /**< shading function */
+  MATERIAL_PARAMETERS* parameters; /**< parameters, shared by the solids of a same material */
+  struct TEXTURE* texture;         /**< texture, shared with other materials, or NULL */
 } MATERIAL;
 
-#define LAMBERT Lambert
 /**
- * Lambert shading model.
- * Its parameters are: {[diffuse color], diffuse coefficient}
- * @param parameters   Material parameters
+ * Shades a hit for a light with the shading model of its material. The
+ * direction and distance of the light are computed once and shared by the
+ * diffuse and specular terms.
+ * @param material     Material of the hit
  * @param intersection Ray intersection data
  * @param light        Light currently tested
  * @param color        Resulting color
+ * @return color
+ */
+float* material_shade(MATERIAL* material, RAY_INTERSECTION* intersection, LIGHT* light, float* color);
+
+/**
+ * Number of hits a batch of shading holds.
  */
-float* Lambert(MATERIAL* material, RAY_INTERSECTION* intersection, LIGHT* light, float* color);
+#define MATERIAL_BATCH_SIZE 64
 
-#define PHONG Phong
 /**
- * Phong shading model.
- * Its parameters are: {[diffuse color], diffuse coefficient,
- [specular color], specular coefficient}
- * @param parameters   Material parameters
+ * Hits of a same material shaded together, stored as structures of arrays
+ * so that the shading kernels run the same operations over every hit.
+ */
+typedef struct {
+  int n;                                  /**< Number of hits */
+  float point[3][MATERIAL_BATCH_SIZE];    /**< Intersection points */
+  float normal[3][MATERIAL_BATCH_SIZE];   /**< Normals at the intersection points */
+  float direction[3][MATERIAL_BATCH_SIZE];/**< Directions of the rays which hit */
+  float texture[3][MATERIAL_BATCH_SIZE];  /**< Texture coordinates and footprints */
+  float texel[3][MATERIAL_BATCH_SIZE];    /**< Texture colors, once sampled */
+  bool textured;                          /**< The texture colors were sampled */
+  float color[3][MATERIAL_BATCH_SIZE];    /**< Resulting colors */
+} MATERIAL_BATCH;
+
+/**
+ * Adds a hit to a batch of shading.
+ * @param batch        Batch, with room for one more hit
  * @param intersection Ray intersection data
- * @param light        Light currently tested
- * @param color        Resulting color
  */
-float* Phong(MATERIAL* material, RAY_INTERSECTION* intersection, LIGHT* light, float* color);
+void material_batch_add(MATERIAL_BATCH* batch, RAY_INTERSECTION* intersection);
+
+/**
+ * Shades every hit of a batch for a light with the shading model of a
+ * material, the directions and cosines of the light SIMD_WIDTH hits at a
+ * time. The colors are the ones material_shade gives for each hit.
+ * @param material Material of every hit of the batch
+ * @param batch    Batch
+ * @param light    Light currently tested
+ */
+void material_shade_batch(MATERIAL* material, MATERIAL_BATCH* batch, LIGHT* light);
 
 #endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "texture.h"
+#include "image.h"
+
+const u_char texture_morton[TEXTURE_TILE] = { 0, 1, 4, 5, 16, 17, 20, 21 };
+
+/**
+ * Number of texels of a level, rounded up to whole tiles.
+ */
+static size_t level_size(int width, int height) {
+  size_t tiles_x = (width + TEXTURE_TILE - 1)/TEXTURE_TILE;
+  size_t tiles_y = (height + TEXTURE_TILE - 1)/TEXTURE_TILE;
+  return tiles_x * tiles_y * TEXTURE_TILE*TEXTURE_TILE;
+}
+
+size_t texture_size(int width, int height) {
+  size_t n = 0;
+
+  for(;;) {
+    n += level_size(width, height);
+    if(width == 1 && height == 1)
+      return n;
+    width = (width > 1) ? width/2 : 1;
+    height = (height > 1) ? height/2 : 1;
+  }
+}
+
+void texture_init(TEXTURE* texture, int width, int height, u_int* texels) {
+  TEXTURE_LEVEL* level;
+
+  texture->width = width;
+  texture->height = height;
+  texture->texels = texels;
+  texture->n_levels = 0;
+  for(;;) {
+    level = &texture->levels[texture->n_levels++];
+    level->width = width;
+    level->height = height;
+    level->tiles = (width + TEXTURE_TILE - 1)/TEXTURE_TILE;
+    level->texels = texels;
+    texels += level_size(width, height);
+    if(width == 1 && height == 1)
+      return;
+    width = (width > 1) ? width/2 : 1;
+    height = (height > 1) ? height/2 : 1;
+  }
+}
+
+void texture_build(TEXTURE* texture, const IMAGE* img) {
+  const TEXTURE_LEVEL* src;
+  TEXTURE_LEVEL* dst;
+  u_int p[4];
+  u_int r, g, b;
+  int x, y, x1, y1, i, k;
+
+  dst = &texture->levels[0];
+  for(y = 0; y < dst->height; y++)
+  for(x = 0; x < dst->width; x++)
+    texture_texel(dst, x, y) = image_pixel(img, x, y);
+
+  // 2x2 box filter, the last row or column of odd sizes is dropped
+  for(i = 1; i < texture->n_levels; i++) {
+    src = &texture->levels[i - 1];
+    dst = &texture->levels[i];
+    for(y = 0; y < dst->height; y++)
+    for(x = 0; x < dst->width; x++) {
+      x1 = (2*x + 1 < src->width) ? 2*x + 1 : 2*x;
+      y1 = (2*y + 1 < src->height) ? 2*y + 1 : 2*y;
+      p[0] = texture_texel(src, 2*x, 2*y);
+      p[1] = texture_texel(src, x1, 2*y);
+      p[2] = texture_texel(src, 2*x, y1);
+      p[3] = texture_texel(src, x1, y1);
+      r = g = b = 2;
+      for(k = 0; k < 4; k++) {
+        r += (p[k] >> 16) & 0xff;
+        g += (p[k] >> 8) & 0xff;
+        b += p[k] & 0xff;
+      }
+      texture_texel(dst, x, y) = ((r/4) << 16) | ((g/4) << 8) | (b/4);
+    }
+  }
+}
+
+TEXTURE* texture(const IMAGE* img) {
+  TEXTURE* texture = (TEXTURE*)malloc(sizeof(TEXTURE));
+  u_int* texels;
+
+  if(posix_memalign((void**)&texels, IMAGE_ALIGNMENT, sizeof(u_int) * texture_size(img->width, img->height)) != 0) {
+    fprintf(stderr, "Error while allocating a %dx%d texture\n", img->width, img->height);
+    exit(1);
+  }
+  texture_init(texture, img->width, img->height, texels);
+  texture_build(texture, img);
+  return texture;
+}
+
+void texture_free(TEXTURE* texture) {
+  free(texture->texels);
+  free(texture);
+}
+
+float texture_lod(const TEXTURE* texture, float footprint) {
+  int size = (texture->width > texture->height) ? texture->width : texture->height;
+  float texels = footprint * size;
+  return (texels > 1.0f) ? log2f(texels) : 0.0f;
+}
+
+/**
+ * Bilinear filtering of the 4 texels of a level nearest to some texture
+ * coordinates, adding the weighted color to rgb.
+ */
+static void bilinear(const TEXTURE_LEVEL* level, float u, float v, float weight, float* rgb) {
+  float x = u*level->width - 0.5f;
+  float y = v*level->height - 0.5f;
+  int x0 = (int)floorf(x);
+  int y0 = (int)floorf(y);
+  float fx = x - x0;
+  float fy = y - y0;
+  int x1 = x0 + 1;
+  int y1 = y0 + 1;
+  u_int p[4];
+  float w[4];
+  int k;
+
+  x0 = (x0 < 0) ? 0 : (x0 >= level->width) ? level->width - 1 : x0;
+  x1 = (x1 < 0) ? 0 : (x1 >= level->width) ? level->width - 1 : x1;
+  y0 = (y0 < 0) ? 0 : (y0 >= level->height) ? level->height - 1 : y0;
+  y1 = (y1 < 0) ? 0 : (y1 >= level->height) ? level->height - 1 : y1;
+
+  p[0] = texture_texel(level, x0, y0);
+  p[1] = texture_texel(level, x1, y0);
+  p[2] = texture_texel(level, x0, y1);
+  p[3] = texture_texel(level, x1, y1);
+  w[0] = (1 - fx)*(1 - fy)*weight/255.0f;
+  w[1] = fx*(1 - fy)*weight/255.0f;
+  w[2] = (1 - fx)*fy*weight/255.0f;
+  w[3] = fx*fy*weight/255.0f;
+  for(k = 0; k < 4; k++) {
+    rgb[0] += w[k] * ((p[k] >> 16) & 0xff);
+    rgb[1] += w[k] * ((p[k] >> 8) & 0xff);
+    rgb[2] += w[k] * (p[k] & 0xff);
+  }
+}
+
+void texture_sample(const TEXTURE* texture, float u, float v, float lod, float* rgb) {
+  int level;
+  float f;
+
+  rgb[0] = rgb[1] = rgb[2] = 0.0f;
+  if(lod >= texture->n_levels - 1) {
+    bilinear(&texture->levels[texture->n_levels - 1], u, v, 1.0f, rgb);
+    return;
+  }
+  if(lod < 0.0f)
+    lod = 0.0f;
+
+  level = (int)lod;
+  f = lod - level;
+  bilinear(&texture->levels[level], u, v, 1.0f - f, rgb);
+  if(f > 0.0f)
+    bilinear(&texture->levels[level + 1], u, v, f, rgb);
+}
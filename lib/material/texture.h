@@ -0,0 +1,111 @@
+/**!
+ * Defines a mipmapped texture built from an image, with bilinear and
+ * trilinear filtering.
+ */
+#ifndef TEXTURE_H_
+#define TEXTURE_H_
+
+#include <sys/types.h>
+
+struct IMAGE;
+
+/**
+ * Side of the square tiles the texels of a level are stored in.
+ */
+#define TEXTURE_TILE 8
+#define TEXTURE_MAX_LEVELS 32
+
+/**
+ * Level of the mip chain of a texture. Texels are stored tile after tile,
+ * row by row, and in Morton order inside a tile, so that the texels a
+ * filter reads are close in memory whatever the direction of the rays.
+ */
+typedef struct {
+  int width;
+  int height;
+  int tiles;     /**< Number of tiles in a row */
+  u_int* texels; /**< Texels as an u_int representing 3 u_char {r, g, b} */
+} TEXTURE_LEVEL;
+
+/**
+ * Texture data type. Every level lives in a single block of texels, which
+ * can be shared by any number of materials.
+ */
+typedef struct TEXTURE {
+  int width;
+  int height;
+  int n_levels;
+  TEXTURE_LEVEL levels[TEXTURE_MAX_LEVELS]; /**< Levels from full size down to 1x1 */
+  u_int* texels;                            /**< Block holding the texels of every level */
+} TEXTURE;
+
+/**
+ * Texel of a level at the given coordinates, as an lvalue.
+ */
+#define texture_texel(level, x, y) \
+  ((level)->texels[((size_t)((y)/TEXTURE_TILE)*(level)->tiles + (x)/TEXTURE_TILE)*TEXTURE_TILE*TEXTURE_TILE + \
+                   texture_morton[(x)%TEXTURE_TILE] + 2*texture_morton[(y)%TEXTURE_TILE]])
+
+/**
+ * Spreads the bits of a coordinate inside a tile to the even bits of its
+ * Morton index.
+ */
+extern const u_char texture_morton[TEXTURE_TILE];
+
+/**
+ * Returns the number of texels of the block of a texture, every level
+ * included.
+ * @param width,height Size of the texture
+ */
+size_t texture_size(int width, int height);
+
+/**
+ * Lays out the levels of a texture in a block of texels, without touching
+ * the texels, for instance to use a block read from a file.
+ * @param texture      Texture
+ * @param width,height Size of the texture
+ * @param texels       Block of texture_size(width, height) texels
+ */
+void texture_init(TEXTURE* texture, int width, int height, u_int* texels);
+
+/**
+ * Fills the levels of a texture laid out by texture_init from an image of
+ * the same size, each level being the 2x2 box filtered previous one.
+ * @param texture Texture
+ * @param img     Image
+ */
+void texture_build(TEXTURE* texture, const struct IMAGE* img);
+
+/**
+ * Creates the texture of an image.
+ * @param img Image
+ * @return Pointer to the allocated texture
+ */
+TEXTURE* texture(const struct IMAGE* img);
+
+/**
+ * Destroys a texture created by texture() and its texels.
+ * @param texture Texture to be destroyed
+ */
+void texture_free(TEXTURE* texture);
+
+/**
+ * Returns the level of detail matching the width of a ray footprint.
+ * @param texture   Texture
+ * @param footprint Width of the footprint in texture coordinates
+ * @return Level of detail, 0 for the full size level
+ */
+float texture_lod(const TEXTURE* texture, float footprint);
+
+/**
+ * Samples a texture at some texture coordinates, clamped to the edges.
+ * Levels of detail between two levels are filtered trilinearly, others
+ * bilinearly.
+ * @param texture Texture
+ * @param u,v     Texture coordinates, between 0.0f and 1.0f
+ * @param lod     Level of detail
+ * @param rgb     Resulting color, between 0.0f and 1.0f
+ */
+void texture_sample(const TEXTURE* texture, float u, float v, float lod, float* rgb);
+
+#endif
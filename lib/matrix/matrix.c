@@ -0,0 +1,91 @@
+#include <string.h>
+#include <math.h>
+#include "matrix.h"
+
+void matrix_identity(MATRIX M) {
+  memset(M, 0, sizeof(float)*MATRIX_SIZE);
+  M[0] = M[4] = M[8] = 1.0f;
+}
+
+void matrix_mulm(const MATRIX A, const MATRIX B, MATRIX M) {
+  float r[MATRIX_SIZE];
+  int i, j;
+
+  for(j = 0; j < 4; j++)
+  for(i = 0; i < 3; i++)
+    r[j*3 + i] = A[i]*B[j*3] + A[3 + i]*B[j*3 + 1] + A[6 + i]*B[j*3 + 2];
+  // B's translation is a point, A's translation applies to it
+  for(i = 0; i < 3; i++)
+    r[9 + i] += A[9 + i];
+  m_copy(r, M);
+}
+
+float matrix_inverse(const MATRIX A, MATRIX M) {
+  float r[MATRIX_SIZE];
+  float det, inv;
+  int i;
+
+  // the inverse of the linear part is its adjugate over its determinant
+  r[0] = A[4]*A[8] - A[7]*A[5];
+  r[1] = A[7]*A[2] - A[1]*A[8];
+  r[2] = A[1]*A[5] - A[4]*A[2];
+  r[3] = A[6]*A[5] - A[3]*A[8];
+  r[4] = A[0]*A[8] - A[6]*A[2];
+  r[5] = A[3]*A[2] - A[0]*A[5];
+  r[6] = A[3]*A[7] - A[6]*A[4];
+  r[7] = A[6]*A[1] - A[0]*A[7];
+  r[8] = A[0]*A[4] - A[3]*A[1];
+  det = A[0]*r[0] + A[3]*r[1] + A[6]*r[2];
+  if(det == 0.0f)
+    return det;
+
+  inv = 1.0f/det;
+  for(i = 0; i < 9; i++)
+    r[i] *= inv;
+  // the translation is undone after the linear part
+  r[9] = -(r[0]*A[9] + r[3]*A[10] + r[6]*A[11]);
+  r[10] = -(r[1]*A[9] + r[4]*A[10] + r[7]*A[11]);
+  r[11] = -(r[2]*A[9] + r[5]*A[10] + r[8]*A[11]);
+  m_copy(r, M);
+  return det;
+}
+
+void matrix_translation(const float* t, MATRIX M) {
+  matrix_identity(M);
+  M[9] = t[0];
+  M[10] = t[1];
+  M[11] = t[2];
+}
+
+void matrix_scaling(const float* s, MATRIX M) {
+  matrix_identity(M);
+  M[0] = s[0];
+  M[4] = s[1];
+  M[8] = s[2];
+}
+
+void matrix_rotation(const float* q, MATRIX M) {
+  float x = q[0], y = q[1], z = q[2], w = q[3];
+
+  matrix_identity(M);
+  M[0] = 1 - 2*(y*y + z*z);
+  M[1] = 2*(x*y + z*w);
+  M[2] = 2*(x*z - y*w);
+  M[3] = 2*(x*y - z*w);
+  M[4] = 1 - 2*(x*x + z*z);
+  M[5] = 2*(y*z + x*w);
+  M[6] = 2*(x*z + y*w);
+  M[7] = 2*(y*z - x*w);
+  M[8] = 1 - 2*(x*x + y*y);
+}
+
+void matrix_quaternion(const float* axis, float degrees, float* q) {
+  float length = sqrtf(axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2]);
+  float half = degrees*(float)M_PI/360.0f;
+  float s = (length > 0.0f) ? sinf(half)/length : 0.0f;
+
+  q[0] = axis[0]*s;
+  q[1] = axis[1]*s;
+  q[2] = axis[2]*s;
+  q[3] = cosf(half);
+}
@@ -1,7 +1,7 @@
 /**
- * Defines 3D Matrix algebra and manipulation macros and functions.
+ * Defines 3D affine matrix algebra and manipulation macros and functions.
  * All of the matrix algebra functions and macros take as last argument
- * the matrix where to store the result of the operation.
+ * the matrix or vector where to store the result of the operation.
  */
 #ifndef MATRIX_H_
 #define MATRIX_H_
@@ -11,75 +11,113 @@
 #define MATRIX float*
 
 /*
-Matrix:
-  _u_v_w_
-  |0|3|6|
-  |1|4|7|
-  |2|5|8|
-  ¨¨¨¨¨¨¨
+Matrix, a linear part u,v,w and a translation t:
+  _u_v_w_t__
+  |0|3|6|9 |
+  |1|4|7|10|
+  |2|5|8|11|
+  ¨¨¨¨¨¨¨¨¨¨
 */
+#define MATRIX_SIZE 12
 
-// Aliases for matrix functions and macros using the v_ prefix.
+// Aliases for matrix functions and macros using the m_ prefix.
 #define m_copy matrix_copy
-#define m_set matrix_set
-#define m_add matrix_add
-#define m_sub matrix_sub
-#define m_mul matrix_mul
+#define m_identity matrix_identity
 #define m_mulm matrix_mulm
+#define m_point matrix_point
+#define m_vector matrix_vector
+#define m_normal matrix_normal
 
 /**
- * Copies the value of a vector to another vector
- * @param A Destination matrix
- * @param B Source matrix
+ * Copies the value of a matrix to another matrix
+ * @param A Source matrix
+ * @param M Destination matrix
  */
-#define matrix_copy(A, B) \
-  memcpy(A, B, sizeof(float)*3);
+#define matrix_copy(A, M) \
+  memcpy((M), (A), sizeof(float)*MATRIX_SIZE)
 
 /**
- * Sets a matrix components.
- * @param A     Matrix
- * @param u,v,w Vectors
+ * Transforms a point, translation included.
+ * @param M Matrix
+ * @param p Input point
+ * @param r Result point, different from p
  */
-#define matrix_set(A, u, v, w) \
-  v_copy(&A[0], u); \
-  v_copy(&A[3], v); \
-  v_copy(&A[6], w)
+#define matrix_point(M, p, r) \
+  (r)[0] = (M)[0]*(p)[0] + (M)[3]*(p)[1] + (M)[6]*(p)[2] + (M)[9]; \
+  (r)[1] = (M)[1]*(p)[0] + (M)[4]*(p)[1] + (M)[7]*(p)[2] + (M)[10]; \
+  (r)[2] = (M)[2]*(p)[0] + (M)[5]*(p)[1] + (M)[8]*(p)[2] + (M)[11]
 
 /**
- * Adds two matrices and takes the result into another matrix.
+ * Transforms a vector by the linear part of a matrix.
+ * @param M Matrix
+ * @param v Input vector
+ * @param r Result vector, different from v
+ */
+#define matrix_vector(M, v, r) \
+  (r)[0] = (M)[0]*(v)[0] + (M)[3]*(v)[1] + (M)[6]*(v)[2]; \
+  (r)[1] = (M)[1]*(v)[0] + (M)[4]*(v)[1] + (M)[7]*(v)[2]; \
+  (r)[2] = (M)[2]*(v)[0] + (M)[5]*(v)[1] + (M)[8]*(v)[2]
+
+/**
+ * Transforms a normal by the transpose of the linear part of the inverse
+ * of a matrix, the result is not normalized.
+ * @param I Inverse of the matrix
+ * @param n Input normal
+ * @param r Result normal, different from n
+ */
+#define matrix_normal(I, n, r) \
+  (r)[0] = (I)[0]*(n)[0] + (I)[1]*(n)[1] + (I)[2]*(n)[2]; \
+  (r)[1] = (I)[3]*(n)[0] + (I)[4]*(n)[1] + (I)[5]*(n)[2]; \
+  (r)[2] = (I)[6]*(n)[0] + (I)[7]*(n)[1] + (I)[8]*(n)[2]
+
+/**
+ * Sets a matrix to the identity.
+ * @param M Result matrix
+ */
+void matrix_identity(MATRIX M);
+
+/**
+ * Multiplies two matrices, the result applies B then A.
  * @param A,B Input matrices
- * @param M   Result matrix
+ * @param M   Result matrix, which may be A or B
+ */
+void matrix_mulm(const MATRIX A, const MATRIX B, MATRIX M);
+
+/**
+ * Inverts a matrix.
+ * @param A Input matrix
+ * @param M Result matrix, which may be A
+ * @return Determinant of the linear part of A, M is not set when it is 0
  */
-#define matrix_add(A, B, M) \
-  matrix_set((A), (u)[0] + (v)[0], (u)[1] + (v)[1], (u)[2] + (v)[2])
+float matrix_inverse(const MATRIX A, MATRIX M);
+
 /**
- * Subtracts two matrices and takes the result into another matrix.
- * @param u,v Input matrices
- * @param r   Result matrix
+ * Sets a matrix to a translation.
+ * @param t Translation vector
+ * @param M Result matrix
  */
-#define matrix_sub(u, v, r) \
-  matrix_set((r), (u)[0] - (v)[0], (u)[1] - (v)[1], (u)[2] - (v)[2])
+void matrix_translation(const float* t, MATRIX M);
+
 /**
- * Multiplies a matrix by a scalar value.
- * @param s Scalar
- * @param v Input matrix
- * @param r Result matrix
+ * Sets a matrix to a scaling along each axis.
+ * @param s Scale factors
+ * @param M Result matrix
  */
-#define matrix_mul(s, v, r) \
-  matrix_set((r), ((v)[0])*(s), ((v)[1])*(s), ((v)[2])*(s))
+void matrix_scaling(const float* s, MATRIX M);
+
 /**
- * Multiplies two matrices and takes the result into another matrix.
- * @param u,v Input matrices
- * @param r   Result matrix
+ * Sets a matrix to a rotation.
+ * @param q Unit quaternion {x, y, z, w}
+ * @param M Result matrix
  */
-#define matrix_mulm(u, v, r) \
-  matrix_set((r), (u)[0] * (v)[0], (u)[1] * (v)[1], (u)[2] * (v)[2])
+void matrix_rotation(const float* q, MATRIX M);
 
 /**
- * Copies the value of a matrix to another matrix
- * @param u Result matrix
- * @param v Vector to be copied
+ * Computes the unit quaternion of a rotation around an axis.
+ * @param axis    Rotation axis, not necessarily normalized
+ * @param degrees Rotation angle
+ * @param q       Resulting quaternion {x, y, z, w}
  */
-void matrix_copy(VECTOR u, const VECTOR v);
+void matrix_quaternion(const float* axis, float degrees, float* q);
 
 #endif
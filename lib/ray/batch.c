@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "vector.h"
+#include "simd.h"
+#include "scene.h"
+#include "ray.h"
+#include "packet.h"
+#include "batch.h"
+#include "stats.h"
+
+/**
+ * Hit of a ray, sorted by the material which shades it.
+ */
+typedef struct {
+  MATERIAL* material;
+  int index;          /**< Index of the ray */
+} SHADING_HIT;
+
+/**
+ * Rays of a same depth of the wavefront, with one array per stage. Only
+ * the colors, parents and reflectances are kept once the rays of the next
+ * depth are spawned, until the reflected colors are folded back.
+ */
+typedef struct {
+  int n;
+  RAY* rays;
+  float (*origins)[3];             /**< Origins the rays point to */
+  RAY_INTERSECTION* intersections;
+  SHADING_HIT* hits;               /**< Rays which hit a solid, sorted by material */
+  int n_hits;
+
+  float (*colors)[3];              /**< Colors of the rays, without their reflections until folded */
+  int* parents;                    /**< Ray of the previous depth each ray reflects */
+  float* reflectances;             /**< Reflectance of the surface each ray reflects off */
+} RAY_QUEUE;
+
+/**
+ * Tells whether two materials shade every hit the same way.
+ */
+static bool same_shading(const MATERIAL* a, const MATERIAL* b) {
+  return a->kind == b->kind && a->parameters == b->parameters && a->texture == b->texture;
+}
+
+/**
+ * Orders hits by shading model, parameters and texture, then by ray,
+ * so that the hits of a same material follow each other.
+ */
+static int compare_hits(const void* a, const void* b) {
+  const SHADING_HIT* x = (const SHADING_HIT*)a;
+  const SHADING_HIT* y = (const SHADING_HIT*)b;
+  size_t keys[3][2] = {
+    { (size_t)x->material->kind, (size_t)y->material->kind },
+    { (size_t)x->material->parameters, (size_t)y->material->parameters },
+    { (size_t)x->material->texture, (size_t)y->material->texture }
+  };
+  int k;
+
+  for(k = 0; k < 3; k++) {
+    if(keys[k][0] != keys[k][1])
+      return (keys[k][0] < keys[k][1]) ? -1 : 1;
+  }
+  return x->index - y->index;
+}
+
+/**
+ * Shades the hits of a batch for every light chosen for them, adding the
+ * weighted colors of the hits each light reaches. The hits which chose a
+ * light are shaded together, in a smaller batch when some did not.
+ * @param hits Hits of the batch, sharing the same shading
+ */
+static void shade_batch(RAY* rays, RAY_INTERSECTION* intersections, SHADING_HIT* hits, int n,
+                        SCENE* scene, float (*colors)[3]) {
+  MATERIAL_BATCH batch, subset;
+  MATERIAL_BATCH* shaded;
+  RAY shadows[SIMD_WIDTH];
+  float distance[SIMD_WIDTH];
+  int index[SIMD_WIDTH];
+  int lit[MATERIAL_BATCH_SIZE];
+  int chosen[MATERIAL_BATCH_SIZE];
+  float weight[MATERIAL_BATCH_SIZE];
+  size_t n_samples[MATERIAL_BATCH_SIZE], next[MATERIAL_BATCH_SIZE];
+  LIGHT_SAMPLE samples[MATERIAL_BATCH_SIZE][LIGHT_MAX_SAMPLES];
+  LIGHT_SAMPLE sample;
+  int i, j, k, m, c, n_chosen, blocked;
+  double start;
+  LIGHT* l;
+  RAY_OCCLUDER* occluder;
+
+  batch.n = 0;
+  for(i = 0; i < n; i++) {
+    j = hits[i].index;
+    material_batch_add(&batch, &intersections[j]);
+    n_samples[i] = scene_lights(scene, intersections[j].point, intersections[j].normal, samples[i]);
+    next[i] = 0;
+  }
+
+  // the lights of each hit are in the order of the light array
+  while(true) {
+    l = NULL;
+    for(i = 0; i < n; i++) {
+      if(next[i] >= n_samples[i])
+        continue;
+      sample = scene_light(scene, samples[i], next[i]);
+      if(l == NULL || sample.light < l)
+        l = sample.light;
+    }
+    if(l == NULL)
+      break;
+
+    for(i = 0, n_chosen = 0; i < n; i++) {
+      if(next[i] >= n_samples[i])
+        continue;
+      sample = scene_light(scene, samples[i], next[i]);
+      if(sample.light != l)
+        continue;
+      weight[n_chosen] = sample.weight;
+      chosen[n_chosen++] = i;
+      next[i]++;
+    }
+    shaded = &batch;
+    if(n_chosen < n) {
+      shaded = &subset;
+      subset.n = 0;
+      for(c = 0; c < n_chosen; c++)
+        material_batch_add(&subset, &intersections[hits[chosen[c]].index]);
+    }
+
+    // cast the shadow rays of the hits towards the light in packets
+    occluder = ray_occluder(scene, l);
+    for(c = 0; c < n_chosen; c++)
+      lit[c] = 0;
+    for(c = 0; c < n_chosen;) {
+      for(m = 0; m < SIMD_WIDTH && c < n_chosen; c++) {
+        j = hits[chosen[c]].index;
+        if(ray_light(&rays[j], &intersections[j], l, &shadows[m], &distance[m]))
+          index[m++] = c;
+      }
+      if(m == 0)
+        continue;
+
+      start = stats_start();
+      blocked = ray_occluded_packet(shadows, m, scene, distance, occluder);
+      stats_time(STATS_CAST, start);
+      stats_count(STATS_SHADOW_RAYS, m);
+      for(j = 0; j < m; j++)
+        lit[index[j]] = !(blocked & (1 << j));
+    }
+
+    // every chosen hit is shaded, only the lit ones add their color
+    material_shade_batch(hits[0].material, shaded, l);
+    for(c = 0; c < n_chosen; c++) {
+      if(!lit[c])
+        continue;
+      for(k = 0; k < 3; k++)
+        colors[hits[chosen[c]].index][k] += weight[c]*shaded->color[k][c];
+    }
+  }
+}
+
+/**
+ * Casts every ray of a queue, a packet at a time, and starts their colors
+ * with the ambient color of the hits and the background of the misses.
+ */
+static void intersect(RAY_QUEUE* queue, SCENE* scene) {
+  RAY* rays = queue->rays;
+  RAY_INTERSECTION* intersections = queue->intersections;
+  int i, lane, count;
+  int active, found;
+  double start = stats_start();
+
+  queue->n_hits = 0;
+  for(i = 0; i < queue->n; i += SIMD_WIDTH) {
+    count = (queue->n - i < SIMD_WIDTH) ? queue->n - i : SIMD_WIDTH;
+    active = 0;
+    for(lane = 0; lane < count; lane++) {
+      if(rays[i + lane].iteration++ < RAY_MAX_ITERATION) {
+        active |= 1 << lane;
+        stats_depth(rays[i + lane].iteration - 1);
+      }
+    }
+
+    found = 0;
+    if(active == (1 << count) - 1) {
+      found = ray_cast_packet(&rays[i], count, scene, &intersections[i]);
+    } else {
+      for(lane = 0; lane < count; lane++) {
+        if((active & (1 << lane)) && ray_cast(&rays[i + lane], scene, &intersections[i + lane]))
+          found |= 1 << lane;
+      }
+    }
+
+    for(lane = 0; lane < count; lane++) {
+      if(found & (1 << lane)) {
+        // has ambient color
+        v_copy(queue->colors[i + lane], scene->ambient_color);
+        queue->hits[queue->n_hits].material = &intersections[i + lane].solid->material;
+        queue->hits[queue->n_hits++].index = i + lane;
+      } else {
+        v_copy(queue->colors[i + lane], scene->background_color);
+        intersections[i + lane].solid = NULL;
+      }
+    }
+  }
+  stats_time(STATS_CAST, start);
+}
+
+/**
+ * Shades the hits of a queue, the runs of a same material a batch at a
+ * time.
+ */
+static void shade(RAY_QUEUE* queue, SCENE* scene) {
+  int i, j;
+
+  qsort(queue->hits, queue->n_hits, sizeof(SHADING_HIT), compare_hits);
+  for(i = 0; i < queue->n_hits; i = j) {
+    for(j = i + 1; j < queue->n_hits && j - i < MATERIAL_BATCH_SIZE &&
+                   same_shading(queue->hits[i].material, queue->hits[j].material); j++);
+    shade_batch(queue->rays, queue->intersections, &queue->hits[i], j - i, scene, queue->colors);
+  }
+}
+
+/**
+ * Allocates the arrays of a queue of n rays.
+ */
+static void queue_alloc(RAY_QUEUE* queue, int n) {
+  queue->n = 0;
+  queue->rays = (RAY*)malloc(sizeof(RAY) * n);
+  queue->origins = (float (*)[3])malloc(sizeof(float) * 3 * n);
+  queue->colors = (float (*)[3])malloc(sizeof(float) * 3 * n);
+  queue->parents = (int*)malloc(sizeof(int) * n);
+  queue->reflectances = (float*)malloc(sizeof(float) * n);
+}
+
+/**
+ * Frees the arrays of a queue allocated by queue_alloc.
+ */
+static void queue_free(RAY_QUEUE* queue) {
+  free(queue->reflectances);
+  free(queue->parents);
+  free(queue->colors);
+  free(queue->origins);
+  free(queue->rays);
+}
+
+/**
+ * Fills the next queue with the reflections of the rays of a queue, in the
+ * order of the rays.
+ */
+static void spawn(RAY_QUEUE* queue, RAY_QUEUE* next) {
+  RAY_INTERSECTION* i;
+  RAY* ray;
+  int k;
+
+  queue_alloc(next, queue->n_hits);
+  for(k = 0; k < queue->n; k++) {
+    i = &queue->intersections[k];
+    ray = &next->rays[next->n];
+    if(i->solid == NULL || !ray_reflection(&queue->rays[k], i, ray))
+      continue;
+
+    // the intersection does not outlive this depth
+    v_copy(next->origins[next->n], i->point);
+    ray->origin = next->origins[next->n];
+    next->parents[next->n] = k;
+    next->reflectances[next->n++] = i->solid->material.reflectance;
+  }
+}
+
+void ray_trace_batch(RAY* rays, int n, SCENE* scene, float (*colors)[3]) {
+  RAY_QUEUE queues[RAY_MAX_ITERATION + 2];
+  RAY_QUEUE* queue;
+  RAY_QUEUE* parent;
+  float color[3];
+  int depth, d, i;
+
+  queues[0].n = n;
+  queues[0].rays = rays;
+  queues[0].origins = NULL;
+  queues[0].colors = colors;
+  queues[0].parents = NULL;
+  queues[0].reflectances = NULL;
+
+  // generate, intersect, shade and spawn the rays of each depth in turn
+  for(depth = 0; depth <= RAY_MAX_ITERATION && queues[depth].n > 0; depth++) {
+    queue = &queues[depth];
+    queue->intersections = (RAY_INTERSECTION*)malloc(sizeof(RAY_INTERSECTION) * queue->n);
+    queue->hits = (SHADING_HIT*)malloc(sizeof(SHADING_HIT) * queue->n);
+
+    intersect(queue, scene);
+    shade(queue, scene);
+    if(depth < RAY_MAX_ITERATION)
+      spawn(queue, &queues[depth + 1]);
+    else
+      queues[depth + 1].n = 0;
+
+    free(queue->hits);
+    free(queue->intersections);
+    if(depth > 0) {
+      free(queue->origins);
+      free(queue->rays);
+      queue->origins = NULL;
+      queue->rays = NULL;
+    }
+  }
+  // the queue which ended the wavefront holds no ray
+  if(depth > 0 && depth <= RAY_MAX_ITERATION)
+    queue_free(&queues[depth]);
+
+  // add the reflected colors, the deepest first
+  for(d = depth - 1; d > 0; d--) {
+    queue = &queues[d];
+    parent = &queues[d - 1];
+    for(i = 0; i < queue->n; i++) {
+      v_mul(queue->reflectances[i], queue->colors[i], color);
+      v_add(parent->colors[queue->parents[i]], color, parent->colors[queue->parents[i]]);
+    }
+    queue_free(queue);
+  }
+}
@@ -0,0 +1,27 @@
+/**!
+ * Defines the wavefront tracing of large groups of rays, whose hits are
+ * shaded in batches of a same material.
+ */
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "ray.h"
+
+/**
+ * Raytraces a group of rays, such as every sample of a tile, breadth
+ * first instead of recursively. The rays of each depth form a queue that
+ * goes through every stage before the next depth starts: the rays are
+ * cast in packets, their hits are sorted by material and each run of hits
+ * of a same material is shaded light by light with the batch kernel of
+ * the material, casting its shadow rays as packets, then the reflections
+ * are spawned into the queue of the next depth. The reflected colors are
+ * added back from the deepest queue up, so the colors are the ones
+ * ray_trace gives.
+ * @param rays   Array of rays
+ * @param n      Number of rays
+ * @param scene  Scene
+ * @param colors Resulting color of each ray
+ */
+void ray_trace_batch(RAY* rays, int n, struct SCENE* scene, float (*colors)[3]);
+
+#endif
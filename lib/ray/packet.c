@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "vector.h"
+#include "simd.h"
+#include "scene.h"
+#include "bvh.h"
+#include "packet.h"
+#include "stats.h"
+
+void ray_packet(RAY_PACKET* packet, RAY* rays, int n) {
+  float lanes[8][SIMD_WIDTH];
+  int lane, k;
+
+  for(lane = 0; lane < SIMD_WIDTH; lane++) {
+    // inactive lanes repeat the first ray, so they never produce NaNs
+    RAY* ray = &rays[lane < n ? lane : 0];
+    for(k = 0; k < 3; k++) {
+      lanes[k][lane] = ray->origin[k];
+      lanes[3 + k][lane] = ray->direction[k];
+    }
+    lanes[6][lane] = ray->near;
+    lanes[7][lane] = ray->far;
+  }
+
+  for(k = 0; k < 3; k++) {
+    packet->origin[k] = s_load(lanes[k]);
+    packet->direction[k] = s_load(lanes[3 + k]);
+    packet->inverse[k] = s_div(s_set1(1.0f), packet->direction[k]);
+    packet->sign[k] = rays[0].direction[k] < 0.0f;
+  }
+  packet->near = s_load(lanes[6]);
+  packet->far = s_load(lanes[7]);
+  packet->active = (n >= SIMD_WIDTH) ? SIMD_ALL : (1 << n) - 1;
+}
+
+int ray_cast_packet(RAY* rays, int n, SCENE* scene, RAY_INTERSECTION* intersections) {
+  RAY_PACKET packet;
+  RAY_PACKET_HIT hit;
+  int lane, hits = 0;
+
+  if(scene->bvh == NULL) {
+    for(lane = 0; lane < n; lane++) {
+      if(ray_cast(&rays[lane], scene, &intersections[lane]))
+        hits |= 1 << lane;
+    }
+    return hits;
+  }
+
+  ray_packet(&packet, rays, n);
+  bvh_intersect_packet(scene->bvh, scene->solids, &packet, &hit);
+
+  for(lane = 0; lane < n; lane++) {
+    RAY* ray = &rays[lane];
+    RAY_INTERSECTION* intersection = &intersections[lane];
+
+    ray->state = CAST;
+    ray->length = ray->far;
+    intersection->solid = NULL;
+
+    if(hit.solid[lane] == NULL)
+      continue;
+
+    // only the nearest primitive computes the full intersection data
+    if(hit.instance[lane] != NULL ?
+       solid_instance_intersection(hit.instance[lane], hit.solid[lane], hit.primitive[lane], ray, intersection) :
+       solid_primitive_intersection(hit.solid[lane], hit.primitive[lane], ray, intersection)) {
+      solid_hit_attributes(intersection);
+    } else if(!ray_cast(ray, scene, intersection)) {
+      // the scalar test disagrees on a grazing hit, fall back to it
+      continue;
+    }
+    ray->length = v_distance(intersection->point, ray->origin);
+    hits |= 1 << lane;
+  }
+  return hits;
+}
+
+int ray_occluded_packet(RAY* rays, int n, SCENE* scene, float* max_t, RAY_OCCLUDER* occluder) {
+  RAY_PACKET packet;
+  BVH_PRIMITIVE blocker;
+  SOLID* s;
+  float distance[SIMD_WIDTH];
+  int lane, all = (1 << n) - 1, blocked = 0;
+
+  if(scene->bvh == NULL) {
+    for(lane = 0; lane < n; lane++) {
+      if(ray_occluded(&rays[lane], scene, max_t[lane], occluder))
+        blocked |= 1 << lane;
+    }
+    return blocked;
+  }
+
+  for(lane = 0; lane < SIMD_WIDTH; lane++)
+    distance[lane] = max_t[lane < n ? lane : 0];
+
+  ray_packet(&packet, rays, n);
+  if(occluder != NULL && (s = ray_occluder_solid(occluder)) != NULL) {
+    blocked = bvh_occludes_packet(s, occluder->primitive, &packet, all, s_load(distance));
+    stats_count(STATS_OCCLUDER_HITS, __builtin_popcount(blocked));
+    stats_count(STATS_OCCLUDER_MISSES, n - __builtin_popcount(blocked));
+    if(blocked == all)
+      return blocked;
+  }
+
+  packet.active = all & ~blocked;
+  blocker.solid = (u_int)-1;
+  blocked |= bvh_occluded_packet(scene->bvh, scene->solids, &packet, s_load(distance), &blocker);
+  if(occluder != NULL && blocker.solid != (u_int)-1) {
+    occluder->solid = blocker.solid;
+    occluder->primitive = blocker.primitive;
+  }
+  return blocked;
+}
+
+void ray_trace_packet(RAY* rays, int n, SCENE* scene, float (*colors)[3]) {
+  RAY shadows[SIMD_WIDTH];
+  RAY_INTERSECTION intersections[SIMD_WIDTH];
+  float distance[SIMD_WIDTH];
+  float temp_color[3];
+  int lane, active = 0;
+  int hits, blocked;
+  int index[SIMD_WIDTH];
+  int m;
+  LIGHT* l;
+  LIGHT_SAMPLE samples[SIMD_WIDTH][LIGHT_MAX_SAMPLES];
+  LIGHT_SAMPLE sample;
+  size_t n_samples[SIMD_WIDTH], next[SIMD_WIDTH];
+  float weight[SIMD_WIDTH];
+  double start = stats_start();
+
+  // rays which already bounced too much see nothing
+  for(lane = 0; lane < n; lane++) {
+    if(rays[lane].iteration++ < RAY_MAX_ITERATION) {
+      active |= 1 << lane;
+      stats_depth(rays[lane].iteration - 1);
+    }
+  }
+
+  hits = 0;
+  if(active == (1 << n) - 1) {
+    hits = ray_cast_packet(rays, n, scene, intersections);
+  } else {
+    for(lane = 0; lane < n; lane++) {
+      if((active & (1 << lane)) && ray_cast(&rays[lane], scene, &intersections[lane]))
+        hits |= 1 << lane;
+    }
+  }
+  stats_time(STATS_CAST, start);
+
+  for(lane = 0; lane < n; lane++) {
+    n_samples[lane] = 0;
+    next[lane] = 0;
+    if(hits & (1 << lane)) {
+      // has ambient color
+      v_copy(colors[lane], scene->ambient_color);
+      n_samples[lane] = scene_lights(scene, intersections[lane].point, intersections[lane].normal, samples[lane]);
+    } else {
+      v_copy(colors[lane], scene->background_color);
+    }
+  }
+
+  // cast the shadow rays of every hit towards the same light together,
+  // the lights of each hit being in the order of the light array
+  while(true) {
+    l = NULL;
+    for(lane = 0; lane < n; lane++) {
+      if(next[lane] >= n_samples[lane])
+        continue;
+      sample = scene_light(scene, samples[lane], next[lane]);
+      if(l == NULL || sample.light < l)
+        l = sample.light;
+    }
+    if(l == NULL)
+      break;
+
+    for(lane = 0, m = 0; lane < n; lane++) {
+      if(next[lane] >= n_samples[lane])
+        continue;
+      sample = scene_light(scene, samples[lane], next[lane]);
+      if(sample.light != l)
+        continue;
+      weight[m] = sample.weight;
+      next[lane]++;
+      if(ray_light(&rays[lane], &intersections[lane], l, &shadows[m], &distance[m]))
+        index[m++] = lane;
+    }
+    if(m == 0)
+      continue;
+
+    start = stats_start();
+    blocked = ray_occluded_packet(shadows, m, scene, distance, ray_occluder(scene, l));
+    stats_time(STATS_CAST, start);
+    stats_count(STATS_SHADOW_RAYS, m);
+    for(lane = 0; lane < m; lane++) {
+      // if the point is not occluded by any solid for the light l,
+      // then it got no shadow
+      if(blocked & (1 << lane))
+        continue;
+      RAY_INTERSECTION* i = &intersections[index[lane]];
+      material_shade(&i->solid->material, i, l, temp_color);
+      v_mul(weight[lane], temp_color, temp_color);
+      v_add(colors[index[lane]], temp_color, colors[index[lane]]);
+    }
+  }
+
+  for(lane = 0; lane < n; lane++) {
+    if(hits & (1 << lane))
+      ray_reflect(&rays[lane], scene, &intersections[lane], colors[lane]);
+  }
+}
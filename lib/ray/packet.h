@@ -0,0 +1,76 @@
+/**!
+ * Defines a packet of rays traced together through SIMD lanes.
+ */
+#ifndef PACKET_H_
+#define PACKET_H_
+
+#include "simd.h"
+#include "ray.h"
+
+/**
+ * Rays stored as a structure of arrays, one ray per SIMD lane.
+ */
+typedef struct {
+  SIMD_FLOAT origin[3];
+  SIMD_FLOAT direction[3];
+  SIMD_FLOAT inverse[3];  /**< Inverse of the direction, for box tests */
+  SIMD_FLOAT near;
+  SIMD_FLOAT far;
+  int sign[3];            /**< Direction signs of the first active lane */
+  int active;             /**< Bit mask of the lanes carrying a ray */
+} RAY_PACKET;
+
+/**
+ * Nearest hits found for the lanes of a packet.
+ */
+typedef struct {
+  SIMD_FLOAT t;                     /**< Nearest distance of each lane */
+  struct SOLID* solid[SIMD_WIDTH];  /**< Solid hit by each lane */
+  u_int primitive[SIMD_WIDTH];      /**< Primitive of the solid hit by each lane */
+  struct SOLID* instance[SIMD_WIDTH]; /**< Instance the solid hit belongs to, or NULL */
+} RAY_PACKET_HIT;
+
+/**
+ * Loads up to SIMD_WIDTH rays into the lanes of a packet.
+ * @param packet Packet
+ * @param rays   Array of rays
+ * @param n      Number of rays, the remaining lanes are inactive
+ */
+void ray_packet(RAY_PACKET* packet, RAY* rays, int n);
+
+/**
+ * Tests for the intersection of up to SIMD_WIDTH rays with the solids of
+ * a scene, traversing the scene hierarchy once for all of them.
+ * @param rays          Array of rays
+ * @param n             Number of rays
+ * @param scene         Scene
+ * @param intersections Nearest intersection of each ray
+ * @return Bit mask of the rays that intersected any solid
+ */
+int ray_cast_packet(RAY* rays, int n, struct SCENE* scene, RAY_INTERSECTION* intersections);
+
+/**
+ * Tests whether up to SIMD_WIDTH rays are blocked by any solid of a scene
+ * before their own distance, stopping for each ray at its first blocker.
+ * @param rays     Array of rays
+ * @param n        Number of rays
+ * @param scene    Scene
+ * @param max_t    Distance of each ray after which hits do not count
+ * @param occluder Last occluder of the light the rays point to, tested
+ *                 first and replaced by a blocker found, or NULL
+ * @return Bit mask of the blocked rays
+ */
+int ray_occluded_packet(RAY* rays, int n, struct SCENE* scene, float* max_t, RAY_OCCLUDER* occluder);
+
+/**
+ * Raytraces up to SIMD_WIDTH coherent rays, such as the samples of
+ * neighbouring pixels. The rays and their shadow rays towards each light
+ * are cast as packets, reflections are traced ray by ray.
+ * @param rays   Array of rays
+ * @param n      Number of rays
+ * @param scene  Scene
+ * @param colors Resulting color of each ray
+ */
+void ray_trace_packet(RAY* rays, int n, struct SCENE* scene, float (*colors)[3]);
+
+#endif
@@ -3,10 +3,14 @@
 #include "vector.h"
 #include "scene.h"
 #include "ray.h"
+#include "bvh.h"
+#include "stats.h"
 
 void ray_calculate(RAY* ray, VECTOR origin, VECTOR target, bool direction) {
   ray->origin = origin;
   ray->iteration = 0;
+  ray->width = 0.0f;
+  ray->spread = 0.0f;
   if(direction) {
     v_mul(-1, target, ray->direction);
   } else {
@@ -15,7 +19,7 @@ void ray_calculate(RAY* ray, VECTOR origin, VECTOR target, bool direction) {
   }
 }
 
-bool ray_cast(RAY* ray, SOLID* solids, size_t n, RAY_INTERSECTION* intersection) {
+bool ray_cast(RAY* ray, SCENE* scene, RAY_INTERSECTION* intersection) {
   SOLID* s;
   RAY_INTERSECTION i;
   float nearest = ray->far;
@@ -25,74 +29,188 @@ bool ray_cast(RAY* ray, SOLID* solids, size_t n, RAY_INTERSECTION* intersection)
   ray->length = ray->far;
   intersection->solid = NULL;
 
-  for(s = solids; s < solids + n; s++) {
-    if(solid_intersection(s, ray, &i) && i.t_in < nearest && (i.t_in > ray->near || i.t_out > ray->near)) {
-      *intersection = i;
-      nearest = i.t_in;
-      ray->length = v_distance(i.point, ray->origin);
+  if(scene->bvh != NULL) {
+    bvh_intersect(scene->bvh, scene->solids, ray, intersection);
+  } else {
+    for(s = scene->solids; s < scene->solids + scene->n_solids; s++) {
+      if(solid_intersection(s, ray, &i) && i.t_in < nearest && (i.t_in > ray->near || i.t_out > ray->near)) {
+        *intersection = i;
+        nearest = i.t_in;
+      }
     }
   }
-  return (intersection != NULL && intersection->solid != NULL);
+
+  if(intersection->solid == NULL)
+    return false;
+
+  solid_hit_attributes(intersection);
+  ray->length = v_distance(intersection->point, ray->origin);
+  return true;
 }
 
-void ray_trace(RAY* ray, SCENE* scene, float* color) {
-  float distance;
+/**
+ * Last occluders of the shadow rays of the calling thread.
+ */
+static __thread RAY_OCCLUDER occluders[RAY_OCCLUDERS];
+
+RAY_OCCLUDER* ray_occluder(SCENE* scene, LIGHT* light) {
+  RAY_OCCLUDER* occluder = &occluders[(size_t)(light - scene->lights) % RAY_OCCLUDERS];
+
+  if(occluder->scene != scene || occluder->light != light) {
+    occluder->scene = scene;
+    occluder->light = light;
+    occluder->solid = (u_int)-1;
+  }
+  return occluder;
+}
+
+SOLID* ray_occluder_solid(RAY_OCCLUDER* occluder) {
+  SOLID* s;
+
+  // the entry may come from an older scene at the same address
+  if(occluder->solid >= occluder->scene->n_solids)
+    return NULL;
+  s = &occluder->scene->solids[occluder->solid];
+  if(occluder->primitive >= solid_primitives(s) && occluder->primitive > 0)
+    return NULL;
+  return s;
+}
+
+bool ray_occluded(RAY* ray, SCENE* scene, float max_t, RAY_OCCLUDER* occluder) {
+  BVH_PRIMITIVE blocker;
+  SOLID* s;
+  size_t p, n;
+
+  if(occluder != NULL && (s = ray_occluder_solid(occluder)) != NULL) {
+    if(solid_occludes(s, occluder->primitive, ray, max_t)) {
+      stats_count(STATS_OCCLUDER_HITS, 1);
+      return true;
+    }
+    stats_count(STATS_OCCLUDER_MISSES, 1);
+  }
+
+  if(scene->bvh != NULL) {
+    if(!bvh_occluded(scene->bvh, scene->solids, ray, max_t, &blocker))
+      return false;
+    if(occluder != NULL) {
+      occluder->solid = blocker.solid;
+      occluder->primitive = blocker.primitive;
+    }
+    return true;
+  }
+
+  for(s = scene->solids; s < scene->solids + scene->n_solids; s++) {
+    n = solid_primitives(s);
+    for(p = 0; p < n || (n == 0 && p == 0); p++) {
+      if(solid_occludes(s, p, ray, max_t)) {
+        if(occluder != NULL) {
+          occluder->solid = s - scene->solids;
+          occluder->primitive = p;
+        }
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool ray_light(RAY* ray, RAY_INTERSECTION* intersection, LIGHT* light, RAY* shadow, float* distance) {
   float dist[3];
+
+  shadow->near = ray->near;
+  shadow->far  = ray->far;
+
+  // cast ray towards the light
+  ray_calculate(shadow, intersection->point, light->position, (light->type == DIRECTIONAL));
+  if(light->type == DIRECTIONAL) {
+    v_mul(-1, light->position, dist);
+    *distance = ray->far;
+  } else {
+    v_sub(light->position, intersection->point, dist);
+    *distance = v_distance(intersection->point, light->position);
+  }
+
+  return (v_dot(intersection->normal, dist) > 0.0f);
+}
+
+bool ray_reflection(RAY* ray, RAY_INTERSECTION* i, RAY* reflection) {
   float incidence[3];
-  float reflection[3];
+
+  if(!(i->solid->material.reflectance > 0.0f && i->solid->material.reflectance <= 1.0f))
+    return false;
+
+  // reflection = 2(normal·incidence)*normal - incidence
+  v_sub(i->point, ray->origin, incidence);
+  v_normalize(incidence, incidence);
+  v_mul(2*v_dot(i->normal, incidence), i->normal, reflection->direction);
+  v_sub(incidence, reflection->direction, reflection->direction);
+
+  reflection->near = ray->near;
+  reflection->far  = ray->far;
+  reflection->origin = i->point;
+  reflection->iteration = ray->iteration;
+  // mirrors keep the cone spread, curved ones would widen it
+  reflection->width = ray->width + ray->spread*i->t_in;
+  reflection->spread = ray->spread;
+  stats_count(STATS_REFLECTION_RAYS, 1);
+  return true;
+}
+
+void ray_reflect(RAY* ray, SCENE* scene, RAY_INTERSECTION* i, float* color) {
+  float temp_color[3];
+  RAY ray2;
+
+  if(ray_reflection(ray, i, &ray2)) {
+    ray_trace(&ray2, scene, temp_color);
+    v_mul(i->solid->material.reflectance, temp_color, temp_color);
+    v_add(color, temp_color, color);
+    //v_mulv(color, temp_color, color);
+  }
+}
+
+void ray_trace(RAY* ray, SCENE* scene, float* color) {
+  float distance;
   float temp_color[3];
 
   RAY ray2;
-  RAY_INTERSECTION i, ii;
+  RAY_INTERSECTION i;
 
-  ray2.near = ray->near;
-  ray2.far  = ray->far;
+  LIGHT_SAMPLE samples[LIGHT_MAX_SAMPLES];
+  LIGHT_SAMPLE sample;
+  size_t k, n_samples;
+  double start = stats_start();
+  bool hit;
 
-  LIGHT* l;
+  if(ray->iteration < RAY_MAX_ITERATION)
+    stats_depth(ray->iteration);
+  hit = ray->iteration++ < RAY_MAX_ITERATION && ray_cast(ray, scene, &i);
+  stats_time(STATS_CAST, start);
 
   // cast ray to the solids
-  if(ray->iteration++ < RAY_MAX_ITERATION && ray_cast(ray, scene->solids, scene->n_solids, &i)) {
+  if(hit) {
     // has ambient color
     v_copy(color, scene->ambient_color);
-    // cast rays towards all the lights to check for shadows
-    for(l = scene->lights; l < scene->lights + scene->n_lights; l++) {
-      // cast ray towards the ligh
-      ray_calculate(&ray2, i.point, l->position, (l->type == DIRECTIONAL));
-      if(l->type == DIRECTIONAL) {
-        v_mul(-1, l->position, dist);
-        distance = ray->far;
-      } else {
-        v_sub(l->position, i.point, dist);
-        distance = v_distance(i.point, l->position);
-      }
-
-      if(v_dot(i.normal, dist) <= 0.0f)
+    // cast rays towards the lights chosen for the point to check for shadows
+    n_samples = scene_lights(scene, i.point, i.normal, samples);
+    for(k = 0; k < n_samples; k++) {
+      sample = scene_light(scene, samples, k);
+      if(!ray_light(ray, &i, sample.light, &ray2, &distance))
         continue;
 
       // if the point is not occluded by any solid for the light l,
       // then it got no shadow
-      if(!(ray_cast(&ray2, scene->solids, scene->n_solids, &ii) && ii.t_in < distance)) {
-        i.solid->material.function(&i.solid->material, &i, l, temp_color);
+      start = stats_start();
+      hit = ray_occluded(&ray2, scene, distance, ray_occluder(scene, sample.light));
+      stats_time(STATS_CAST, start);
+      stats_count(STATS_SHADOW_RAYS, 1);
+      if(!hit) {
+        material_shade(&i.solid->material, &i, sample.light, temp_color);
+        v_mul(sample.weight, temp_color, temp_color);
         v_add(color, temp_color, color);
       }
     }
 
-    if(i.solid->material.reflectance > 0.0f && i.solid->material.reflectance <= 1.0f) {
-      // reflection = 2(normal·incidence)*normal - incidence
-      v_sub(i.point, ray->origin, incidence);
-      v_normalize(incidence, incidence);
-      v_mul(2*v_dot(i.normal, incidence), i.normal, reflection);
-      v_sub(incidence, reflection, reflection);
-
-      ray2.origin = i.point;
-      ray2.iteration = ray->iteration;
-      v_copy(ray2.direction, reflection);
-
-      ray_trace(&ray2, scene, temp_color);
-      v_mul(i.solid->material.reflectance, temp_color, temp_color);
-      v_add(color, temp_color, color);
-      //v_mulv(color, temp_color, color);
-    }
+    ray_reflect(ray, scene, &i, color);
   } else {
     v_copy(color, scene->background_color);
   }
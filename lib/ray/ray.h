@@ -9,8 +9,10 @@
 #include <sys/types.h>
 
 #define RAY_MAX_ITERATION 3
+#define RAY_OCCLUDERS 64 /**< Number of lights whose last occluder each thread keeps */
 
 struct SCENE;
+struct LIGHT;
 
 /**
  * Simple structure for a ray.
@@ -31,6 +33,10 @@ typedef struct {
 
   float length;
   u_short iteration;
+
+  // the rays of a pixel are cones, whose width filters textures
+  float width;        /**< Width of the ray footprint at its origin */
+  float spread;       /**< Growth of the footprint width per unit of distance */
 } RAY;
 
 /**
@@ -41,15 +47,33 @@ typedef struct {
   float t_in;          /**< Position on the ray where it enters a solid */
   float t_out;         /**< Position on the ray where it comes out of a solid */
 
-  float texture[3];
+  size_t primitive;    /**< Primitive of the solid hit (triangle index for meshes) */
+  float barycentric[2];/**< Barycentric coordinates of the hit in a triangle */
 
+  // computed by solid_hit_attributes, once the nearest intersection is known
+  float texture[3];    /**< Texture coordinates at the intersection point, and the width of the ray footprint in texture coordinates */
   float point[3];      /**< Nearest intersection point */
   float normal[3];     /**< Normal at the intersection point */
   struct SOLID* solid; /**< Solid hit by the ray */
+  struct SOLID* instance; /**< Instance the solid hit belongs to, NULL for solids of the scene */
 } RAY_INTERSECTION;
 
 /**
- * Calculates a ray for the given origin and target points.
+ * Primitive which last blocked a shadow ray of a thread towards a light.
+ * Shadow rays of neighboring points towards the same light are usually
+ * blocked by the same primitive, which is then tested before searching
+ * the whole scene.
+ */
+typedef struct {
+  struct SCENE* scene;
+  struct LIGHT* light;
+  u_int solid;        /**< Index of the blocking solid in the scene, past the solids when none */
+  u_int primitive;    /**< Index of the primitive inside the solid */
+} RAY_OCCLUDER;
+
+/**
+ * Calculates a ray for the given origin and target points. The ray
+ * starts as a line, with a footprint of width 0.
  * @param ray    Ray pointer
  * @param origin Origin point
  * @param target Target point
@@ -57,14 +81,76 @@ typedef struct {
 void ray_calculate(RAY* ray, float* origin, float* target, bool direction);
 
 /**
- * Tests for the intersection of the given ray with an array of solids.
+ * Tests for the intersection of the given ray with the solids of a scene.
+ * Uses the scene acceleration structure when it was built, otherwise
+ * tests every solid.
  * @param ray          Ray
- * @param solids       Array of solids
- * @param n            Size of the solid array
- * @param intersection Nearest intersection of the ray with any solid from the array
+ * @param scene        Scene
+ * @param intersection Nearest intersection of the ray with any solid of the scene
  * @return There was an intersection with any solid
  */
-bool ray_cast(RAY* ray, struct SOLID* solids, size_t n, RAY_INTERSECTION* intersection);
+bool ray_cast(RAY* ray, struct SCENE* scene, RAY_INTERSECTION* intersection);
+
+/**
+ * Tests whether any solid of a scene blocks a ray before a distance,
+ * stopping at the first blocker found. Used for shadow rays, which only
+ * need to know whether they reach their light.
+ * @param ray      Ray
+ * @param scene    Scene
+ * @param max_t    Distance along the ray after which hits do not count
+ * @param occluder Last occluder of the light, tested first and replaced by
+ *                 the blocker found, or NULL
+ * @return The ray is blocked
+ */
+bool ray_occluded(RAY* ray, struct SCENE* scene, float max_t, RAY_OCCLUDER* occluder);
+
+/**
+ * Returns the last occluder of the shadow rays of the calling thread
+ * towards a light. Lights share the entries of a thread modulo
+ * RAY_OCCLUDERS, an entry being emptied when it changes light or scene.
+ * @param scene Scene
+ * @param light Light of the scene
+ * @return Entry of the light
+ */
+RAY_OCCLUDER* ray_occluder(struct SCENE* scene, struct LIGHT* light);
+
+/**
+ * Returns the solid holding the last occluder of a light, NULL when the
+ * entry is empty.
+ * @param occluder Last occluder of the light
+ */
+struct SOLID* ray_occluder_solid(RAY_OCCLUDER* occluder);
+
+/**
+ * Calculates the shadow ray from an intersection towards a light.
+ * @param ray          Ray which produced the intersection
+ * @param intersection Intersection to be lit
+ * @param light        Light
+ * @param shadow       Resulting shadow ray
+ * @param distance     Resulting distance to the light along the shadow ray
+ * @return The light faces the intersection and may reach it
+ */
+bool ray_light(RAY* ray, RAY_INTERSECTION* intersection, struct LIGHT* light, RAY* shadow, float* distance);
+
+/**
+ * Calculates the reflection of a ray at an intersection, if its material
+ * is reflective. The reflected ray starts at the intersection point.
+ * @param ray          Ray which produced the intersection
+ * @param intersection Intersection
+ * @param reflection   Resulting reflected ray
+ * @return The material of the intersection is reflective
+ */
+bool ray_reflection(RAY* ray, RAY_INTERSECTION* intersection, RAY* reflection);
+
+/**
+ * Traces the reflection of a ray at an intersection, if its material is
+ * reflective, and adds its weighted color.
+ * @param ray          Ray which produced the intersection
+ * @param scene        Scene
+ * @param intersection Intersection
+ * @param color        Color to add the reflected color to
+ */
+void ray_reflect(RAY* ray, struct SCENE* scene, RAY_INTERSECTION* intersection, float* color);
 
 /**
  * Completely raytraces an entire scene.
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "vector.h"
+#include "scene.h"
+#include "camera.h"
+
+void camera_look(CAMERA* camera, const float* position, const float* target, float fov) {
+  float vertical[3] = { 0.0f, 1.0f, 0.0f };
+
+  v_copy(camera->position, position);
+  v_sub(target, position, camera->forward);
+  if(!(fov > 0.0f && fov < 180.0f) || v_dot(camera->forward, camera->forward) == 0.0f) {
+    fprintf(stderr, "Error, the camera needs a target away from the eye and a field of view in ]0, 180[\n");
+    exit(1);
+  }
+  v_normalize(camera->forward, camera->forward);
+
+  // looking straight up or down, the rows follow x
+  if(fabsf(camera->forward[1]) > 0.9999f) {
+    v_set(vertical, 0.0f, 0.0f, 1.0f);
+  }
+  v_cross(vertical, camera->forward, camera->right);
+  v_normalize(camera->right, camera->right);
+  v_cross(camera->forward, camera->right, camera->up);
+
+  camera->fov = fov;
+  camera->lens = 1.0f;
+  camera->shift[0] = 0.0f;
+  camera->shift[1] = 0.0f;
+}
+
+void camera_window(CAMERA* camera, const float* position) {
+  v_copy(camera->position, position);
+  v_set(camera->forward, 0.0f, 0.0f, 1.0f);
+  v_set(camera->right, 1.0f, 0.0f, 0.0f);
+  v_set(camera->up, 0.0f, 1.0f, 0.0f);
+
+  // the window is 1 high at the distance of the plane, and its center
+  // is shifted to the origin
+  camera->lens = -position[2];
+  camera->fov = (float)(atan(0.5/camera->lens) * 360.0/M_PI);
+  camera->shift[0] = -position[0];
+  camera->shift[1] = -position[1];
+}
+
+void camera_scene(CAMERA* camera, SCENE* scene, const float* eye) {
+  if(scene->fov > 0.0f)
+    camera_look(camera, eye, scene->look, scene->fov);
+  else
+    camera_window(camera, eye);
+}
+
+void camera_resize(CAMERA* camera, int width, int height) {
+  float h = (float)(2.0*camera->lens*tan(camera->fov*M_PI/360.0));
+  float w, center[3], v[3];
+
+  camera->width = width;
+  camera->height = height;
+  camera->aspect = (float)width/height;
+  w = h*camera->aspect;
+
+  // center of the image on the image plane, then its top left corner
+  v_mul(camera->lens, camera->forward, center);
+  v_mul(camera->shift[0]*h, camera->right, v);
+  v_add(center, v, center);
+  v_mul(camera->shift[1]*h, camera->up, v);
+  v_add(center, v, center);
+  v_mul(-w/2, camera->right, v);
+  v_add(center, v, camera->corner);
+  v_mul(h/2, camera->up, v);
+  v_add(camera->corner, v, camera->corner);
+
+  camera->pixel = w/width;
+  v_mul(camera->pixel, camera->right, camera->dx);
+  v_mul(-h/height, camera->up, camera->dy);
+}
+
+void camera_ray(CAMERA* camera, float x, float y, RAY* ray) {
+  float direction[3];
+  int k;
+
+  for(k = 0; k < 3; k++)
+    direction[k] = camera->corner[k] + x*camera->dx[k] + y*camera->dy[k];
+
+  ray->origin = camera->position;
+  ray->iteration = 0;
+  ray->width = 0.0f;
+  ray->spread = camera->pixel/v_length(direction);
+  v_normalize(direction, ray->direction);
+}
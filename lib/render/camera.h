@@ -0,0 +1,82 @@
+/**!
+ * Defines the pinhole camera generating the primary rays of an image.
+ */
+#ifndef CAMERA_H_
+#define CAMERA_H_
+
+#include "ray.h"
+
+struct SCENE;
+
+/**
+ * Pinhole camera. The eye looks through an image plane in front of it,
+ * whose center may be shifted off the viewing axis. Once the camera is
+ * sized to an image, the image plane is held as its top left corner and
+ * the steps from a pixel to the next one, so that the ray of any point of
+ * the image is a couple of multiply-adds away.
+ */
+typedef struct CAMERA {
+  float position[3];  /**< Eye position, origin of the primary rays */
+  float forward[3];   /**< Viewing axis, normalized */
+  float right[3];     /**< Direction of the rows of the image, normalized */
+  float up[3];        /**< Direction of the columns of the image, bottom to top, normalized */
+  float fov;          /**< Vertical field of view in degrees */
+  float aspect;       /**< Width over height of the image */
+  float lens;         /**< Distance from the eye to the image plane */
+  float shift[2];     /**< Offset of the center of the image from the viewing axis, in image heights */
+
+  // set by camera_resize for the size of the image
+  int width, height;
+  float corner[3];    /**< From the eye to the top left corner of the image, on the image plane */
+  float dx[3];        /**< Step on the image plane from a pixel to the next one of its row */
+  float dy[3];        /**< Step on the image plane from a pixel to the one below it */
+  float pixel;        /**< Width of a pixel on the image plane */
+} CAMERA;
+
+/**
+ * Points a camera from a position to a target, the rows of the image
+ * staying horizontal (orthogonal to the y axis).
+ * @param camera   Camera
+ * @param position Eye position
+ * @param target   Point seen at the center of the image
+ * @param fov      Vertical field of view in degrees, in ]0, 180[
+ */
+void camera_look(CAMERA* camera, const float* position, const float* target, float fov);
+
+/**
+ * Sets the camera of the scenes which do not give one: the eye looks
+ * along z through a window of the plane z = 0 centered on the origin, of
+ * height 1 and as wide as the aspect ratio of the image gives, wherever
+ * the eye is.
+ * @param camera   Camera
+ * @param position Eye position, in front of the plane z = 0
+ */
+void camera_window(CAMERA* camera, const float* position);
+
+/**
+ * Sets the camera a scene gives, seen from an eye position of its frames.
+ * @param camera Camera
+ * @param scene  Scene
+ * @param eye    Eye position, as scene_frame gives it
+ */
+void camera_scene(CAMERA* camera, struct SCENE* scene, const float* eye);
+
+/**
+ * Sizes a camera to an image of square pixels, the aspect ratio following
+ * the image, and computes its image plane. Must be called after the
+ * camera is set and before generating rays.
+ * @param camera        Camera
+ * @param width,height  Size of the whole image
+ */
+void camera_resize(CAMERA* camera, int width, int height);
+
+/**
+ * Calculates the primary ray through a point of the image. The ray cone
+ * covers a pixel.
+ * @param camera Camera sized to the image
+ * @param x,y    Point of the image in pixels, from its top left corner
+ * @param ray    Resulting ray, whose near and far distances are left as they are
+ */
+void camera_ray(CAMERA* camera, float x, float y, RAY* ray);
+
+#endif
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "scene.h"
+#include "checkpoint.h"
+#include "stats.h"
+
+#define CHECKPOINT_MAGIC   "RTCHECK"
+#define CHECKPOINT_VERSION 2
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  int32_t width;
+  int32_t height;
+  int32_t tile_size;
+  int32_t resolution;
+  int32_t antialias;
+  float threshold;
+  uint32_t n_tiles;
+  uint64_t identity;   /**< Hash of the input of the render, see render_identity */
+} CHECKPOINT_HEADER;
+
+#define bitmap_size(n) (((n) + 7)/8)
+#define bitmap_get(bitmap, i) (((bitmap)[(i)/8] >> ((i)%8)) & 1)
+
+CHECKPOINT* checkpoint(char* filename, double interval, bool resume) {
+  CHECKPOINT* checkpoint = (CHECKPOINT*)calloc(1, sizeof(CHECKPOINT));
+
+  checkpoint->filename = strdup(filename);
+  checkpoint->interval = interval;
+  checkpoint->resume = resume;
+  pthread_mutex_init(&checkpoint->lock, NULL);
+  return checkpoint;
+}
+
+void checkpoint_free(CHECKPOINT* checkpoint) {
+  pthread_mutex_destroy(&checkpoint->lock);
+  free(checkpoint->done);
+  free(checkpoint->snapshot);
+  free(checkpoint->filename);
+  free(checkpoint);
+}
+
+/**
+ * FNV-1a hash of some bytes, following the hash of the previous ones.
+ */
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+  const u_char* p = (const u_char*)data;
+  size_t i;
+
+  for(i = 0; i < size; i++)
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+/**
+ * Identity of the input of a render: the path, size and modification time
+ * of every file the scene was built from, the time of its frame and the
+ * camera.
+ */
+static uint64_t render_identity(RENDER* render) {
+  SCENE* scene = render->scene;
+  CAMERA* camera = &render->camera;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  int64_t stamp[2];
+  struct stat st;
+  size_t i;
+
+  for(i = 0; i < scene->n_files; i++) {
+    hash = hash_bytes(hash, scene->files[i], strlen(scene->files[i]) + 1);
+    memset(stamp, 0, sizeof(stamp));
+    if(stat(scene->files[i], &st) == 0) {
+      stamp[0] = (int64_t)st.st_size;
+      stamp[1] = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    }
+    hash = hash_bytes(hash, stamp, sizeof(stamp));
+  }
+  hash = hash_bytes(hash, &scene->time, sizeof(scene->time));
+  hash = hash_bytes(hash, camera->position, sizeof(camera->position));
+  hash = hash_bytes(hash, camera->forward, sizeof(camera->forward));
+  hash = hash_bytes(hash, camera->right, sizeof(camera->right));
+  hash = hash_bytes(hash, camera->up, sizeof(camera->up));
+  hash = hash_bytes(hash, &camera->fov, sizeof(camera->fov));
+  hash = hash_bytes(hash, &camera->lens, sizeof(camera->lens));
+  hash = hash_bytes(hash, camera->shift, sizeof(camera->shift));
+  return hash;
+}
+
+static void checkpoint_header(CHECKPOINT* checkpoint, CHECKPOINT_HEADER* header) {
+  RENDER* render = checkpoint->render;
+
+  memset(header, 0, sizeof(CHECKPOINT_HEADER));
+  memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+  header->version = CHECKPOINT_VERSION;
+  header->width = render->image->width;
+  header->height = render->image->height;
+  header->tile_size = render->tile_size;
+  header->resolution = render->resolution;
+  header->antialias = render->antialias;
+  header->threshold = render->threshold;
+  header->n_tiles = checkpoint->n_tiles;
+  header->identity = checkpoint->identity;
+}
+
+/**
+ * Reads or writes the accumulated colors and weights of the pixels of a
+ * tile, row by row.
+ * @return The whole tile was transferred
+ */
+static bool transfer_tile(CHECKPOINT* checkpoint, const TILE* tile, FILE* file, bool write) {
+  IMAGE* img = checkpoint->render->image;
+  size_t offset, n = tile->width;
+  int y;
+
+  for(y = tile->y; y < tile->y + tile->height; y++) {
+    offset = (size_t)y*img->width + tile->x;
+    if(write ? fwrite(&img->accumulation[offset*3], sizeof(float), n*3, file) != n*3 ||
+               fwrite(&img->weights[offset], sizeof(float), n, file) != n
+             : fread(&img->accumulation[offset*3], sizeof(float), n*3, file) != n*3 ||
+               fread(&img->weights[offset], sizeof(float), n, file) != n)
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Reads the completed tiles of the checkpoint file, if there is one.
+ */
+static void checkpoint_read(CHECKPOINT* checkpoint) {
+  CHECKPOINT_HEADER header, expected;
+  FILE* file = fopen(checkpoint->filename, "rb");
+  size_t i;
+
+  if(file == NULL)
+    return;
+
+  checkpoint_header(checkpoint, &expected);
+  if(fread(&header, sizeof(header), 1, file) != 1 ||
+     memcmp(&header, &expected, offsetof(CHECKPOINT_HEADER, identity)) != 0) {
+    fprintf(stderr, "Error, checkpoint '%s' was written for other render settings\n", checkpoint->filename);
+    exit(1);
+  }
+  if(header.identity != expected.identity) {
+    fprintf(stderr, "Error, checkpoint '%s' was written for another scene, frame or camera\n", checkpoint->filename);
+    exit(1);
+  }
+  if(fread(checkpoint->done, 1, bitmap_size(checkpoint->n_tiles), file) != bitmap_size(checkpoint->n_tiles)) {
+    fprintf(stderr, "Error while reading checkpoint '%s'\n", checkpoint->filename);
+    exit(1);
+  }
+  for(i = 0; i < checkpoint->n_tiles; i++) {
+    if(!bitmap_get(checkpoint->done, i))
+      continue;
+    if(!transfer_tile(checkpoint, &checkpoint->tiles[i], file, false)) {
+      fprintf(stderr, "Error while reading checkpoint '%s'\n", checkpoint->filename);
+      exit(1);
+    }
+    checkpoint->n_done++;
+  }
+  fclose(file);
+}
+
+/**
+ * Writes the tiles of the snapshot bitmap to a temporary file, which then
+ * replaces the checkpoint file at once.
+ */
+static void checkpoint_write(CHECKPOINT* checkpoint) {
+  char temporary[PATH_MAX + 16];
+  CHECKPOINT_HEADER header;
+  FILE* file;
+  size_t i;
+  bool ok;
+
+  snprintf(temporary, sizeof(temporary), "%s.%d", checkpoint->filename, (int)getpid());
+  file = fopen(temporary, "wb");
+  if(file == NULL) {
+    fprintf(stderr, "Warning: could not write checkpoint '%s'\n", checkpoint->filename);
+    return;
+  }
+
+  checkpoint_header(checkpoint, &header);
+  ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+       fwrite(checkpoint->snapshot, 1, bitmap_size(checkpoint->n_tiles), file) == bitmap_size(checkpoint->n_tiles);
+  for(i = 0; i < checkpoint->n_tiles && ok; i++) {
+    if(bitmap_get(checkpoint->snapshot, i))
+      ok = transfer_tile(checkpoint, &checkpoint->tiles[i], file, true);
+  }
+  if(fclose(file) != 0)
+    ok = false;
+  if(ok)
+    ok = (rename(temporary, checkpoint->filename) == 0);
+  if(!ok) {
+    remove(temporary);
+    fprintf(stderr, "Warning: could not write checkpoint '%s'\n", checkpoint->filename);
+  }
+}
+
+void checkpoint_begin(CHECKPOINT* checkpoint, RENDER* render, const TILE* tiles, size_t n_tiles) {
+  if(render->image->accumulation == NULL) {
+    fprintf(stderr, "Error, checkpoints need an accumulation buffer\n");
+    exit(1);
+  }
+
+  checkpoint->render = render;
+  checkpoint->tiles = tiles;
+  checkpoint->n_tiles = n_tiles;
+  checkpoint->identity = render_identity(render);
+  checkpoint->n_done = 0;
+  checkpoint->done = (u_char*)realloc(checkpoint->done, bitmap_size(n_tiles));
+  checkpoint->snapshot = (u_char*)realloc(checkpoint->snapshot, bitmap_size(n_tiles));
+  memset(checkpoint->done, 0, bitmap_size(n_tiles));
+  checkpoint->saving = false;
+  checkpoint->saved = stats_clock();
+
+  if(checkpoint->resume)
+    checkpoint_read(checkpoint);
+}
+
+bool checkpoint_done(CHECKPOINT* checkpoint, size_t tile) {
+  return bitmap_get(checkpoint->done, tile);
+}
+
+void checkpoint_tile(CHECKPOINT* checkpoint, size_t tile) {
+  double now = stats_clock();
+  bool save = false;
+
+  pthread_mutex_lock(&checkpoint->lock);
+  checkpoint->done[tile/8] |= 1 << (tile%8);
+  checkpoint->n_done++;
+  // a single thread saves, from a copy of the bitmap its tiles are final
+  if(!checkpoint->saving && now - checkpoint->saved >= checkpoint->interval &&
+     checkpoint->n_done < checkpoint->n_tiles) {
+    checkpoint->saving = save = true;
+    memcpy(checkpoint->snapshot, checkpoint->done, bitmap_size(checkpoint->n_tiles));
+  }
+  pthread_mutex_unlock(&checkpoint->lock);
+  if(!save)
+    return;
+
+  checkpoint_write(checkpoint);
+
+  pthread_mutex_lock(&checkpoint->lock);
+  checkpoint->saving = false;
+  checkpoint->saved = stats_clock();
+  pthread_mutex_unlock(&checkpoint->lock);
+}
+
+void checkpoint_end(CHECKPOINT* checkpoint) {
+  checkpoint->render = NULL;
+  checkpoint->tiles = NULL;
+}
@@ -0,0 +1,92 @@
+/**!
+ * Defines the checkpoints of a render, which save the completed tiles of
+ * the image periodically so that a killed render can be resumed.
+ */
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "render.h"
+
+#define CHECKPOINT_INTERVAL 60.0
+
+/**
+ * Progress of a render. A checkpoint file holds its settings, the bitmap
+ * of the completed tiles, then the accumulated colors and weights of the
+ * pixels of each completed tile, row by row. Tiles are only marked once
+ * their pixels are written, and are not touched afterwards, so that a
+ * checkpoint can be saved while the other tiles are being rendered.
+ */
+typedef struct CHECKPOINT {
+  char* filename;
+  double interval;     /**< Seconds between two saves */
+  bool resume;         /**< Start from the tiles of an existing checkpoint file */
+
+  // set by checkpoint_begin for the tiles of a render
+  RENDER* render;
+  const TILE* tiles;
+  size_t n_tiles;
+  uint64_t identity;   /**< Hash of the scene files, frame and camera of the render */
+  size_t n_done;
+  u_char* done;        /**< Bitmap of the completed tiles */
+  u_char* snapshot;    /**< Copy of the bitmap being saved */
+  double saved;        /**< Time of the last save */
+  bool saving;
+  pthread_mutex_t lock;
+} CHECKPOINT;
+
+/**
+ * Creates the checkpoints of renders.
+ * @param filename Name of the checkpoint file
+ * @param interval Seconds between two saves
+ * @param resume   Start from the tiles of the checkpoint file if it exists
+ * @return Pointer to the allocated checkpoint
+ */
+CHECKPOINT* checkpoint(char* filename, double interval, bool resume);
+
+/**
+ * Destroys a checkpoint, the file is kept.
+ * @param checkpoint Checkpoint to be destroyed
+ */
+void checkpoint_free(CHECKPOINT* checkpoint);
+
+/**
+ * Starts the checkpoints of the tiles of a render. When resuming, the
+ * completed tiles of the checkpoint file are added to the accumulation
+ * buffer of the image, which must be cleared, and are marked as done.
+ * Exits when the file was written for other render settings, or for
+ * another input: other scene files, or files changed since, another time
+ * of the frames of the scene or another camera.
+ * @param checkpoint Checkpoint
+ * @param render     Rendering settings, the image must have an accumulation buffer
+ * @param tiles      Tiles of the whole image
+ * @param n_tiles    Number of tiles
+ */
+void checkpoint_begin(CHECKPOINT* checkpoint, RENDER* render, const TILE* tiles, size_t n_tiles);
+
+/**
+ * Tells whether a tile was completed.
+ * @param checkpoint Checkpoint
+ * @param tile       Index of the tile
+ */
+bool checkpoint_done(CHECKPOINT* checkpoint, size_t tile);
+
+/**
+ * Marks a tile as completed once its pixels are written, and saves the
+ * checkpoint file when the interval has elapsed and no other thread is
+ * saving it.
+ * @param checkpoint Checkpoint
+ * @param tile       Index of the tile
+ */
+void checkpoint_tile(CHECKPOINT* checkpoint, size_t tile);
+
+/**
+ * Ends the checkpoints of a render. The file is left as it is, until the
+ * image it leads to is written.
+ * @param checkpoint Checkpoint
+ */
+void checkpoint_end(CHECKPOINT* checkpoint);
+
+#endif
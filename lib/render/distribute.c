@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "distribute.h"
+
+/**
+ * Worker process seen from the coordinator.
+ */
+typedef struct {
+  pid_t pid;
+  FILE* input;    /**< Ranges of tiles sent to the worker */
+  FILE* output;   /**< Tiles sent back by the worker */
+  size_t pending; /**< Tiles of the range being rendered, 0 when idle */
+} WORKER_PROCESS;
+
+void render_worker(RENDER* render, int width, int height, FILE* input, FILE* output) {
+  size_t first, last;
+
+  image_write_tiles(output, width, height);
+  fflush(output);
+  while(fscanf(input, "%zu %zu", &first, &last) == 2) {
+    render_range(render, width, height, first, last, output);
+    // the coordinator waits for the whole range
+    if(fflush(output) != 0) {
+      fprintf(stderr, "Error while sending tiles\n");
+      exit(1);
+    }
+  }
+}
+
+/**
+ * Forks a worker process, connected to the coordinator by a pipe for each
+ * direction.
+ * @param workers Workers already forked, followed by the new one
+ * @param id      Index of the new worker
+ */
+static void spawn(RENDER* render, WORKER_PROCESS* workers, size_t id) {
+  int ranges[2], tiles[2];
+  size_t i;
+  FILE* input;
+  FILE* output;
+
+  if(pipe(ranges) != 0 || pipe(tiles) != 0) {
+    fprintf(stderr, "Error while creating the pipes of render worker %zu\n", id);
+    exit(1);
+  }
+  // buffered output would be written by both processes
+  fflush(NULL);
+  workers[id].pid = fork();
+  if(workers[id].pid < 0) {
+    fprintf(stderr, "Error while creating render worker %zu\n", id);
+    exit(1);
+  }
+
+  if(workers[id].pid == 0) {
+    // the pipes of the other workers would not be closed when they end
+    for(i = 0; i < id; i++) {
+      fclose(workers[i].input);
+      fclose(workers[i].output);
+    }
+    close(ranges[1]);
+    close(tiles[0]);
+    input = fdopen(ranges[0], "r");
+    output = fdopen(tiles[1], "w");
+    render_worker(render, render->image->width, render->image->height, input, output);
+    fclose(input);
+    if(fclose(output) != 0)
+      _exit(1);
+    _exit(0);
+  }
+
+  close(ranges[0]);
+  close(tiles[1]);
+  workers[id].input = fdopen(ranges[1], "w");
+  workers[id].output = fdopen(tiles[0], "r");
+  workers[id].pending = 0;
+}
+
+/**
+ * Sends the next range of tiles to an idle worker.
+ * @return The worker was given tiles, false when there are none left
+ */
+static bool assign(WORKER_PROCESS* worker, size_t* next, size_t n_tiles, size_t range) {
+  size_t last = (*next + range < n_tiles) ? *next + range : n_tiles;
+
+  if(*next >= n_tiles)
+    return false;
+  fprintf(worker->input, "%zu %zu\n", *next, last);
+  if(fflush(worker->input) != 0) {
+    fprintf(stderr, "Error, a render worker stopped\n");
+    exit(1);
+  }
+  worker->pending = last - *next;
+  *next = last;
+  return true;
+}
+
+void render_distribute(RENDER* render, size_t n_workers) {
+  RENDER settings = *render;
+  IMAGE* img = render->image;
+  WORKER_PROCESS* workers = (WORKER_PROCESS*)malloc(sizeof(WORKER_PROCESS) * n_workers);
+  struct pollfd* fds = (struct pollfd*)malloc(sizeof(struct pollfd) * n_workers);
+  size_t* ready = (size_t*)malloc(sizeof(size_t) * n_workers);
+  size_t n_tiles = render_tile_count(render, img->width, img->height);
+  size_t i, k, n, busy, next, range;
+  void (*sigpipe)(int);
+  int width, height, x, y, status;
+
+  if(render->heatmap != NULL || render->checkpoint != NULL || render->stream != NULL) {
+    fprintf(stderr, "Error, heatmaps, checkpoints and streams need the whole image\n");
+    exit(1);
+  }
+
+  // the workers share the processors
+  if(settings.n_threads == 0) {
+    settings.n_threads = render_processors()/n_workers;
+    if(settings.n_threads == 0)
+      settings.n_threads = 1;
+  }
+  // ranges hold enough tiles to keep every thread of a worker busy
+  range = 4*settings.n_threads;
+
+  // a stopped worker is reported rather than killing the coordinator
+  sigpipe = signal(SIGPIPE, SIG_IGN);
+  for(i = 0; i < n_workers; i++)
+    spawn(&settings, workers, i);
+
+  next = 0;
+  busy = 0;
+  for(i = 0; i < n_workers; i++) {
+    image_read_tiles(workers[i].output, &width, &height);
+    if(width != img->width || height != img->height) {
+      fprintf(stderr, "Error, render worker %zu renders another image size\n", i);
+      exit(1);
+    }
+    if(assign(&workers[i], &next, n_tiles, range))
+      busy++;
+  }
+
+  while(busy > 0) {
+    for(i = 0, n = 0; i < n_workers; i++) {
+      if(workers[i].pending == 0)
+        continue;
+      fds[n].fd = fileno(workers[i].output);
+      fds[n].events = POLLIN;
+      ready[n++] = i;
+    }
+    if(poll(fds, n, -1) < 0) {
+      if(errno == EINTR)
+        continue;
+      fprintf(stderr, "Error while waiting for the render workers\n");
+      exit(1);
+    }
+
+    for(k = 0; k < n; k++) {
+      if(fds[k].revents == 0)
+        continue;
+      // a worker sends the tiles of its range at once
+      i = ready[k];
+      for(; workers[i].pending > 0; workers[i].pending--) {
+        if(!image_read_tile(workers[i].output, img, &x, &y, &width, &height)) {
+          fprintf(stderr, "Error, render worker %zu stopped\n", i);
+          exit(1);
+        }
+      }
+      busy--;
+      if(assign(&workers[i], &next, n_tiles, range))
+        busy++;
+    }
+  }
+
+  // workers end with their input
+  for(i = 0; i < n_workers; i++) {
+    fclose(workers[i].input);
+    fclose(workers[i].output);
+    if(waitpid(workers[i].pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Error, render worker %zu failed\n", i);
+      exit(1);
+    }
+  }
+  signal(SIGPIPE, sigpipe);
+
+  free(ready);
+  free(fds);
+  free(workers);
+}
@@ -0,0 +1,37 @@
+/**!
+ * Defines the distributed renderer, which splits an image between worker
+ * processes rendering ranges of tiles and sending them back as tile files.
+ */
+#ifndef DISTRIBUTE_H_
+#define DISTRIBUTE_H_
+
+#include <stdio.h>
+#include "render.h"
+
+/**
+ * Serves ranges of tiles of an image. The worker writes the header of a
+ * tile file to its output, then reads ranges of tiles from its input, one
+ * "first last" line each, and writes the tiles of each range to its output
+ * once they are all rendered, until the end of its input. Workers can be
+ * driven through any pipe or socket.
+ * @param render        Rendering settings
+ * @param width,height  Size of the whole image
+ * @param input         Ranges of tiles to be rendered
+ * @param output        Tile file
+ */
+void render_worker(RENDER* render, int width, int height, FILE* input, FILE* output);
+
+/**
+ * Renders the whole image with local worker processes, forked from the
+ * calling process and driven through pipes. Ranges of tiles are handed
+ * out one at a time, each worker being given the next range as soon as it
+ * sends back its tiles, so that faster workers render more tiles. Each
+ * worker runs the given number of threads, or its share of the processors.
+ * The statistics of the workers are not added to the ones of the calling
+ * process. Exits when a worker fails.
+ * @param render    Rendering settings, the image being the whole image
+ * @param n_workers Number of worker processes
+ */
+void render_distribute(RENDER* render, size_t n_workers);
+
+#endif
@@ -0,0 +1,622 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+#include "vector.h"
+#include "scene.h"
+#include "ray.h"
+#include "packet.h"
+#include "batch.h"
+#include "render.h"
+#include "checkpoint.h"
+#include "stats.h"
+
+/**
+ * Double ended queue of tile indices owned by a worker thread. The owner
+ * takes tiles from the back, other workers steal from the front.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  size_t head;
+  size_t tail;
+  size_t* tiles;
+} TILE_QUEUE;
+
+/**
+ * Tile and its position along the Hilbert curve over the tiles.
+ */
+typedef struct {
+  uint64_t key;
+  size_t tile;
+} TILE_KEY;
+
+typedef struct {
+  RENDER* render;
+  TILE* tiles;
+  TILE_QUEUE* queues;
+  size_t n_queues;
+  size_t id;
+} WORKER;
+
+size_t render_processors() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (size_t)n : 1;
+}
+
+/**
+ * Height of the whole image, which is only partly held in memory while
+ * streaming or rendering a range of tiles.
+ */
+static int image_height(RENDER* render) {
+  return (render->height > 0) ? render->height : render->image->height;
+}
+
+/**
+ * Writes the averaged color of a pixel square to the image, or adds the
+ * summed color to its accumulation buffer.
+ * @param samples Number of samples summed in color
+ */
+static void write_pixel(RENDER* render, int x, int y, float* color, int samples) {
+  y -= render->band;
+  if(render->image->accumulation != NULL) {
+    image_accumulate(render->image, x, y, render->resolution, color, samples);
+    return;
+  }
+
+  // converts color to the [0, 255] range
+  v_mul(255.0f/samples, color, color);
+  v_clamp(color, 0, 255, color);
+
+  // write to the image
+  if(render->resolution == 1)
+    image_setpixel(render->image, x, y, color[0], color[1], color[2]);
+  else
+    image_setpixels_square(render->image, x, y, render->resolution, color[0], color[1], color[2]);
+}
+
+/**
+ * Calculates the ray of an anti-aliasing sample.
+ * @param grid   Squares of a tile and of the ring around it
+ * @param square Index of the pixel square in the grid, column by column
+ * @param sample Index of the sample in the anti-aliasing grid
+ */
+static void sample_ray(RENDER* render, const TILE* grid, int square, int sample, RAY* ray) {
+  int antialias = render->antialias;
+  int squares_y = (grid->height + render->resolution - 1)/render->resolution;
+  int x = grid->x + square/squares_y * render->resolution;
+  int y = grid->y + square%squares_y * render->resolution;
+  int xx = sample/antialias;
+  int yy = sample%antialias;
+
+  // initialize rays with near and far values
+  ray->near = 0.001f;
+  ray->far = 1000.0f;
+  camera_ray(&render->camera, x + (float)xx/antialias, y + (float)yy/antialias, ray);
+}
+
+/**
+ * Adds intersection tests to the cost of a pixel square in the heatmap.
+ * The tests of the ring around the tile are added to the nearest square
+ * of the tile, the squares of the ring belonging to other tiles.
+ */
+static void add_cost(RENDER* render, const TILE* grid, int square, float cost) {
+  int squares_y = (grid->height + render->resolution - 1)/render->resolution;
+  int squares_x = (grid->width + render->resolution - 1)/render->resolution;
+  int i = square/squares_y;
+  int j = square%squares_y;
+  int x, y;
+  float rgb[3] = { cost, cost, cost };
+
+  i = (i < 1) ? 1 : (i > squares_x - 2) ? squares_x - 2 : i;
+  j = (j < 1) ? 1 : (j > squares_y - 2) ? squares_y - 2 : j;
+  x = grid->x + i * render->resolution;
+  y = grid->y + j * render->resolution;
+
+  image_accumulate(render->heatmap, x, y, render->resolution, rgb, 0.0f);
+}
+
+/**
+ * Draws the costs of the heatmap, scaled by the highest one, with a blue,
+ * green, red color ramp.
+ */
+static void resolve_heatmap(IMAGE* heatmap) {
+  size_t i, n = (size_t)heatmap->width * heatmap->height;
+  float highest = 0.0f;
+  float c;
+
+  for(i = 0; i < n; i++) {
+    if(heatmap->accumulation[i*3] > highest)
+      highest = heatmap->accumulation[i*3];
+  }
+  for(i = 0; i < n; i++) {
+    c = (highest > 0.0f) ? heatmap->accumulation[i*3]/highest : 0.0f;
+    if(c < 0.5f)
+      heatmap->data[i] = ((u_int)(510*c) << 8) | (u_int)(255*(1 - 2*c));
+    else
+      heatmap->data[i] = ((u_int)(255*(2*c - 1)) << 16) | ((u_int)(510*(1 - c)) << 8);
+  }
+}
+
+/**
+ * Traces the samples of trace_samples in a single batch.
+ */
+static void trace_batch(RENDER* render, const TILE* grid, const int* squares, int n_squares,
+                        int first, int last, float* color) {
+  int per_square = last - first;
+  int samples = n_squares * per_square;
+  RAY* rays = (RAY*)malloc(sizeof(RAY) * samples);
+  float (*colors)[3] = (float (*)[3])malloc(sizeof(float) * 3 * samples);
+  unsigned long long cost = 0;
+  int sample, square;
+
+  for(sample = 0; sample < samples; sample++)
+    sample_ray(render, grid, squares[sample/per_square], first + sample%per_square, &rays[sample]);
+
+  stats_count(STATS_PRIMARY_RAYS, samples);
+  if(render->heatmap != NULL)
+    cost = stats_cost();
+  ray_trace_batch(rays, samples, render->scene, colors);
+  for(sample = 0; sample < samples; sample++) {
+    square = squares[sample/per_square];
+    v_add(&color[square*3], colors[sample], &color[square*3]);
+  }
+
+  if(render->heatmap != NULL) {
+    cost = stats_cost() - cost;
+    for(sample = 0; sample < samples; sample++)
+      add_cost(render, grid, squares[sample/per_square], (float)cost/samples);
+  }
+  free(colors);
+  free(rays);
+}
+
+/**
+ * Traces the samples first to last - 1 of the anti-aliasing grid of some
+ * pixel squares of a tile and of the ring around it, and adds their
+ * colors to the squares colors.
+ * The samples of a square and of the next ones are traced together in
+ * packets, or one ray at a time, both adding them up in the same order.
+ * @param grid      Squares of the tile and of the ring around it
+ * @param squares   Indices of the squares in the grid
+ * @param n_squares Number of squares
+ * @param color     Summed colors of every square of the grid
+ */
+static void trace_samples(RENDER* render, const TILE* grid, const int* squares, int n_squares,
+                          int first, int last, float* color) {
+  RAY rays[SIMD_WIDTH];
+  float colors[SIMD_WIDTH][3];
+  int targets[SIMD_WIDTH];
+  int per_square = last - first;
+  int samples = n_squares * per_square;
+  int n, lane, sample;
+  int width = render->packets ? SIMD_WIDTH : 1;
+  unsigned long long cost = 0;
+
+  if(render->batch) {
+    trace_batch(render, grid, squares, n_squares, first, last, color);
+    return;
+  }
+
+  for(sample = 0; sample < samples;) {
+    // fill the packet with the next samples
+    for(n = 0; n < width && sample < samples; n++, sample++) {
+      targets[n] = squares[sample/per_square];
+      sample_ray(render, grid, targets[n], first + sample%per_square, &rays[n]);
+    }
+
+    stats_count(STATS_PRIMARY_RAYS, n);
+    if(render->heatmap != NULL)
+      cost = stats_cost();
+    if(render->packets)
+      ray_trace_packet(rays, n, render->scene, colors);
+    else
+      ray_trace(&rays[0], render->scene, colors[0]);
+    for(lane = 0; lane < n; lane++) {
+      v_add(&color[targets[lane]*3], colors[lane], &color[targets[lane]*3]);
+    }
+
+    // the tests of a packet are shared by its lanes
+    if(render->heatmap != NULL) {
+      cost = stats_cost() - cost;
+      for(lane = 0; lane < n; lane++)
+        add_cost(render, grid, targets[lane], (float)cost/n);
+    }
+  }
+}
+
+/**
+ * Tells whether the color of a pixel square differs from the color of any
+ * of its 8 neighbours in the grid by more than the adaptive threshold,
+ * the squares of the ring around the tile included.
+ * @param samples             Number of samples of each square, 0 for the squares out of the image
+ * @param squares_y,squares_x Number of squares of the grid along y and along x, stored column by column
+ */
+static bool refines(RENDER* render, const float* color, const int* samples, int square, int squares_y, int squares_x) {
+  int dx, dy, k, i;
+  int x = square/squares_y;
+  int y = square%squares_y;
+  const float* neighbour;
+
+  for(dx = -1; dx <= 1; dx++)
+  for(dy = -1; dy <= 1; dy++) {
+    if(x + dx < 0 || x + dx >= squares_x || y + dy < 0 || y + dy >= squares_y)
+      continue;
+    i = (x + dx)*squares_y + y + dy;
+    if(samples[i] == 0)
+      continue;
+    neighbour = &color[i*3];
+    for(k = 0; k < 3; k++) {
+      if(fabsf(color[square*3 + k] - neighbour[k]) > render->threshold)
+        return true;
+    }
+  }
+  return false;
+}
+
+void render_tile(RENDER* render, const TILE* tile) {
+  double start = stats_start();
+  int x, y;
+  int i, n, n_ring, n_refined;
+  int res = render->resolution;
+  int antialias = render->antialias*render->antialias;
+  // the first samples of a ring of squares around the tile compare the
+  // squares along its border with the ones of the next tiles
+  TILE grid = { tile->x - res, tile->y - res, tile->width + 2*res, tile->height + 2*res };
+  // the squares of the grid are stored column by column
+  int squares_y = (grid.height + res - 1)/res;
+  int squares_x = (grid.width + res - 1)/res;
+  int squares = squares_x * squares_y;
+  bool refine = render->threshold > 0.0f && antialias > 1;
+  float* color = (float*)calloc(squares*3, sizeof(float));
+  int* indices = (int*)calloc(squares, sizeof(int));
+  int* refined = (int*)malloc(squares*sizeof(int));
+  int* samples = (int*)malloc(squares*sizeof(int));
+
+  // the squares of the tile, followed by the ones of the ring in the image
+  for(i = 0, n = 0, n_ring = 0; i < squares; i++) {
+    x = grid.x + i/squares_y * res;
+    y = grid.y + i%squares_y * res;
+    samples[i] = 0;
+    if(x >= tile->x && x < tile->x + tile->width && y >= tile->y && y < tile->y + tile->height) {
+      indices[n++] = i;
+      samples[i] = antialias;
+    } else if(refine && x >= 0 && x < render->image->width && y >= 0 && y < image_height(render)) {
+      refined[n_ring++] = i;
+      samples[i] = 1;
+    }
+  }
+  memcpy(&indices[n], refined, n_ring*sizeof(int));
+
+  if(!refine) {
+    trace_samples(render, &grid, indices, n, 0, antialias, color);
+  } else {
+    // one sample per square, then the whole grid for the squares of the
+    // tile that differ from a neighbour
+    trace_samples(render, &grid, indices, n + n_ring, 0, 1, color);
+    for(i = 0, n_refined = 0; i < n; i++) {
+      if(refines(render, color, samples, indices[i], squares_y, squares_x))
+        refined[n_refined++] = indices[i];
+      else
+        samples[indices[i]] = 1;
+    }
+    trace_samples(render, &grid, refined, n_refined, 1, antialias, color);
+  }
+
+  for(i = 0; i < n; i++) {
+    x = grid.x + indices[i]/squares_y * res;
+    y = grid.y + indices[i]%squares_y * res;
+    write_pixel(render, x, y, &color[indices[i]*3], samples[indices[i]]);
+  }
+  free(samples);
+  free(refined);
+  free(indices);
+  free(color);
+  stats_time(STATS_TRACE, start);
+}
+
+/**
+ * Takes the next tile from the worker own queue, or steals one from the
+ * front of another queue.
+ * @return Index of the tile, or -1 when every queue is empty
+ */
+static long next_tile(WORKER* worker) {
+  size_t i, q;
+  long tile = -1;
+  TILE_QUEUE* queue = &worker->queues[worker->id];
+
+  pthread_mutex_lock(&queue->lock);
+  if(queue->head < queue->tail)
+    tile = queue->tiles[--queue->tail];
+  pthread_mutex_unlock(&queue->lock);
+
+  for(i = 1; tile < 0 && i < worker->n_queues; i++) {
+    q = (worker->id + i) % worker->n_queues;
+    queue = &worker->queues[q];
+    pthread_mutex_lock(&queue->lock);
+    if(queue->head < queue->tail)
+      tile = queue->tiles[queue->head++];
+    pthread_mutex_unlock(&queue->lock);
+  }
+  return tile;
+}
+
+static void* work(void* data) {
+  WORKER* worker = (WORKER*)data;
+  long tile;
+
+  while((tile = next_tile(worker)) >= 0) {
+    render_tile(worker->render, &worker->tiles[tile]);
+    if(worker->render->checkpoint != NULL)
+      checkpoint_tile(worker->render->checkpoint, tile);
+  }
+  stats_merge();
+  return NULL;
+}
+
+/**
+ * Position of a cell along the Hilbert curve filling a square grid.
+ * @param side Side of the grid, a power of 2
+ * @param x,y  Cell
+ */
+static uint64_t hilbert(uint64_t side, uint64_t x, uint64_t y) {
+  uint64_t s, rx, ry, t, d = 0;
+
+  for(s = side/2; s > 0; s /= 2) {
+    rx = (x & s) > 0;
+    ry = (y & s) > 0;
+    d += s*s*((3*rx) ^ ry);
+    // the quadrant is turned so that the curve goes on from its entrance
+    if(ry == 0) {
+      if(rx == 1) {
+        x = side - 1 - x;
+        y = side - 1 - y;
+      }
+      t = x;
+      x = y;
+      y = t;
+    }
+  }
+  return d;
+}
+
+static int compare_keys(const void* a, const void* b) {
+  uint64_t u = ((const TILE_KEY*)a)->key;
+  uint64_t v = ((const TILE_KEY*)b)->key;
+  return (u > v) - (u < v);
+}
+
+/**
+ * Orders tiles, numbered row by row, along a Hilbert curve over the grid
+ * of tiles: tiles which are close along the curve are close in the image.
+ * @param pending Tiles to be ordered
+ * @param columns Number of tiles of a row
+ */
+static void hilbert_order(size_t* pending, size_t n, size_t columns) {
+  TILE_KEY* keys = (TILE_KEY*)malloc(sizeof(TILE_KEY) * (n + 1));
+  uint64_t side = 1;
+  size_t i;
+
+  for(i = 0; i < n; i++) {
+    while(side < columns || side <= pending[i]/columns)
+      side *= 2;
+  }
+  for(i = 0; i < n; i++) {
+    keys[i].key = hilbert(side, pending[i]%columns, pending[i]/columns);
+    keys[i].tile = pending[i];
+  }
+  qsort(keys, n, sizeof(TILE_KEY), compare_keys);
+  for(i = 0; i < n; i++)
+    pending[i] = keys[i].tile;
+  free(keys);
+}
+
+/**
+ * Renders the rows top to bottom - 1 of the image with the worker threads.
+ * @param size       Size of the tile side, aligned to the pixel squares
+ * @param first,last Range of the tiles of the rows to be rendered, row by row
+ */
+static void render_rows(RENDER* render, int size, int top, int bottom, size_t first, size_t last) {
+  size_t i, n, n_tiles, n_pending, columns;
+  size_t n_threads;
+  int x, y;
+  int width = render->image->width;
+  TILE* tiles;
+  size_t* pending;
+  TILE_QUEUE* queues;
+  WORKER* workers;
+  pthread_t* threads;
+
+  // the lights and hierarchies are only built by scene_prepare
+  if(!render->scene->prepared) {
+    fprintf(stderr, "Error, the scene must be prepared before rendering\n");
+    exit(1);
+  }
+
+  columns = (width + size - 1)/size;
+  n_tiles = columns * ((bottom - top + size - 1)/size);
+  tiles = (TILE*)malloc(sizeof(TILE) * n_tiles);
+  for(y = top, n = 0; y < bottom; y += size)
+  for(x = 0; x < width; x += size, n++) {
+    tiles[n].x = x;
+    tiles[n].y = y;
+    tiles[n].width = (x + size > width) ? width - x : size;
+    tiles[n].height = (y + size > bottom) ? bottom - y : size;
+  }
+
+  // a resumed render only renders the tiles it had not completed
+  pending = (size_t*)malloc(sizeof(size_t) * (n_tiles + 1));
+  if(render->checkpoint != NULL)
+    checkpoint_begin(render->checkpoint, render, tiles, n_tiles);
+  if(last > n_tiles)
+    last = n_tiles;
+  for(n = first, n_pending = 0; n < last; n++) {
+    if(render->checkpoint == NULL || !checkpoint_done(render->checkpoint, n))
+      pending[n_pending++] = n;
+  }
+
+  n_threads = (render->n_threads > 0) ? render->n_threads : render_processors();
+  if(n_threads > n_pending)
+    n_threads = n_pending;
+
+  // deal contiguous runs of the curve to each thread, neighbouring tiles
+  // share most of their geometry
+  hilbert_order(pending, n_pending, columns);
+  queues = (TILE_QUEUE*)malloc(sizeof(TILE_QUEUE) * n_threads);
+  workers = (WORKER*)malloc(sizeof(WORKER) * n_threads);
+  threads = (pthread_t*)malloc(sizeof(pthread_t) * n_threads);
+  for(i = 0; i < n_threads; i++) {
+    pthread_mutex_init(&queues[i].lock, NULL);
+    queues[i].head = 0;
+    queues[i].tail = 0;
+    queues[i].tiles = (size_t*)malloc(sizeof(size_t) * (n_pending/n_threads + 1));
+    for(n = i*n_pending/n_threads; n < (i + 1)*n_pending/n_threads; n++)
+      queues[i].tiles[queues[i].tail++] = pending[n];
+
+    workers[i].render = render;
+    workers[i].tiles = tiles;
+    workers[i].queues = queues;
+    workers[i].n_queues = n_threads;
+    workers[i].id = i;
+  }
+
+  // the calling thread works as the first worker
+  for(i = 1; i < n_threads; i++) {
+    if(pthread_create(&threads[i], NULL, work, &workers[i]) != 0) {
+      fprintf(stderr, "Error while creating render thread %zu\n", i);
+      exit(1);
+    }
+  }
+  if(n_threads > 0)
+    work(&workers[0]);
+  for(i = 1; i < n_threads; i++)
+    pthread_join(threads[i], NULL);
+  if(render->checkpoint != NULL)
+    checkpoint_end(render->checkpoint);
+
+  for(i = 0; i < n_threads; i++) {
+    pthread_mutex_destroy(&queues[i].lock);
+    free(queues[i].tiles);
+  }
+  free(threads);
+  free(workers);
+  free(queues);
+  free(pending);
+  free(tiles);
+}
+
+/**
+ * Renders the image of a stream a band of rows at a time, in a band image
+ * reused from one band to the next.
+ */
+static void render_stream(RENDER* render, int size) {
+  int width = render->stream->width;
+  int height = render->stream->height;
+  int columns = (width + size - 1)/size;
+  size_t n_threads = (render->n_threads > 0) ? render->n_threads : render_processors();
+  int rows;
+
+  if(render->heatmap != NULL || render->checkpoint != NULL) {
+    fprintf(stderr, "Error, heatmaps and checkpoints need the whole image and cannot be streamed\n");
+    exit(1);
+  }
+
+  // bands hold enough tiles to keep every thread busy until their end
+  rows = size * ((4*n_threads + columns - 1)/columns);
+  camera_resize(&render->camera, width, height);
+  render->image = image(width, rows);
+  render->height = height;
+  for(render->band = 0; render->band < height; render->band += rows) {
+    image_accumulation(render->image);
+    render_rows(render, size, render->band, (render->band + rows < height) ? render->band + rows : height,
+                0, SIZE_MAX);
+    image_resolve(render->image);
+    image_stream_rows(render->stream, render->image, rows);
+  }
+
+  image_free(render->image);
+  render->image = NULL;
+  render->band = 0;
+  render->height = 0;
+}
+
+/**
+ * Size of the tile side, aligned to the pixel squares.
+ */
+static int tile_size(RENDER* render) {
+  int size = (render->tile_size > 0) ? render->tile_size : RENDER_TILE_SIZE;
+
+  if(size % render->resolution != 0)
+    size += render->resolution - size % render->resolution;
+  return size;
+}
+
+size_t render_tile_count(RENDER* render, int width, int height) {
+  int size = tile_size(render);
+
+  return (size_t)((width + size - 1)/size) * ((height + size - 1)/size);
+}
+
+void render_range(RENDER* render, int width, int height, size_t first, size_t last, FILE* output) {
+  int size = tile_size(render);
+  size_t columns = (width + size - 1)/size;
+  size_t n_tiles = render_tile_count(render, width, height);
+  size_t i;
+  int top, bottom, x, y;
+
+  if(render->heatmap != NULL || render->checkpoint != NULL || render->stream != NULL) {
+    fprintf(stderr, "Error, heatmaps, checkpoints and streams need the whole image\n");
+    exit(1);
+  }
+  if(last > n_tiles)
+    last = n_tiles;
+  if(first >= last)
+    return;
+
+  // the band holds the rows of tiles of the range
+  top = first/columns * size;
+  bottom = ((last - 1)/columns + 1) * size;
+  if(bottom > height)
+    bottom = height;
+  camera_resize(&render->camera, width, height);
+  render->image = image(width, bottom - top);
+  render->band = top;
+  render->height = height;
+  image_accumulation(render->image);
+  render_rows(render, size, top, bottom, first - top/size*columns, last - top/size*columns);
+  image_resolve(render->image);
+
+  for(i = first; i < last; i++) {
+    x = i%columns * size;
+    y = i/columns * size;
+    image_write_tile(output, render->image, x, y, (x + size > width) ? width - x : size,
+                     (y + size > height) ? height - y : size, top);
+  }
+
+  image_free(render->image);
+  render->image = NULL;
+  render->band = 0;
+  render->height = 0;
+}
+
+void render(RENDER* render) {
+  int size = tile_size(render);
+
+  if(render->stream != NULL) {
+    render_stream(render, size);
+    return;
+  }
+
+  camera_resize(&render->camera, render->image->width, render->image->height);
+  render->band = 0;
+  if(render->heatmap != NULL)
+    image_accumulation(render->heatmap);
+
+  render_rows(render, size, 0, render->image->height, 0, SIZE_MAX);
+
+  if(render->image->accumulation != NULL)
+    image_resolve(render->image);
+  if(render->heatmap != NULL)
+    resolve_heatmap(render->heatmap);
+}
@@ -0,0 +1,116 @@
+/**!
+ * Defines the tile based renderer, which raytraces a scene into an image
+ * with a pool of worker threads.
+ */
+#ifndef RENDER_H_
+#define RENDER_H_
+
+#include <stdlib.h>
+#include "image.h"
+#include "camera.h"
+
+#define RENDER_TILE_SIZE 32
+
+struct SCENE;
+struct CHECKPOINT;
+
+/**
+ * Rectangular region of the image rendered as a unit of work.
+ */
+typedef struct {
+  int x, y;          /**< Top left pixel of the tile */
+  int width, height; /**< Size of the tile in pixels */
+} TILE;
+
+/**
+ * Rendering settings and the target image.
+ */
+typedef struct RENDER {
+  struct SCENE* scene;
+  IMAGE* image;      /**< Target image, or the band being rendered when streaming */
+
+  CAMERA camera;     /**< Camera of the primary rays, sized to the image by the renderer */
+  int resolution;    /**< Size of the pixel squares each traced color is written to */
+  int antialias;     /**< Samples per pixel side */
+  float threshold;   /**< Color difference between neighbouring pixels above which they
+                          are anti-aliased, 0 to anti-alias every pixel */
+  int packets;       /**< Trace coherent rays together in SIMD packets */
+  int batch;         /**< Trace the samples of a tile together breadth first, shading their
+                          hits sorted by material */
+
+  int tile_size;     /**< Size of the tile side in pixels */
+  size_t n_threads;  /**< Number of worker threads, 0 for one per processor */
+
+  IMAGE* heatmap;    /**< Image of the intersection tests made for each pixel, or NULL */
+
+  IMAGE_STREAM* stream; /**< Output the image is written to band by band, or NULL to render
+                             the whole image in memory */
+  int band;          /**< First row of the image held in memory, while streaming or
+                          rendering a range of tiles */
+  int height;        /**< Height of the whole image while only a band of it is held in
+                          memory, 0 otherwise */
+  struct CHECKPOINT* checkpoint; /**< Progress saved periodically and resumed, or NULL */
+} RENDER;
+
+/**
+ * Renders the whole image. The image is split into tiles which are
+ * distributed between the worker threads in runs following a Hilbert
+ * curve over the tiles, so that the tiles of a thread are close to each
+ * other; threads that run out of tiles steal the remaining tiles of other
+ * threads.
+ * If the image has an accumulation buffer, samples are added to it and
+ * the image is resolved once every tile is done.
+ * With a stream, the image has the size of the stream and is not given:
+ * it is rendered a band of rows of tiles at a time, each band being
+ * resolved and written as soon as it is done, so that the memory used
+ * depends on the width of the image only.
+ * With a checkpoint, the tiles already completed by a resumed render are
+ * skipped, and the completed tiles are saved periodically. Streamed
+ * images cannot be checkpointed. When a heatmap image of
+ * the same size is given, the number of intersection tests of each pixel
+ * is drawn to it, from blue for the cheapest pixels to red for the most
+ * expensive ones. It needs the statistics to be compiled in, and batches
+ * spread their tests evenly over their samples. Heatmaps need the whole
+ * image and cannot be streamed.
+ * @param render Rendering settings
+ */
+void render(RENDER* render);
+
+/**
+ * Returns the number of tiles of an image, which are numbered row by row.
+ * @param render        Rendering settings
+ * @param width,height  Size of the whole image
+ */
+size_t render_tile_count(RENDER* render, int width, int height);
+
+/**
+ * Renders the tiles first to last - 1 of an image, numbered row by row,
+ * and writes them to a tile file. Only the band of rows holding these
+ * tiles is kept in memory, the image of the settings is not used. Each
+ * tile is rendered exactly as in a render of the whole image.
+ * @param render        Rendering settings
+ * @param width,height  Size of the whole image
+ * @param first,last    Range of tiles, last being clamped to the number of tiles
+ * @param output        Tile file, whose header is already written
+ */
+void render_range(RENDER* render, int width, int height, size_t first, size_t last, FILE* output);
+
+/**
+ * Renders a single tile of the image on the calling thread.
+ * With an adaptive threshold, every pixel square is first traced with a
+ * single sample, and only the squares whose color differs from one of
+ * their neighbours are traced with the whole anti-aliasing grid. The
+ * squares of the ring around the tile are traced with a single sample as
+ * well, so that the squares along its border are compared with their
+ * neighbours of the next tiles while tiles are still rendered apart.
+ * @param render Rendering settings
+ * @param tile   Tile to be rendered
+ */
+void render_tile(RENDER* render, const TILE* tile);
+
+/**
+ * Returns the number of processors available to the renderer.
+ */
+size_t render_processors();
+
+#endif
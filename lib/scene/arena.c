@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+/**
+ * Size of the block header, keeping the memory after it aligned.
+ */
+#define ARENA_HEADER ((sizeof(ARENA_BLOCK) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+static ARENA_BLOCK* arena_block(size_t size) {
+  ARENA_BLOCK* block;
+
+  if(posix_memalign((void**)&block, ARENA_ALIGNMENT, ARENA_HEADER + size) != 0) {
+    fprintf(stderr, "Error while allocating an arena block of %zu bytes\n", size);
+    exit(1);
+  }
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+ARENA* arena() {
+  ARENA* arena = (ARENA*)malloc(sizeof(ARENA));
+  arena->blocks = NULL;
+  arena->allocated = 0;
+  return arena;
+}
+
+void* arena_alloc(ARENA* arena, size_t size) {
+  ARENA_BLOCK* block = arena->blocks;
+
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  arena->allocated += size;
+
+  if(size > ARENA_BLOCK_SIZE/4) {
+    // large arrays get their own block, behind the current one so that
+    // its remaining space is still used
+    block = arena_block(size);
+    block->used = size;
+    if(arena->blocks != NULL) {
+      block->next = arena->blocks->next;
+      arena->blocks->next = block;
+    } else {
+      arena->blocks = block;
+    }
+    return (char*)block + ARENA_HEADER;
+  }
+
+  if(block == NULL || block->used + size > block->size) {
+    block = arena_block(ARENA_BLOCK_SIZE);
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+  block->used += size;
+  return (char*)block + ARENA_HEADER + block->used - size;
+}
+
+char* arena_strdup(ARENA* arena, const char* string) {
+  size_t n = strlen(string) + 1;
+  return (char*)memcpy(arena_alloc(arena, n), string, n);
+}
+
+void arena_free(ARENA* arena) {
+  ARENA_BLOCK* block;
+
+  while((block = arena->blocks) != NULL) {
+    arena->blocks = block->next;
+    free(block);
+  }
+  free(arena);
+}
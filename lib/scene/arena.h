@@ -0,0 +1,55 @@
+/**
+ * Defines a memory arena, which hands out memory from large blocks and
+ * frees all of it at once. Used for the data of loaded scenes.
+ */
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stdlib.h>
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define ARENA_ALIGNMENT  32
+
+/**
+ * Block of memory of an arena, allocations are taken from its end.
+ */
+typedef struct ARENA_BLOCK {
+  struct ARENA_BLOCK* next;
+  size_t size;
+  size_t used;
+} ARENA_BLOCK;
+
+typedef struct ARENA {
+  ARENA_BLOCK* blocks; /**< most recent block first */
+  size_t allocated;    /**< total bytes handed out */
+} ARENA;
+
+/**
+ * Creates an empty arena.
+ * @return Pointer to the allocated struct
+ */
+ARENA* arena();
+
+/**
+ * Allocates memory from an arena, aligned to ARENA_ALIGNMENT bytes. Large
+ * allocations get a block of their own.
+ * @param arena Arena
+ * @param size  Number of bytes
+ * @return Pointer to the memory, valid until the arena is freed
+ */
+void* arena_alloc(ARENA* arena, size_t size);
+
+/**
+ * Allocates a copy of a string in an arena.
+ * @param arena  Arena
+ * @param string String to be copied
+ */
+char* arena_strdup(ARENA* arena, const char* string);
+
+/**
+ * Frees an arena and every allocation made from it.
+ * @param arena Arena
+ */
+void arena_free(ARENA* arena);
+
+#endif
@@ -0,0 +1,622 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include "vector.h"
+#include "simd.h"
+#include "solid.h"
+#include "bvh.h"
+#include "stats.h"
+
+/**
+ * Bounds of a primitive, only used while building.
+ */
+typedef struct {
+  float min[3];
+  float max[3];
+  float centroid[3];
+} BVH_BOX;
+
+typedef struct {
+  BVH* bvh;
+  BVH_BOX* boxes;
+} BVH_BUILD;
+
+static void box_empty(float* min, float* max) {
+  v_set(min, FLT_MAX, FLT_MAX, FLT_MAX);
+  v_set(max, -FLT_MAX, -FLT_MAX, -FLT_MAX);
+}
+
+static void box_grow(float* min, float* max, const float* bmin, const float* bmax) {
+  int k;
+  for(k = 0; k < 3; k++) {
+    min[k] = fminf(min[k], bmin[k]);
+    max[k] = fmaxf(max[k], bmax[k]);
+  }
+}
+
+static float box_area(const float* min, const float* max) {
+  float d[3];
+  v_sub(max, min, d);
+  if(d[0] < 0.0f || d[1] < 0.0f || d[2] < 0.0f)
+    return 0.0f;
+  return 2.0f*(d[0]*d[1] + d[1]*d[2] + d[2]*d[0]);
+}
+
+static void swap_primitives(BVH_BUILD* b, size_t i, size_t j) {
+  BVH_PRIMITIVE p = b->bvh->primitives[i];
+  BVH_BOX box = b->boxes[i];
+  b->bvh->primitives[i] = b->bvh->primitives[j];
+  b->boxes[i] = b->boxes[j];
+  b->bvh->primitives[j] = p;
+  b->boxes[j] = box;
+}
+
+/**
+ * Builds the node of the primitives begin to end - 1 and its subtree.
+ * Nodes at depth BVH_STACK_SIZE - 1 are leaves, so that the traversals
+ * never hold more than BVH_STACK_SIZE nodes on their stack.
+ * @param depth Depth of the node, 0 for the root
+ */
+static size_t build(BVH_BUILD* b, size_t begin, size_t end, int depth) {
+  size_t i, mid;
+  int k, axis, split, bin;
+  size_t index = b->bvh->n_nodes++;
+  BVH_NODE* node = &b->bvh->nodes[index];
+
+  float cmin[3], cmax[3];
+  float scale, cost, best_cost;
+
+  size_t counts[BVH_BINS];
+  float bmin[BVH_BINS][3], bmax[BVH_BINS][3];
+  float lmin[3], lmax[3], rmin[3], rmax[3];
+  float left_area[BVH_BINS];
+  size_t left_count[BVH_BINS];
+  size_t right_count;
+
+  box_empty(node->min, node->max);
+  box_empty(cmin, cmax);
+  for(i = begin; i < end; i++) {
+    box_grow(node->min, node->max, b->boxes[i].min, b->boxes[i].max);
+    box_grow(cmin, cmax, b->boxes[i].centroid, b->boxes[i].centroid);
+  }
+
+  node->offset = begin;
+  node->count = end - begin;
+  node->axis = 0;
+  if(end - begin <= 1)
+    return index;
+  if(depth >= BVH_STACK_SIZE - 1) {
+    if(end - begin > USHRT_MAX) {
+      fprintf(stderr, "Error, %zu primitives are left at the deepest level of the hierarchy\n", end - begin);
+      exit(1);
+    }
+    return index;
+  }
+
+  // find the cheapest binned split along any axis
+  best_cost = FLT_MAX;
+  axis = -1;
+  split = 0;
+  for(k = 0; k < 3; k++) {
+    if(cmax[k] - cmin[k] <= 0.0f)
+      continue;
+    scale = BVH_BINS / (cmax[k] - cmin[k]);
+
+    for(bin = 0; bin < BVH_BINS; bin++) {
+      counts[bin] = 0;
+      box_empty(bmin[bin], bmax[bin]);
+    }
+    for(i = begin; i < end; i++) {
+      bin = (int)((b->boxes[i].centroid[k] - cmin[k]) * scale);
+      if(bin >= BVH_BINS) bin = BVH_BINS - 1;
+      counts[bin]++;
+      box_grow(bmin[bin], bmax[bin], b->boxes[i].min, b->boxes[i].max);
+    }
+
+    // sweep from the left, then from the right evaluating each plane
+    box_empty(lmin, lmax);
+    for(bin = 0, i = 0; bin < BVH_BINS - 1; bin++) {
+      i += counts[bin];
+      box_grow(lmin, lmax, bmin[bin], bmax[bin]);
+      left_count[bin] = i;
+      left_area[bin] = box_area(lmin, lmax);
+    }
+    box_empty(rmin, rmax);
+    for(bin = BVH_BINS - 1, right_count = 0; bin > 0; bin--) {
+      right_count += counts[bin];
+      box_grow(rmin, rmax, bmin[bin], bmax[bin]);
+      if(left_count[bin - 1] == 0 || right_count == 0)
+        continue;
+      cost = left_count[bin - 1]*left_area[bin - 1] + right_count*box_area(rmin, rmax);
+      if(cost < best_cost) {
+        best_cost = cost;
+        axis = k;
+        split = bin;
+      }
+    }
+  }
+
+  if(axis < 0) {
+    // every centroid is in the same place, split in the middle
+    if(end - begin <= BVH_LEAF_SIZE)
+      return index;
+    mid = begin + (end - begin)/2;
+    axis = 0;
+  } else {
+    // the split is only worth it if it is cheaper than intersecting every primitive
+    if(end - begin <= BVH_LEAF_SIZE && best_cost >= (end - begin)*box_area(node->min, node->max))
+      return index;
+
+    scale = BVH_BINS / (cmax[axis] - cmin[axis]);
+    mid = begin;
+    for(i = begin; i < end; i++) {
+      bin = (int)((b->boxes[i].centroid[axis] - cmin[axis]) * scale);
+      if(bin >= BVH_BINS) bin = BVH_BINS - 1;
+      if(bin < split)
+        swap_primitives(b, i, mid++);
+    }
+  }
+
+  build(b, begin, mid, depth + 1);
+  // the node array does not move, it was allocated for the worst case
+  node->offset = build(b, mid, end, depth + 1);
+  node->count = 0;
+  node->axis = axis;
+  return index;
+}
+
+BVH* bvh(SOLID* solids, size_t n) {
+  size_t s, p, i;
+  BVH_BUILD b;
+  BVH* bvh = (BVH*)malloc(sizeof(BVH));
+
+  bvh->n_primitives = 0;
+  bvh->n_unbounded = 0;
+  for(s = 0; s < n; s++) {
+    p = solid_primitives(&solids[s]);
+    bvh->n_primitives += p;
+    if(p == 0)
+      bvh->n_unbounded++;
+  }
+
+  bvh->primitives = (BVH_PRIMITIVE*)malloc(sizeof(BVH_PRIMITIVE) * (bvh->n_primitives + 1));
+  bvh->unbounded = (u_int*)malloc(sizeof(u_int) * (bvh->n_unbounded + 1));
+  bvh->nodes = (BVH_NODE*)malloc(sizeof(BVH_NODE) * (2*bvh->n_primitives + 1));
+  bvh->n_nodes = 0;
+  b.bvh = bvh;
+  b.boxes = (BVH_BOX*)malloc(sizeof(BVH_BOX) * (bvh->n_primitives + 1));
+
+  for(s = 0, i = 0, bvh->n_unbounded = 0; s < n; s++) {
+    p = solid_primitives(&solids[s]);
+    if(p == 0) {
+      bvh->unbounded[bvh->n_unbounded++] = s;
+      continue;
+    }
+    while(p-- > 0) {
+      bvh->primitives[i].solid = s;
+      bvh->primitives[i].primitive = p;
+      solid_bounds(&solids[s], p, b.boxes[i].min, b.boxes[i].max);
+      v_add(b.boxes[i].min, b.boxes[i].max, b.boxes[i].centroid);
+      v_mul(0.5f, b.boxes[i].centroid, b.boxes[i].centroid);
+      i++;
+    }
+  }
+
+  if(bvh->n_primitives > 0)
+    build(&b, 0, bvh->n_primitives, 0);
+
+  free(b.boxes);
+  return bvh;
+}
+
+void bvh_refit(BVH* bvh, SOLID* solids) {
+  BVH_PRIMITIVE* p;
+  BVH_NODE* node;
+  float min[3], max[3];
+  size_t i, j;
+
+  // children are stored after their parent, so they are refitted first
+  for(i = bvh->n_nodes; i-- > 0;) {
+    node = &bvh->nodes[i];
+    box_empty(node->min, node->max);
+    if(node->count == 0) {
+      box_grow(node->min, node->max, node[1].min, node[1].max);
+      box_grow(node->min, node->max, bvh->nodes[node->offset].min, bvh->nodes[node->offset].max);
+      continue;
+    }
+    for(j = node->offset; j < node->offset + node->count; j++) {
+      p = &bvh->primitives[j];
+      solid_bounds(&solids[p->solid], p->primitive, min, max);
+      box_grow(node->min, node->max, min, max);
+    }
+  }
+}
+
+void bvh_free(BVH* bvh) {
+  free(bvh->nodes);
+  free(bvh->primitives);
+  free(bvh->unbounded);
+  free(bvh);
+}
+
+/**
+ * Slab test of a ray against a node box. The far distance is slightly
+ * relaxed so that rounding never culls a primitive lying exactly at the
+ * nearest hit distance (e.g. a mesh face resting on a plane).
+ * @return Entry distance, or FLT_MAX if the box is missed
+ */
+static inline float node_distance(const BVH_NODE* node, const float* origin, const float* inv, float near, float far) {
+  float t0, t1, tmin = -FLT_MAX, tmax = FLT_MAX;
+  int k;
+
+  stats_count(STATS_BOX_TESTS, 1);
+  for(k = 0; k < 3; k++) {
+    t0 = (node->min[k] - origin[k]) * inv[k];
+    t1 = (node->max[k] - origin[k]) * inv[k];
+    tmin = fmaxf(tmin, fminf(t0, t1));
+    tmax = fminf(tmax, fmaxf(t0, t1));
+  }
+  if(tmax < tmin || tmax < near || tmin > far + fabsf(far)*BVH_EPSILON)
+    return FLT_MAX;
+  return tmin;
+}
+
+/**
+ * Tests a primitive and keeps the intersection if it is the nearest so far.
+ * Ties are resolved towards the first solid of the array, as a linear scan does.
+ */
+static inline void test_primitive(SOLID* solid, size_t primitive, RAY* ray, RAY_INTERSECTION* intersection, float* nearest) {
+  RAY_INTERSECTION i;
+  if(solid_primitive_intersection(solid, primitive, ray, &i)
+    && (i.t_in < *nearest || (i.t_in == *nearest && intersection->solid != NULL && solid < intersection->solid))
+    && (i.t_in > ray->near || i.t_out > ray->near)) {
+    *intersection = i;
+    *nearest = i.t_in;
+  }
+}
+
+bool bvh_intersect(BVH* bvh, SOLID* solids, RAY* ray, RAY_INTERSECTION* intersection) {
+  u_int stack[BVH_STACK_SIZE];
+  size_t top = 0;
+  size_t i;
+  float inv[3];
+  float nearest = ray->far;
+  float t_first, t_second;
+  const BVH_NODE* node;
+  const BVH_NODE* first;
+  const BVH_NODE* second;
+  const BVH_PRIMITIVE* p;
+
+  intersection->solid = NULL;
+
+  for(i = 0; i < bvh->n_unbounded; i++)
+    test_primitive(&solids[bvh->unbounded[i]], 0, ray, intersection, &nearest);
+
+  if(bvh->n_nodes == 0)
+    return (intersection->solid != NULL);
+
+  v_set(inv, 1.0f/ray->direction[0], 1.0f/ray->direction[1], 1.0f/ray->direction[2]);
+
+  node = bvh->nodes;
+  if(node_distance(node, ray->origin, inv, ray->near, nearest) == FLT_MAX)
+    return (intersection->solid != NULL);
+
+  for(;;) {
+    if(node->count > 0) {
+      for(p = &bvh->primitives[node->offset]; p < &bvh->primitives[node->offset + node->count]; p++)
+        test_primitive(&solids[p->solid], p->primitive, ray, intersection, &nearest);
+    } else {
+      // visit the nearest child first, defer the other one
+      first = node + 1;
+      second = &bvh->nodes[node->offset];
+      t_first = node_distance(first, ray->origin, inv, ray->near, nearest);
+      t_second = node_distance(second, ray->origin, inv, ray->near, nearest);
+      if(t_second < t_first) {
+        const BVH_NODE* n = first; first = second; second = n;
+        float t = t_first; t_first = t_second; t_second = t;
+      }
+      if(t_first != FLT_MAX) {
+        if(t_second != FLT_MAX)
+          stack[top++] = second - bvh->nodes;
+        node = first;
+        continue;
+      }
+    }
+
+    // pop the next node which is still closer than the nearest hit
+    do {
+      if(top == 0)
+        return (intersection->solid != NULL);
+      node = &bvh->nodes[stack[--top]];
+    } while(node_distance(node, ray->origin, inv, ray->near, nearest) == FLT_MAX);
+  }
+}
+
+/**
+ * Slab test of every lane of a packet against a node box.
+ * @return Bit mask of the lanes that hit the box before their nearest hit
+ */
+static inline int node_packet(const BVH_NODE* node, const RAY_PACKET* packet, SIMD_FLOAT nearest) {
+  SIMD_FLOAT t0, t1, tmin, tmax;
+  int k;
+
+  stats_count(STATS_BOX_TESTS, __builtin_popcount(packet->active));
+  tmin = s_set1(-FLT_MAX);
+  tmax = s_set1(FLT_MAX);
+  for(k = 0; k < 3; k++) {
+    t0 = s_mul(s_sub(s_set1(node->min[k]), packet->origin[k]), packet->inverse[k]);
+    t1 = s_mul(s_sub(s_set1(node->max[k]), packet->origin[k]), packet->inverse[k]);
+    tmin = s_max(tmin, s_min(t0, t1));
+    tmax = s_min(tmax, s_max(t0, t1));
+  }
+  nearest = s_add(nearest, s_mul(s_max(nearest, s_sub(s_set1(0.0f), nearest)), s_set1(BVH_EPSILON)));
+  return packet->active & s_movemask(s_and(s_and(s_ge(tmax, tmin), s_ge(tmax, packet->near)), s_le(tmin, nearest)));
+}
+
+/**
+ * Traverses the object of an instance with the lanes of a packet moved to
+ * object space, keeping for each lane the hit if it is the nearest so far.
+ */
+static void test_instance_packet(SOLID* solid, RAY_PACKET* packet, int lanes, RAY_PACKET_HIT* hit) {
+  OBJECT* object = solid->instance->object;
+  RAY_PACKET local;
+  RAY_PACKET_HIT inner;
+  int accept, lane;
+
+  packet->active = lanes;
+  solid_instance_packet(solid, packet, &local);
+  // only hits nearer than the ones found so far are looked for
+  local.far = hit->t;
+  accept = bvh_intersect_packet(object->bvh, object->solids, &local, &inner) & lanes;
+  if(accept == 0)
+    return;
+
+  hit->t = s_select(s_mask(accept), inner.t, hit->t);
+  for(lane = 0; lane < SIMD_WIDTH; lane++) {
+    if(accept & (1 << lane)) {
+      hit->solid[lane] = inner.solid[lane];
+      hit->primitive[lane] = inner.primitive[lane];
+      hit->instance[lane] = solid;
+    }
+  }
+}
+
+/**
+ * Tests a primitive against a packet and keeps, for each lane, the
+ * intersection if it is the nearest so far.
+ */
+static inline void test_packet(SOLID* solid, size_t primitive, RAY_PACKET* packet, int lanes, RAY_PACKET_HIT* hit) {
+  SIMD_FLOAT t_in, t_out;
+  SIMD_MASK valid, closer;
+  int accept, ties, lane;
+
+  if(solid->function == INSTANCE_SOLID) {
+    test_instance_packet(solid, packet, lanes, hit);
+    return;
+  }
+
+  packet->active = lanes;
+  valid = s_and(solid_primitive_packet(solid, primitive, packet, &t_in, &t_out), s_mask(lanes));
+  valid = s_and(valid, s_or(s_gt(t_in, packet->near), s_gt(t_out, packet->near)));
+  closer = s_lt(t_in, hit->t);
+
+  accept = s_movemask(s_and(valid, closer));
+  // ties are resolved towards the first solid of the array, as a linear scan does
+  ties = s_movemask(s_and(valid, s_andnot(closer, s_ge(hit->t, t_in))));
+  for(lane = 0; ties != 0 && lane < SIMD_WIDTH; lane++) {
+    if((ties & (1 << lane)) && hit->solid[lane] != NULL && solid < hit->solid[lane])
+      accept |= 1 << lane;
+  }
+  if(accept == 0)
+    return;
+
+  hit->t = s_select(s_mask(accept), t_in, hit->t);
+  for(lane = 0; lane < SIMD_WIDTH; lane++) {
+    if(accept & (1 << lane)) {
+      hit->solid[lane] = solid;
+      hit->primitive[lane] = primitive;
+      hit->instance[lane] = NULL;
+    }
+  }
+}
+
+int bvh_intersect_packet(BVH* bvh, SOLID* solids, RAY_PACKET* packet, RAY_PACKET_HIT* hit) {
+  u_int stack[BVH_STACK_SIZE];
+  size_t top = 0;
+  size_t i;
+  int active = packet->active;
+  int lanes, first_lanes, second_lanes;
+  int lane;
+  const BVH_NODE* node;
+  const BVH_NODE* first;
+  const BVH_NODE* second;
+  const BVH_PRIMITIVE* p;
+
+  hit->t = packet->far;
+  for(lane = 0; lane < SIMD_WIDTH; lane++) {
+    hit->solid[lane] = NULL;
+    hit->primitive[lane] = 0;
+    hit->instance[lane] = NULL;
+  }
+
+  for(i = 0; i < bvh->n_unbounded; i++)
+    test_packet(&solids[bvh->unbounded[i]], 0, packet, active, hit);
+
+  if(bvh->n_nodes > 0) {
+    node = bvh->nodes;
+    lanes = node_packet(node, packet, hit->t);
+
+    while(lanes != 0) {
+      if(node->count > 0) {
+        for(p = &bvh->primitives[node->offset]; p < &bvh->primitives[node->offset + node->count]; p++)
+          test_packet(&solids[p->solid], p->primitive, packet, lanes, hit);
+        lanes = 0;
+      } else {
+        // the packet direction decides which child is nearer
+        first = node + 1;
+        second = &bvh->nodes[node->offset];
+        if(packet->sign[node->axis]) {
+          const BVH_NODE* n = first; first = second; second = n;
+        }
+        packet->active = active;
+        first_lanes = node_packet(first, packet, hit->t);
+        second_lanes = node_packet(second, packet, hit->t);
+        if(first_lanes != 0) {
+          if(second_lanes != 0)
+            stack[top++] = second - bvh->nodes;
+          node = first;
+          lanes = first_lanes;
+          continue;
+        } else if(second_lanes != 0) {
+          node = second;
+          lanes = second_lanes;
+          continue;
+        }
+        lanes = 0;
+      }
+
+      // pop the next node still hit by any lane before its nearest hit
+      packet->active = active;
+      while(lanes == 0 && top > 0) {
+        node = &bvh->nodes[stack[--top]];
+        lanes = node_packet(node, packet, hit->t);
+      }
+    }
+  }
+
+  packet->active = active;
+  lanes = 0;
+  for(lane = 0; lane < SIMD_WIDTH; lane++) {
+    if(hit->solid[lane] != NULL)
+      lanes |= 1 << lane;
+  }
+  return lanes;
+}
+
+/**
+ * Sets the blocker found by a traversal, when it is asked for.
+ */
+static inline void set_blocker(BVH_PRIMITIVE* blocker, u_int solid, u_int primitive) {
+  if(blocker != NULL) {
+    blocker->solid = solid;
+    blocker->primitive = primitive;
+  }
+}
+
+bool bvh_occluded(BVH* bvh, SOLID* solids, RAY* ray, float max_t, BVH_PRIMITIVE* blocker) {
+  u_int stack[BVH_STACK_SIZE];
+  size_t top = 0;
+  size_t i;
+  float inv[3];
+  const BVH_NODE* node;
+  const BVH_PRIMITIVE* p;
+
+  for(i = 0; i < bvh->n_unbounded; i++) {
+    if(solid_occludes(&solids[bvh->unbounded[i]], 0, ray, max_t)) {
+      set_blocker(blocker, bvh->unbounded[i], 0);
+      return true;
+    }
+  }
+
+  if(bvh->n_nodes == 0)
+    return false;
+
+  v_set(inv, 1.0f/ray->direction[0], 1.0f/ray->direction[1], 1.0f/ray->direction[2]);
+
+  // any blocker ends the search, so the visiting order does not matter
+  stack[top++] = 0;
+  while(top > 0) {
+    node = &bvh->nodes[stack[--top]];
+    if(node_distance(node, ray->origin, inv, ray->near, max_t) == FLT_MAX)
+      continue;
+
+    if(node->count > 0) {
+      for(p = &bvh->primitives[node->offset]; p < &bvh->primitives[node->offset + node->count]; p++) {
+        if(solid_occludes(&solids[p->solid], p->primitive, ray, max_t)) {
+          set_blocker(blocker, p->solid, p->primitive);
+          return true;
+        }
+      }
+    } else {
+      stack[top++] = node->offset;
+      stack[top++] = node + 1 - bvh->nodes;
+    }
+  }
+  return false;
+}
+
+/**
+ * Tests a primitive against the lanes of a packet which are not blocked yet.
+ * @return Bit mask of the lanes the primitive blocks
+ */
+static inline int occludes_packet(SOLID* solid, size_t primitive, RAY_PACKET* packet, int lanes, SIMD_FLOAT max_t) {
+  SIMD_FLOAT t_in, t_out;
+  SIMD_MASK blocked;
+  RAY_PACKET local;
+
+  packet->active = lanes;
+  if(solid->function == INSTANCE_SOLID) {
+    solid_instance_packet(solid, packet, &local);
+    return lanes & bvh_occluded_packet(solid->instance->object->bvh, solid->instance->object->solids, &local, max_t, NULL);
+  }
+  blocked = solid_primitive_packet(solid, primitive, packet, &t_in, &t_out);
+  blocked = s_and(blocked, s_or(s_gt(t_in, packet->near), s_gt(t_out, packet->near)));
+  blocked = s_and(blocked, s_lt(t_in, max_t));
+  return lanes & s_movemask(blocked);
+}
+
+int bvh_occludes_packet(SOLID* solid, size_t primitive, RAY_PACKET* packet, int lanes, SIMD_FLOAT max_t) {
+  int active = packet->active;
+  int blocked = occludes_packet(solid, primitive, packet, lanes, max_t);
+
+  packet->active = active;
+  return blocked;
+}
+
+int bvh_occluded_packet(BVH* bvh, SOLID* solids, RAY_PACKET* packet, SIMD_FLOAT max_t, BVH_PRIMITIVE* blocker) {
+  u_int stack[BVH_STACK_SIZE];
+  size_t top = 0;
+  size_t i;
+  int active = packet->active;
+  int open = active;
+  int lanes, blocked;
+  const BVH_NODE* node;
+  const BVH_PRIMITIVE* p;
+
+  for(i = 0; i < bvh->n_unbounded && open != 0; i++) {
+    blocked = occludes_packet(&solids[bvh->unbounded[i]], 0, packet, open, max_t);
+    if(blocked != 0)
+      set_blocker(blocker, bvh->unbounded[i], 0);
+    open &= ~blocked;
+  }
+
+  if(bvh->n_nodes > 0 && open != 0)
+    stack[top++] = 0;
+
+  // lanes leave the traversal as soon as they are blocked
+  while(top > 0 && open != 0) {
+    node = &bvh->nodes[stack[--top]];
+    packet->active = open;
+    lanes = node_packet(node, packet, max_t);
+    if(lanes == 0)
+      continue;
+
+    if(node->count > 0) {
+      for(p = &bvh->primitives[node->offset]; p < &bvh->primitives[node->offset + node->count] && lanes != 0; p++) {
+        blocked = occludes_packet(&solids[p->solid], p->primitive, packet, lanes, max_t);
+        if(blocked != 0)
+          set_blocker(blocker, p->solid, p->primitive);
+        lanes &= ~blocked;
+        open &= ~blocked;
+      }
+    } else {
+      stack[top++] = node->offset;
+      stack[top++] = node + 1 - bvh->nodes;
+    }
+  }
+
+  packet->active = active;
+  return active & ~open;
+}
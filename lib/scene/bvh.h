@@ -0,0 +1,139 @@
+/**
+ * Defines a Bounding Volume Hierarchy over the primitives of an array of
+ * solids, used to accelerate ray casting.
+ */
+#ifndef BVH_H_
+#define BVH_H_
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "ray.h"
+#include "packet.h"
+
+#define BVH_BINS 12         /**< Number of bins used to evaluate the SAH */
+#define BVH_LEAF_SIZE 4     /**< Maximum number of primitives in a leaf */
+#define BVH_STACK_SIZE 64   /**< Size of the traversal stacks, the tree being at most BVH_STACK_SIZE - 1 deep */
+#define BVH_EPSILON 1e-5f   /**< Relative tolerance of the box tests */
+
+struct SOLID;
+
+/**
+ * Node of the flattened hierarchy. Nodes are stored in depth-first order,
+ * so the first child of an interior node is always the next node.
+ */
+typedef struct {
+  float min[3];   /**< Bounding box minimum corner */
+  float max[3];   /**< Bounding box maximum corner */
+  u_int offset;   /**< First primitive of a leaf, or second child of an interior node */
+  u_short count;  /**< Number of primitives of a leaf, 0 for interior nodes */
+  u_short axis;   /**< Split axis of an interior node */
+} BVH_NODE;
+
+/**
+ * Reference to a bounded primitive of a solid.
+ */
+typedef struct {
+  u_int solid;     /**< Index of the solid */
+  u_int primitive; /**< Index of the primitive inside the solid */
+} BVH_PRIMITIVE;
+
+/**
+ * Bounding volume hierarchy built with the Surface Area Heuristic.
+ * Solids without finite bounds (planes) are kept out of the tree and
+ * tested linearly.
+ */
+typedef struct BVH {
+  size_t n_nodes;
+  BVH_NODE* nodes;
+
+  size_t n_primitives;
+  BVH_PRIMITIVE* primitives;
+
+  size_t n_unbounded;
+  u_int* unbounded;   /**< Indices of the unbounded solids */
+} BVH;
+
+/**
+ * Builds a hierarchy over the primitives of an array of solids.
+ * @param solids Array of solids
+ * @param n      Size of the solid array
+ * @return Pointer to the allocated hierarchy
+ */
+BVH* bvh(struct SOLID* solids, size_t n);
+
+/**
+ * Updates the boxes of a hierarchy to the current bounds of its
+ * primitives, keeping its tree. The solids must have the same primitives
+ * as when the hierarchy was built, the tree gets looser as they move away
+ * from where they were.
+ * @param bvh    Hierarchy
+ * @param solids Array of solids the hierarchy was built for
+ */
+void bvh_refit(BVH* bvh, struct SOLID* solids);
+
+/**
+ * Destroys a hierarchy and its node and primitive arrays.
+ * @param bvh Hierarchy to be destroyed
+ */
+void bvh_free(BVH* bvh);
+
+/**
+ * Finds the nearest intersection of a ray with the solids of a hierarchy.
+ * Uses the same acceptance rules as a linear scan over the solids.
+ * @param bvh          Hierarchy
+ * @param solids       Array of solids the hierarchy was built for
+ * @param ray          Ray
+ * @param intersection Nearest intersection
+ * @return There was an intersection with any solid
+ */
+bool bvh_intersect(BVH* bvh, struct SOLID* solids, RAY* ray, RAY_INTERSECTION* intersection);
+
+/**
+ * Finds the nearest primitive hit by each lane of a ray packet. Nodes are
+ * visited while any lane still hits them, so coherent packets share most
+ * of the traversal.
+ * @param bvh    Hierarchy
+ * @param solids Array of solids the hierarchy was built for
+ * @param packet Ray packet
+ * @param hit    Nearest hit of each lane
+ * @return Bit mask of the lanes that hit any solid
+ */
+int bvh_intersect_packet(BVH* bvh, struct SOLID* solids, RAY_PACKET* packet, RAY_PACKET_HIT* hit);
+
+/**
+ * Tests whether any solid of a hierarchy blocks a ray before a distance.
+ * Stops at the first blocking primitive found, in no particular order.
+ * @param bvh     Hierarchy
+ * @param solids  Array of solids the hierarchy was built for
+ * @param ray     Ray
+ * @param max_t   Distance along the ray after which hits do not count
+ * @param blocker Resulting blocking primitive when the ray is blocked, or NULL
+ * @return The ray is blocked
+ */
+bool bvh_occluded(BVH* bvh, struct SOLID* solids, RAY* ray, float max_t, BVH_PRIMITIVE* blocker);
+
+/**
+ * Tests whether a primitive of a solid blocks lanes of a packet before
+ * their distance, an instance being searched through its object.
+ * @param solid     Solid
+ * @param primitive Index of the primitive inside the solid
+ * @param packet    Ray packet
+ * @param lanes     Bit mask of the lanes to test
+ * @param max_t     Distance of each lane after which hits do not count
+ * @return Bit mask of the blocked lanes
+ */
+int bvh_occludes_packet(struct SOLID* solid, size_t primitive, RAY_PACKET* packet, int lanes, SIMD_FLOAT max_t);
+
+/**
+ * Packet version of bvh_occluded.
+ * @param bvh     Hierarchy
+ * @param solids  Array of solids the hierarchy was built for
+ * @param packet  Ray packet
+ * @param max_t   Distance of each lane after which hits do not count
+ * @param blocker Resulting last primitive found blocking any lane, or NULL
+ * @return Bit mask of the blocked lanes
+ */
+int bvh_occluded_packet(BVH* bvh, struct SOLID* solids, RAY_PACKET* packet, SIMD_FLOAT max_t, BVH_PRIMITIVE* blocker);
+
+#endif
@@ -0,0 +1,474 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "scene.h"
+#include "arena.h"
+#include "image.h"
+#include "texture.h"
+#include "matrix.h"
+
+/*
+ * The binary cache of a scene file holds the header, then the files the
+ * scene was read from, its textures with their whole mip chain, lights,
+ * objects with their solids, solids, and the animations of the instances
+ * with their steps. Every record is
+ * padded to 8 bytes, so that the arrays of the cache can be used in place
+ * once it is read in a single block.
+ */
+
+#define CACHE_MAGIC   "RTSCENE"
+#define CACHE_VERSION 7
+#define CACHE_PADDING 8
+
+#define cache_padded(n) (((n) + CACHE_PADDING - 1) & ~(size_t)(CACHE_PADDING - 1))
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t word_size;  /**< sizeof(size_t) of the writer, for the index arrays */
+  uint32_t n_files;
+  uint32_t n_textures;
+  uint32_t n_lights;
+  uint32_t n_solids;
+  uint32_t n_objects;
+  uint32_t n_animations;
+  uint32_t light_budget;
+  float light_cutoff;
+  float ambient_color[3];
+  float background_color[3];
+  float eye[3];
+  float eye_end[3];
+  float look[3];
+  float fov;
+} CACHE_HEADER;
+
+typedef struct {
+  int64_t mtime;    /**< modification time in nanoseconds */
+  int64_t size;
+  uint64_t length;  /**< length of the path that follows, with its NUL */
+} CACHE_FILE;
+
+typedef struct {
+  uint32_t type;
+  float position[3];
+  float color[3];
+  float intensity;
+} CACHE_LIGHT;
+
+typedef struct {
+  uint32_t type;         /**< 0 for spheres, 1 for planes, 2 for triangles, 3 for instances */
+  uint32_t kind;         /**< shading model, a MATERIAL_KIND */
+  int32_t texture;       /**< index of the texture, -1 for none */
+  uint32_t n_parameters;
+  float reflectance;
+  uint64_t num_points;   /**< index of the object of an instance */
+  uint64_t n_points;     /**< number of floats of the point array, or of the instance transform */
+  uint64_t n_indices;
+} CACHE_SOLID;
+
+typedef struct {
+  uint64_t solid;
+  uint64_t n_steps;      /**< number of MOTION records that follow */
+  float transform[MATRIX_SIZE];
+} CACHE_ANIMATION;
+
+/**
+ * Position of the reader in a cache held in memory.
+ */
+typedef struct {
+  char* p;
+  char* end;
+} CURSOR;
+
+static void cache_filename(const char* filename, char* cache) {
+  snprintf(cache, PATH_MAX, "%s.bin", filename);
+}
+
+static bool cache_stat(const char* filename, CACHE_FILE* file) {
+  struct stat st;
+  if(stat(filename, &st) != 0)
+    return false;
+  file->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  file->size = st.st_size;
+  return true;
+}
+
+static bool cache_write(FILE* file, const void* data, size_t size) {
+  static const char padding[CACHE_PADDING];
+  // empty arrays may have no storage at all
+  if(size == 0)
+    return true;
+  return fwrite(data, 1, size, file) == size &&
+         fwrite(padding, 1, cache_padded(size) - size, file) == cache_padded(size) - size;
+}
+
+/**
+ * Takes the next record of a cache.
+ * @return Pointer to the record in the cache, NULL when the cache ends
+ */
+static void* cache_take(CURSOR* cursor, size_t size) {
+  char* p = cursor->p;
+  if((size_t)(cursor->end - p) < cache_padded(size))
+    return NULL;
+  cursor->p += cache_padded(size);
+  return p;
+}
+
+/**
+ * Finds the index of a texture, adding it to the list of textures.
+ */
+static int32_t cache_texture(TEXTURE** textures, size_t* n_textures, TEXTURE* texture) {
+  size_t i;
+  if(texture == NULL)
+    return -1;
+  for(i = 0; i < *n_textures; i++) {
+    if(textures[i] == texture)
+      return i;
+  }
+  textures[(*n_textures)++] = texture;
+  return i;
+}
+
+/**
+ * Fills the record of a solid. Only the solids and materials the loader
+ * knows of are cached, instances have no material of their own.
+ * @return The solid can be cached
+ */
+static bool cache_solid(SCENE* scene, SOLID* s, CACHE_SOLID* record, TEXTURE** textures, size_t* n_textures) {
+  size_t i;
+
+  record->num_points = s->num_points;
+  record->texture = -1;
+  if(s->function == INSTANCE_SOLID) {
+    record->type = 3;
+    record->n_points = MATRIX_SIZE;
+    for(i = 0; i < scene->n_objects; i++) {
+      if(scene->objects[i] == s->instance->object)
+        break;
+    }
+    record->num_points = i;
+    return i < scene->n_objects;
+  } else if(s->function == SPHERE) {
+    record->type = 0;
+    record->n_points = 4;
+  } else if(s->function == PLANE) {
+    record->type = 1;
+    record->n_points = 6;
+  } else if(s->function == TRIANGLE) {
+    record->type = 2;
+    record->n_points = s->num_points * 3;
+    record->n_indices = s->indices[0]*3 + 1;
+  } else {
+    return false;
+  }
+
+  record->kind = s->material.kind;
+  record->n_parameters = (s->material.parameters != NULL) ? sizeof(MATERIAL_PARAMETERS)/sizeof(float) : 0;
+  record->reflectance = s->material.reflectance;
+  record->texture = cache_texture(textures, n_textures, s->material.texture);
+  return true;
+}
+
+static bool cache_write_solid(FILE* file, SOLID* s, CACHE_SOLID* record) {
+  return cache_write(file, record, sizeof(CACHE_SOLID)) &&
+         cache_write(file, s->material.parameters, sizeof(float) * record->n_parameters) &&
+         cache_write(file, (s->instance != NULL) ? s->instance->transform : s->points, sizeof(float) * record->n_points) &&
+         cache_write(file, s->indices, sizeof(size_t) * record->n_indices);
+}
+
+bool scene_save_binary(SCENE* scene, const char* filename) {
+  char cache[PATH_MAX], temporary[PATH_MAX + 16];
+  CACHE_HEADER header;
+  CACHE_FILE dependency;
+  CACHE_LIGHT light;
+  CACHE_ANIMATION animation;
+  CACHE_SOLID* solids;
+  TEXTURE** textures;
+  size_t n_textures = 0;
+  size_t n_solids = scene->n_solids;
+  size_t i, j, r;
+  uint64_t n;
+  bool ok = true;
+  FILE* file;
+
+  // the solids of the objects come first, then the ones of the scene
+  for(i = 0; i < scene->n_objects; i++)
+    n_solids += scene->objects[i]->n_solids;
+  solids = (CACHE_SOLID*)calloc(n_solids + 1, sizeof(CACHE_SOLID));
+  textures = (TEXTURE**)malloc(sizeof(TEXTURE*) * (n_solids + 1));
+  for(i = 0, r = 0; i < scene->n_objects; i++) {
+    for(j = 0; j < scene->objects[i]->n_solids && ok; j++, r++)
+      ok = cache_solid(scene, &scene->objects[i]->solids[j], &solids[r], textures, &n_textures);
+  }
+  for(i = 0; i < scene->n_solids && ok; i++, r++)
+    ok = cache_solid(scene, &scene->solids[i], &solids[r], textures, &n_textures);
+
+  cache_filename(filename, cache);
+  snprintf(temporary, sizeof(temporary), "%s.%d", cache, (int)getpid());
+  file = ok ? fopen(temporary, "wb") : NULL;
+  if(file == NULL) {
+    free(solids);
+    free(textures);
+    return false;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  header.version = CACHE_VERSION;
+  header.word_size = sizeof(size_t);
+  header.n_files = scene->n_files;
+  header.n_textures = n_textures;
+  header.n_lights = scene->n_lights;
+  header.n_solids = scene->n_solids;
+  header.n_objects = scene->n_objects;
+  header.n_animations = scene->n_animations;
+  header.light_budget = scene->light_budget;
+  header.light_cutoff = scene->light_cutoff;
+  v_copy(header.ambient_color, scene->ambient_color);
+  v_copy(header.background_color, scene->background_color);
+  v_copy(header.eye, scene->eye);
+  v_copy(header.eye_end, scene->eye_end);
+  v_copy(header.look, scene->look);
+  header.fov = scene->fov;
+  ok = cache_write(file, &header, sizeof(header));
+
+  for(i = 0; i < scene->n_files && ok; i++) {
+    memset(&dependency, 0, sizeof(dependency));
+    dependency.length = strlen(scene->files[i]) + 1;
+    ok = cache_stat(scene->files[i], &dependency) &&
+         cache_write(file, &dependency, sizeof(dependency)) &&
+         cache_write(file, scene->files[i], dependency.length);
+  }
+
+  for(i = 0; i < n_textures && ok; i++) {
+    int size[2] = { textures[i]->width, textures[i]->height };
+    ok = cache_write(file, size, sizeof(size)) &&
+         cache_write(file, textures[i]->texels, sizeof(u_int) * texture_size(size[0], size[1]));
+  }
+
+  for(i = 0; i < scene->n_lights && ok; i++) {
+    memset(&light, 0, sizeof(light));
+    light.type = scene->lights[i].type;
+    v_copy(light.position, scene->lights[i].position);
+    v_copy(light.color, scene->lights[i].color);
+    light.intensity = scene->lights[i].intensity;
+    ok = cache_write(file, &light, sizeof(light));
+  }
+
+  for(i = 0, r = 0; i < scene->n_objects && ok; i++) {
+    n = scene->objects[i]->n_solids;
+    ok = cache_write(file, &n, sizeof(n));
+    for(j = 0; j < n && ok; j++, r++)
+      ok = cache_write_solid(file, &scene->objects[i]->solids[j], &solids[r]);
+  }
+  for(i = 0; i < scene->n_solids && ok; i++, r++)
+    ok = cache_write_solid(file, &scene->solids[i], &solids[r]);
+
+  for(i = 0; i < scene->n_animations && ok; i++) {
+    memset(&animation, 0, sizeof(animation));
+    animation.solid = scene->animations[i].solid;
+    animation.n_steps = scene->animations[i].n_steps;
+    m_copy(scene->animations[i].transform, animation.transform);
+    ok = cache_write(file, &animation, sizeof(animation)) &&
+         cache_write(file, scene->animations[i].steps, sizeof(MOTION) * animation.n_steps);
+  }
+
+  free(solids);
+  free(textures);
+  if(fclose(file) != 0)
+    ok = false;
+  // the cache appears at once, for other processes reading it
+  if(ok)
+    ok = (rename(temporary, cache) == 0);
+  if(!ok)
+    remove(temporary);
+  return ok;
+}
+
+/**
+ * Reads the record of a solid, instances are only allowed once the objects
+ * of the scene are read.
+ * @return The record is valid
+ */
+static bool cache_read_solid(CURSOR* cursor, ARENA* a, SCENE* scene, SOLID* s, TEXTURE** textures, uint32_t n_textures) {
+  CACHE_SOLID* record;
+  float* points;
+
+  if((record = (CACHE_SOLID*)cache_take(cursor, sizeof(CACHE_SOLID))) == NULL ||
+     record->type > 3 || record->kind >= MATERIAL_KINDS || record->texture >= (int32_t)n_textures)
+    return false;
+  s->material.parameters = (MATERIAL_PARAMETERS*)cache_take(cursor, sizeof(float) * record->n_parameters);
+  points = (float*)cache_take(cursor, sizeof(float) * record->n_points);
+  s->indices = (size_t*)cache_take(cursor, sizeof(size_t) * record->n_indices);
+  if(s->material.parameters == NULL || points == NULL || s->indices == NULL)
+    return false;
+  if(record->n_indices == 0)
+    s->indices = NULL;
+
+  if(record->type == 3) {
+    if(record->num_points >= scene->n_objects || record->n_points != MATRIX_SIZE)
+      return false;
+    solid_instance(s, scene->objects[record->num_points], (INSTANCE*)arena_alloc(a, sizeof(INSTANCE)));
+    s->material.parameters = NULL;
+    solid_transform(s, points);
+    return true;
+  }
+
+  s->num_points = record->num_points;
+  s->points = points;
+  s->function = (record->type == 0) ? SPHERE : (record->type == 1) ? PLANE : TRIANGLE;
+  if(record->n_parameters != sizeof(MATERIAL_PARAMETERS)/sizeof(float))
+    return false;
+  s->material.kind = (MATERIAL_KIND)record->kind;
+  s->material.reflectance = record->reflectance;
+  s->material.texture = (record->texture >= 0) ? textures[record->texture] : NULL;
+  return true;
+}
+
+/**
+ * Reads the records of a cache into a scene allocated in an arena.
+ * @return Scene, or NULL when the cache is invalid or outdated
+ */
+static SCENE* cache_read(CURSOR* cursor, ARENA* a) {
+  CACHE_HEADER* header;
+  CACHE_FILE* dependency;
+  CACHE_FILE current;
+  CACHE_LIGHT* light;
+  CACHE_ANIMATION* record;
+  ANIMATION* animation;
+  TEXTURE** textures;
+  u_int* texels;
+  SCENE* scene;
+  OBJECT* object;
+  uint64_t* n;
+  size_t i, j;
+  int* size;
+
+  header = (CACHE_HEADER*)cache_take(cursor, sizeof(CACHE_HEADER));
+  if(header == NULL || memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+     header->version != CACHE_VERSION || header->word_size != sizeof(size_t))
+    return NULL;
+
+  scene = (SCENE*)arena_alloc(a, sizeof(SCENE));
+  memset(scene, 0, sizeof(SCENE));
+  scene->arena = a;
+  v_copy(scene->ambient_color, header->ambient_color);
+  v_copy(scene->background_color, header->background_color);
+  v_copy(scene->eye, header->eye);
+  v_copy(scene->eye_end, header->eye_end);
+  v_copy(scene->look, header->look);
+  scene->fov = header->fov;
+  scene->light_cutoff = header->light_cutoff;
+  scene->light_budget = header->light_budget;
+
+  // the cache is outdated when any file it was read from has changed
+  scene->n_files = header->n_files;
+  scene->files = (char**)arena_alloc(a, sizeof(char*) * header->n_files);
+  for(i = 0; i < header->n_files; i++) {
+    dependency = (CACHE_FILE*)cache_take(cursor, sizeof(CACHE_FILE));
+    if(dependency == NULL || (scene->files[i] = (char*)cache_take(cursor, dependency->length)) == NULL)
+      return NULL;
+    scene->files[i][dependency->length - 1] = '\0';
+    if(!cache_stat(scene->files[i], &current) ||
+       current.mtime != dependency->mtime || current.size != dependency->size)
+      return NULL;
+  }
+
+  // the mip chains are used in place
+  textures = (TEXTURE**)arena_alloc(a, sizeof(TEXTURE*) * (header->n_textures + 1));
+  for(i = 0; i < header->n_textures; i++) {
+    if((size = (int*)cache_take(cursor, sizeof(int) * 2)) == NULL || size[0] <= 0 || size[1] <= 0 ||
+       (texels = (u_int*)cache_take(cursor, sizeof(u_int) * texture_size(size[0], size[1]))) == NULL)
+      return NULL;
+    textures[i] = (TEXTURE*)arena_alloc(a, sizeof(TEXTURE));
+    texture_init(textures[i], size[0], size[1], texels);
+  }
+
+  scene->n_lights = header->n_lights;
+  scene->lights = (LIGHT*)arena_alloc(a, sizeof(LIGHT) * header->n_lights);
+  for(i = 0; i < header->n_lights; i++) {
+    if((light = (CACHE_LIGHT*)cache_take(cursor, sizeof(CACHE_LIGHT))) == NULL)
+      return NULL;
+    scene->lights[i].type = light->type;
+    v_copy(scene->lights[i].position, light->position);
+    v_copy(scene->lights[i].color, light->color);
+    scene->lights[i].intensity = light->intensity;
+  }
+
+  scene->n_objects = header->n_objects;
+  scene->objects = (OBJECT**)arena_alloc(a, sizeof(OBJECT*) * (header->n_objects + 1));
+  for(i = 0; i < header->n_objects; i++) {
+    if((n = (uint64_t*)cache_take(cursor, sizeof(uint64_t))) == NULL)
+      return NULL;
+    object = scene->objects[i] = (OBJECT*)arena_alloc(a, sizeof(OBJECT));
+    object->n_solids = *n;
+    object->solids = (SOLID*)arena_alloc(a, sizeof(SOLID) * object->n_solids);
+    object->bvh = NULL;
+    memset(object->solids, 0, sizeof(SOLID) * object->n_solids);
+    // objects hold no instances, the loader does not allow them
+    for(j = 0; j < object->n_solids; j++) {
+      if(!cache_read_solid(cursor, a, scene, &object->solids[j], textures, header->n_textures) ||
+         object->solids[j].instance != NULL)
+        return NULL;
+    }
+  }
+
+  scene->n_solids = header->n_solids;
+  scene->solids = (SOLID*)arena_alloc(a, sizeof(SOLID) * header->n_solids);
+  memset(scene->solids, 0, sizeof(SOLID) * header->n_solids);
+  for(i = 0; i < header->n_solids; i++) {
+    if(!cache_read_solid(cursor, a, scene, &scene->solids[i], textures, header->n_textures))
+      return NULL;
+  }
+
+  // the steps are used in place, only instances are animated
+  scene->n_animations = header->n_animations;
+  scene->animations = (ANIMATION*)arena_alloc(a, sizeof(ANIMATION) * (header->n_animations + 1));
+  for(i = 0; i < header->n_animations; i++) {
+    animation = &scene->animations[i];
+    if((record = (CACHE_ANIMATION*)cache_take(cursor, sizeof(CACHE_ANIMATION))) == NULL ||
+       record->solid >= scene->n_solids || scene->solids[record->solid].instance == NULL || record->n_steps == 0 ||
+       (animation->steps = (MOTION*)cache_take(cursor, sizeof(MOTION) * record->n_steps)) == NULL)
+      return NULL;
+    animation->solid = record->solid;
+    animation->n_steps = record->n_steps;
+    m_copy(record->transform, animation->transform);
+    for(j = 0; j < animation->n_steps; j++) {
+      if((unsigned)animation->steps[j].type > MOTION_TRANSLATE)
+        return NULL;
+    }
+  }
+  return scene;
+}
+
+SCENE* scene_load_binary(const char* filename) {
+  char cache[PATH_MAX];
+  ARENA* a;
+  CURSOR cursor;
+  SCENE* scene = NULL;
+  FILE* file;
+  struct stat st;
+
+  cache_filename(filename, cache);
+  file = fopen(cache, "rb");
+  if(file == NULL)
+    return NULL;
+
+  // read the whole cache at once, its arrays are used in place
+  a = arena();
+  if(fstat(fileno(file), &st) == 0 && st.st_size > 0) {
+    cursor.p = (char*)arena_alloc(a, st.st_size);
+    cursor.end = cursor.p + st.st_size;
+    if(fread(cursor.p, 1, st.st_size, file) == (size_t)st.st_size)
+      scene = cache_read(&cursor, a);
+  }
+  fclose(file);
+
+  if(scene == NULL)
+    arena_free(a);
+  return scene;
+}
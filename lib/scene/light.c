@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+#include "vector.h"
+#include "light.h"
+
+bool light_prepare(LIGHT* light) {
+  int k;
+
+  if(light->type == DIRECTIONAL) {
+    v_mul(-1, light->position, light->direction);
+    v_normalize(light->direction, light->direction);
+  } else {
+    v_set(light->direction, 0.0f, 0.0f, 0.0f);
+  }
+  v_mul(light->intensity, light->color, light->radiance);
+  light->power = fmaxf(light->radiance[0], fmaxf(light->radiance[1], light->radiance[2]));
+  light->attenuation = LIGHT_DIRECTIONAL_ATTENUATION;
+
+  if(!(light->intensity >= 0.0f) || !isfinite(light->power))
+    return false;
+  for(k = 0; k < 3; k++) {
+    if(!(light->color[k] >= 0.0f) || !isfinite(light->position[k]) || !isfinite(light->direction[k]))
+      return false;
+  }
+  return light->type != DIRECTIONAL || v_dot(light->position, light->position) > 0.0f;
+}
+
+/**
+ * Cell of the grid holding a point along an axis, clamped to the grid.
+ */
+static int grid_cell(LIGHT_GRID* grid, float x, int axis) {
+  int cell = (int)floorf((x - grid->min[axis])/grid->size);
+  return (cell < 0) ? 0 : (cell >= grid->dims[axis]) ? grid->dims[axis] - 1 : cell;
+}
+
+LIGHT_GRID* light_grid(LIGHT* lights, size_t n, float cutoff, size_t budget) {
+  LIGHT_GRID* grid = (LIGHT_GRID*)calloc(1, sizeof(LIGHT_GRID));
+  float max[3], extent[3];
+  float r, volume;
+  int lo[3], hi[3], x, y, z, k;
+  size_t i, n_bounded = 0, n_cells;
+  u_int* cursor;
+
+  grid->cutoff = cutoff;
+  grid->budget = (budget < 1) ? 1 : (budget > LIGHT_MAX_SAMPLES) ? LIGHT_MAX_SAMPLES : budget;
+  grid->radii = (float*)malloc(sizeof(float) * (n + 1));
+  grid->global = (u_int*)malloc(sizeof(u_int) * (n + 1));
+
+  // only point lights have a sphere, and only when they are culled
+  v_set(grid->min, FLT_MAX, FLT_MAX, FLT_MAX);
+  v_set(max, -FLT_MAX, -FLT_MAX, -FLT_MAX);
+  for(i = 0; i < n; i++) {
+    if(lights[i].type == DIRECTIONAL || cutoff <= 0.0f) {
+      grid->radii[i] = FLT_MAX;
+      grid->global[grid->n_global++] = i;
+      continue;
+    }
+    grid->radii[i] = fmaxf(lights[i].power/cutoff, 0.0f);
+    if(grid->radii[i] == 0.0f)
+      continue;
+    r = sqrtf(grid->radii[i]);
+    for(k = 0; k < 3; k++) {
+      grid->min[k] = fminf(grid->min[k], lights[i].position[k] - r);
+      max[k] = fmaxf(max[k], lights[i].position[k] + r);
+    }
+    n_bounded++;
+  }
+  if(n_bounded == 0)
+    return grid;
+
+  // cubic cells, a few per light
+  v_sub(max, grid->min, extent);
+  volume = extent[0]*extent[1]*extent[2];
+  grid->size = cbrtf(volume/(LIGHT_GRID_CELLS*n_bounded));
+  for(k = 0; k < 3; k++)
+    grid->size = fmaxf(grid->size, extent[k]/LIGHT_GRID_SIZE);
+  n_cells = 1;
+  for(k = 0; k < 3; k++) {
+    grid->dims[k] = (int)ceilf(extent[k]/grid->size);
+    grid->dims[k] = (grid->dims[k] < 1) ? 1 : (grid->dims[k] > LIGHT_GRID_SIZE) ? LIGHT_GRID_SIZE : grid->dims[k];
+    n_cells *= grid->dims[k];
+  }
+
+  // count the lights of each cell, then fill the cells in light order
+  grid->cells = (u_int*)calloc(n_cells + 1, sizeof(u_int));
+  for(i = 0; i < n; i++) {
+    if(grid->radii[i] == 0.0f || grid->radii[i] == FLT_MAX)
+      continue;
+    r = sqrtf(grid->radii[i]);
+    for(k = 0; k < 3; k++) {
+      lo[k] = grid_cell(grid, lights[i].position[k] - r, k);
+      hi[k] = grid_cell(grid, lights[i].position[k] + r, k);
+    }
+    for(z = lo[2]; z <= hi[2]; z++)
+    for(y = lo[1]; y <= hi[1]; y++)
+    for(x = lo[0]; x <= hi[0]; x++)
+      grid->cells[(z*grid->dims[1] + y)*grid->dims[0] + x + 1]++;
+  }
+  for(i = 0; i < n_cells; i++)
+    grid->cells[i + 1] += grid->cells[i];
+
+  grid->lights = (u_int*)malloc(sizeof(u_int) * (grid->cells[n_cells] + 1));
+  cursor = (u_int*)malloc(sizeof(u_int) * n_cells);
+  memcpy(cursor, grid->cells, sizeof(u_int) * n_cells);
+  for(i = 0; i < n; i++) {
+    if(grid->radii[i] == 0.0f || grid->radii[i] == FLT_MAX)
+      continue;
+    r = sqrtf(grid->radii[i]);
+    for(k = 0; k < 3; k++) {
+      lo[k] = grid_cell(grid, lights[i].position[k] - r, k);
+      hi[k] = grid_cell(grid, lights[i].position[k] + r, k);
+    }
+    for(z = lo[2]; z <= hi[2]; z++)
+    for(y = lo[1]; y <= hi[1]; y++)
+    for(x = lo[0]; x <= hi[0]; x++)
+      grid->lights[cursor[(z*grid->dims[1] + y)*grid->dims[0] + x]++] = i;
+  }
+  free(cursor);
+  return grid;
+}
+
+void light_grid_free(LIGHT_GRID* grid) {
+  free(grid->cells);
+  free(grid->lights);
+  free(grid->radii);
+  free(grid->global);
+  free(grid);
+}
+
+/**
+ * Estimated contribution of a light to a point, as the shading models
+ * give it for a white material: 0 when the light is culled or behind the
+ * point.
+ */
+static float estimate(LIGHT_GRID* grid, LIGHT* lights, size_t i, const float* point, const float* normal) {
+  LIGHT* light = &lights[i];
+  float d[3];
+  float sq, facing;
+
+  if(light->type == DIRECTIONAL) {
+    v_copy(d, light->direction);
+    sq = light->attenuation;
+  } else {
+    v_sub(light->position, point, d);
+    sq = v_dot(d, d);
+    if(sq > grid->radii[i])
+      return 0.0f;
+  }
+  facing = v_dot(normal, d);
+  if(facing <= 0.0f)
+    return 0.0f;
+  return facing/sqrtf(v_dot(d, d)) * light->power/sq;
+}
+
+/**
+ * Hash of an integer, for the draws of a point.
+ */
+static uint32_t hash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+/**
+ * Index of the k-th light which may reach a point, the global lights
+ * being followed by the ones of its cell.
+ */
+static inline size_t candidate(LIGHT_GRID* grid, const u_int* cell, size_t k) {
+  return (k < grid->n_global) ? grid->global[k] : cell[k - grid->n_global];
+}
+
+size_t light_select(LIGHT_GRID* grid, LIGHT* lights, const float* point, const float* normal, LIGHT_SAMPLE* samples) {
+  const u_int* cell = NULL;
+  size_t n_cell = 0, n_candidates, n_lit, n = 0;
+  size_t i, j, k, last = 0, draws;
+  float u[LIGHT_MAX_SAMPLES];
+  float w, total, sum, x;
+  uint32_t bits[3], seed;
+  LIGHT_SAMPLE sample;
+  int c[3];
+
+  // the point lights of the cell of the point follow the global lights
+  if(grid->cells != NULL) {
+    for(k = 0; k < 3; k++) {
+      x = (point[k] - grid->min[k])/grid->size;
+      if(!(x >= 0.0f && x < grid->dims[k]))
+        break;
+      c[k] = (int)x;
+    }
+    if(k == 3) {
+      i = (c[2]*grid->dims[1] + c[1])*grid->dims[0] + c[0];
+      cell = &grid->lights[grid->cells[i]];
+      n_cell = grid->cells[i + 1] - grid->cells[i];
+    }
+  }
+  n_candidates = grid->n_global + n_cell;
+
+  total = 0.0f;
+  for(k = 0, n_lit = 0; k < n_candidates; k++) {
+    w = estimate(grid, lights, candidate(grid, cell, k), point, normal);
+    if(w > 0.0f) {
+      total += w;
+      n_lit++;
+      last = k;
+    }
+  }
+
+  if(n_lit <= grid->budget) {
+    for(k = 0; k < n_candidates; k++) {
+      if(estimate(grid, lights, candidate(grid, cell, k), point, normal) > 0.0f) {
+        samples[n].light = &lights[candidate(grid, cell, k)];
+        samples[n++].weight = 1.0f;
+      }
+    }
+  } else {
+    // sorted draws, walked along the running sum of the contributions
+    memcpy(bits, point, sizeof(bits));
+    seed = hash(bits[0] ^ hash(bits[1] ^ hash(bits[2])));
+    for(j = 0; j < grid->budget; j++) {
+      x = ((hash(seed + (uint32_t)j*0x9e3779b9u) >> 8) + 0.5f)/16777216.0f * total;
+      for(i = j; i > 0 && u[i - 1] > x; i--)
+        u[i] = u[i - 1];
+      u[i] = x;
+    }
+    sum = 0.0f;
+    for(k = 0, j = 0; k <= last && j < grid->budget; k++) {
+      w = estimate(grid, lights, candidate(grid, cell, k), point, normal);
+      if(w <= 0.0f)
+        continue;
+      sum += w;
+      // rounding leaves the last draws to the last light
+      for(draws = 0; j < grid->budget && (u[j] < sum || k == last); j++)
+        draws++;
+      if(draws == 0)
+        continue;
+      samples[n].light = &lights[candidate(grid, cell, k)];
+      samples[n++].weight = draws*total/(grid->budget*w);
+    }
+  }
+
+  // the global lights and the ones of the cell are each in order
+  for(j = 1; j < n; j++) {
+    sample = samples[j];
+    for(i = j; i > 0 && samples[i - 1].light > sample.light; i--)
+      samples[i] = samples[i - 1];
+    samples[i] = sample;
+  }
+  return n;
+}
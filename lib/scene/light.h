@@ -1,21 +1,109 @@
 /**
- * Defines a simple light structure
+ * Defines a simple light structure, and the culling and sampling of the
+ * lights shading a point.
  */
 #ifndef LIGHT_H_
 #define LIGHT_H_
 
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define LIGHT_MAX_SAMPLES 64 /**< Highest budget of lights shading a point */
+#define LIGHT_BUDGET      16 /**< Number of lights shading a point when the scene does not give it */
+#define LIGHT_GRID_CELLS  4  /**< Cells of the light grid per point light */
+#define LIGHT_GRID_SIZE   64 /**< Highest number of cells of the light grid along an axis */
+#define LIGHT_DIRECTIONAL_ATTENUATION 10.0f /**< Squared distance attenuating directional lights */
+
 /**
  * Simple light structure that defines mainly
- * its spatial and shading parameters.
+ * its spatial and shading parameters, as a scene gives them, followed by
+ * the terms the renderer uses, computed once by light_prepare.
  */
-typedef struct {
+typedef struct LIGHT {
   enum {
     POINT,
     DIRECTIONAL
   } type;
-  float position[3];
+  float position[3];   /**< Position of a point light, direction a directional light shines in */
   float color[3];
   float intensity;
+
+  float direction[3];  /**< Normalized direction towards a directional light */
+  float radiance[3];   /**< Color times intensity */
+  float power;         /**< Brightest channel of the radiance */
+  float attenuation;   /**< Squared distance attenuating a directional light */
 } LIGHT;
 
+/**
+ * Light chosen to shade a point.
+ */
+typedef struct {
+  LIGHT* light;
+  float weight;    /**< Factor of the contribution of the light, 1 unless it was sampled */
+} LIGHT_SAMPLE;
+
+/**
+ * Uniform grid over the spheres of influence of the point lights. The
+ * contribution of a point light, its power over the squared distance, is
+ * below the cutoff outside of its sphere.
+ * Directional lights, and point lights when there is no cutoff, reach
+ * every point.
+ */
+typedef struct LIGHT_GRID {
+  float cutoff;
+  size_t budget;   /**< Highest number of lights shading a point, the others are sampled */
+
+  float min[3];    /**< Minimum corner of the grid */
+  float size;      /**< Side of the cells */
+  int dims[3];     /**< Number of cells along each axis */
+  u_int* cells;    /**< First entry of each cell in lights, followed by the end of the last cell */
+  u_int* lights;   /**< Point lights whose sphere overlaps each cell, in order */
+  float* radii;    /**< Squared radius of the sphere of each light */
+
+  size_t n_global;
+  u_int* global;   /**< Lights reaching every point, in order */
+} LIGHT_GRID;
+
+/**
+ * Computes the terms of a light used by the renderer from the ones a scene
+ * gives.
+ * @param light Light
+ * @return The light is valid: its terms are finite, its color and
+ *         intensity are not negative and a directional light has a direction
+ */
+bool light_prepare(LIGHT* light);
+
+/**
+ * Builds the grid of an array of lights, once they are prepared.
+ * @param lights Lights
+ * @param n      Number of lights
+ * @param cutoff Contribution below which point lights are culled, 0 to keep every light
+ * @param budget Highest number of lights shading a point, up to LIGHT_MAX_SAMPLES
+ * @return Pointer to the allocated grid
+ */
+LIGHT_GRID* light_grid(LIGHT* lights, size_t n, float cutoff, size_t budget);
+
+/**
+ * Destroys a light grid.
+ * @param grid Grid to be destroyed
+ */
+void light_grid_free(LIGHT_GRID* grid);
+
+/**
+ * Chooses the lights shading a point. The lights which reach the point
+ * and face its normal are kept. When there are more of them than the
+ * budget, budget of them are drawn at random, with a probability following
+ * their estimated contribution, and weighted so that the expected color is
+ * the one of all of them. The draws only depend on the point, so that
+ * images do not depend on the order the points are shaded in.
+ * @param grid    Grid of the lights
+ * @param lights  Lights the grid was built for
+ * @param point   Shaded point
+ * @param normal  Normal at the point
+ * @param samples Resulting lights, in the order of the light array, room for LIGHT_MAX_SAMPLES
+ * @return Number of lights chosen
+ */
+size_t light_select(LIGHT_GRID* grid, LIGHT* lights, const float* point, const float* normal, LIGHT_SAMPLE* samples);
+
 #endif
@@ -0,0 +1,784 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "scene.h"
+#include "arena.h"
+#include "image.h"
+#include "texture.h"
+#include "matrix.h"
+
+#define LOADER_NAME_SIZE 64
+
+/**
+ * Position of a parser in a NUL terminated text file.
+ */
+typedef struct {
+  const char* filename;
+  const char* p;
+  size_t line;
+} PARSER;
+
+typedef struct {
+  char name[LOADER_NAME_SIZE];
+  MATERIAL material;
+} NAMED_MATERIAL;
+
+typedef struct {
+  char name[LOADER_NAME_SIZE];
+  const char* path;
+  TEXTURE* texture;
+} NAMED_TEXTURE;
+
+typedef struct {
+  char name[LOADER_NAME_SIZE];
+  OBJECT* object;
+} NAMED_OBJECT;
+
+/**
+ * Elements of a scene being parsed, in arrays grown as they are found.
+ */
+typedef struct {
+  ARENA* arena;
+  SCENE* scene;
+  char directory[PATH_MAX]; /**< directory of the scene file, ending with '/' */
+
+  size_t n_solids, c_solids;
+  SOLID* solids;
+  size_t n_lights, c_lights;
+  LIGHT* lights;
+  size_t n_materials, c_materials;
+  NAMED_MATERIAL* materials;
+  size_t n_textures, c_textures;
+  NAMED_TEXTURE* textures;
+  size_t n_files, c_files;
+  char** files;
+  size_t n_objects, c_objects;
+  NAMED_OBJECT* objects;
+  size_t n_animations, c_animations;
+  ANIMATION* animations;
+  bool eye_end;             /**< the eye position of the last frame was given */
+
+  // solids of the scene, set aside while the solids of an object are read
+  OBJECT* object;           /**< object being read, NULL outside of objects */
+  size_t n_scene_solids, c_scene_solids;
+  SOLID* scene_solids;
+} LOADER;
+
+/**
+ * Makes room for one more element at the end of a loader array.
+ */
+#define loader_grow(array, n, capacity) \
+  if((n) == (capacity)) { \
+    (capacity) = (capacity) ? (capacity)*2 : 16; \
+    (array) = realloc((array), sizeof(*(array)) * (capacity)); \
+  }
+
+/**
+ * Maps a file in memory. Mapped files are NUL terminated by the zeroed end
+ * of their last page, files filling whole pages are read instead.
+ * @param size   Resulting size of the file
+ * @param mapped Resulting flag telling whether the file was mapped
+ */
+static char* file_map(const char* filename, size_t* size, bool* mapped) {
+  FILE* file;
+  struct stat st;
+  char* data = NULL;
+
+  file = fopen(filename, "rb");
+  if(file == NULL || fstat(fileno(file), &st) != 0) {
+    fprintf(stderr, "Error while opening file '%s'\n", filename);
+    exit(1);
+  }
+
+  *size = st.st_size;
+  *mapped = false;
+  if(*size > 0 && *size % sysconf(_SC_PAGESIZE) != 0) {
+    data = (char*)mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    *mapped = (data != MAP_FAILED);
+    if(*mapped)
+      madvise(data, *size, MADV_SEQUENTIAL);
+  }
+  if(!*mapped) {
+    data = (char*)malloc(*size + 1);
+    if(fread(data, 1, *size, file) != *size) {
+      fprintf(stderr, "Error while reading file '%s'\n", filename);
+      exit(1);
+    }
+    data[*size] = '\0';
+  }
+  fclose(file);
+  return data;
+}
+
+static void file_unmap(char* data, size_t size, bool mapped) {
+  if(mapped)
+    munmap(data, size);
+  else
+    free(data);
+}
+
+static void parse_error(PARSER* parser, const char* message, const char* argument) {
+  fprintf(stderr, "%s:%zu: %s%s\n", parser->filename, parser->line, message, argument);
+  exit(1);
+}
+
+#define is_blank(c) ((c) == ' ' || (c) == '\t' || (c) == '\r')
+#define is_separator(c) (is_blank(c) || (c) == '\n' || (c) == '\0' || (c) == '#')
+
+/**
+ * Skips blanks and a comment, up to the end of the line.
+ */
+static void parse_blank(PARSER* parser) {
+  const char* p = parser->p;
+  while(is_blank(*p))
+    p++;
+  if(*p == '#') {
+    while(*p != '\n' && *p != '\0')
+      p++;
+  }
+  parser->p = p;
+}
+
+/**
+ * Tells whether the rest of the line is empty.
+ */
+static bool parse_eol(PARSER* parser) {
+  parse_blank(parser);
+  return *parser->p == '\n' || *parser->p == '\0';
+}
+
+static void parse_end(PARSER* parser) {
+  if(!parse_eol(parser))
+    parse_error(parser, "unexpected ", parser->p);
+}
+
+/**
+ * Moves to the start of the next line.
+ * @return False at the end of the file
+ */
+static bool parse_line(PARSER* parser) {
+  const char* p = parser->p;
+  while(*p != '\n' && *p != '\0')
+    p++;
+  parser->p = p;
+  if(*p == '\0')
+    return false;
+  parser->p++;
+  parser->line++;
+  return true;
+}
+
+/**
+ * Tells whether the line continues with a keyword.
+ */
+static bool parse_keyword(PARSER* parser, const char* keyword) {
+  size_t n = strlen(keyword);
+  parse_blank(parser);
+  if(strncmp(parser->p, keyword, n) != 0 || !is_separator(parser->p[n]))
+    return false;
+  parser->p += n;
+  return true;
+}
+
+static void parse_word(PARSER* parser, char* word, size_t size) {
+  size_t n = 0;
+  if(parse_eol(parser))
+    parse_error(parser, "missing argument", "");
+  while(!is_separator(*parser->p)) {
+    if(n == size - 1)
+      parse_error(parser, "word too long", "");
+    word[n++] = *parser->p++;
+  }
+  word[n] = '\0';
+}
+
+static float parse_float(PARSER* parser) {
+  char* end;
+  float f;
+  parse_blank(parser);
+  f = strtof(parser->p, &end);
+  if(end == parser->p || !is_separator(*end))
+    parse_error(parser, "expected a number", "");
+  parser->p = end;
+  return f;
+}
+
+static void parse_floats(PARSER* parser, float* f, size_t n) {
+  size_t i;
+  for(i = 0; i < n; i++)
+    f[i] = parse_float(parser);
+}
+
+/**
+ * Reads OBJ vertex and face lines into a triangle solid, up to the end of
+ * the file or to an end line. Polygons are split in triangle fans. The
+ * lines are read twice: first to count the vertices and triangles, so that
+ * the arrays are allocated once, then to fill them.
+ * @param mirror Mirror the vertices along z and reverse the faces
+ * @return An end line was found
+ */
+static bool parse_obj(PARSER* parser, SOLID* solid, ARENA* arena, bool mirror) {
+  PARSER start = *parser;
+  size_t nv = 0, nt = 0;
+  size_t v = 0, t = 0, k;
+  long index, first = 0, previous = 0;
+  bool ended = false;
+  float* points;
+  size_t* indices;
+  char* end;
+
+  do {
+    if(parse_keyword(parser, "end")) {
+      ended = true;
+      break;
+    } else if(parse_keyword(parser, "v")) {
+      nv++;
+    } else if(parse_keyword(parser, "f")) {
+      for(k = 0; !parse_eol(parser); k++) {
+        while(!is_separator(*parser->p))
+          parser->p++;
+      }
+      if(k < 3)
+        parse_error(parser, "faces need at least 3 vertices", "");
+      nt += k - 2;
+    }
+  } while(parse_line(parser));
+  if(nt == 0)
+    parse_error(parser, "mesh without faces", "");
+
+  points = (float*)arena_alloc(arena, sizeof(float) * nv * 3);
+  indices = (size_t*)arena_alloc(arena, sizeof(size_t) * (nt*3 + 1));
+  indices[0] = nt;
+
+  *parser = start;
+  do {
+    if(parse_keyword(parser, "end")) {
+      break;
+    } else if(parse_keyword(parser, "v")) {
+      parse_floats(parser, &points[v*3], 3);
+      if(mirror)
+        points[v*3 + 2] = -points[v*3 + 2];
+      v++;
+    } else if(parse_keyword(parser, "f")) {
+      for(k = 0; !parse_eol(parser); k++) {
+        // v, v/vt, v//vn or v/vt/vn, indices start at 1 or count back from -1
+        index = strtol(parser->p, &end, 10);
+        if(end == parser->p)
+          parse_error(parser, "expected a vertex index", "");
+        // there is no vertex 0, indices start at 1 or -1
+        if(index == 0)
+          parse_error(parser, "vertex index out of range", "");
+        index = (index > 0) ? index - 1 : (long)v + index;
+        if(index < 0 || (size_t)index >= nv)
+          parse_error(parser, "vertex index out of range", "");
+        parser->p = end;
+        while(!is_separator(*parser->p))
+          parser->p++;
+
+        if(k == 0)
+          first = index;
+        if(k >= 2) {
+          indices[1 + t*3] = first;
+          indices[1 + t*3 + 1] = mirror ? index : previous;
+          indices[1 + t*3 + 2] = mirror ? previous : index;
+          t++;
+        }
+        previous = index;
+      }
+    }
+  } while(parse_line(parser));
+
+  solid->num_points = nv;
+  solid->points = points;
+  solid->texCoords = NULL;
+  solid->indices = indices;
+  solid->function = TRIANGLE;
+  solid->mesh = NULL;
+  solid->occludes = NULL;
+  return ended;
+}
+
+void solid_load_obj(SOLID* solid, const char* filename, ARENA* arena) {
+  PARSER parser = { filename, NULL, 1 };
+  size_t size;
+  bool mapped;
+  char* data = file_map(filename, &size, &mapped);
+
+  parser.p = data;
+  parse_obj(&parser, solid, arena, true);
+  file_unmap(data, size, mapped);
+}
+
+/**
+ * Reads a path relative to the scene file, and adds it to the files the
+ * scene depends on.
+ */
+static char* parse_path(LOADER* loader, PARSER* parser) {
+  char word[PATH_MAX];
+  char path[PATH_MAX];
+
+  parse_word(parser, word, sizeof(word));
+  if(snprintf(path, sizeof(path), "%s%s", (word[0] == '/') ? "" : loader->directory, word) >= (int)sizeof(path))
+    parse_error(parser, "path too long", "");
+
+  loader_grow(loader->files, loader->n_files, loader->c_files);
+  return loader->files[loader->n_files++] = arena_strdup(loader->arena, path);
+}
+
+static MATERIAL* find_material(LOADER* loader, PARSER* parser) {
+  char name[LOADER_NAME_SIZE];
+  size_t i;
+
+  parse_word(parser, name, sizeof(name));
+  for(i = 0; i < loader->n_materials; i++) {
+    if(strcmp(loader->materials[i].name, name) == 0)
+      return &loader->materials[i].material;
+  }
+  parse_error(parser, "unknown material ", name);
+  return NULL;
+}
+
+static TEXTURE* find_texture(LOADER* loader, PARSER* parser) {
+  char name[LOADER_NAME_SIZE];
+  size_t i;
+
+  parse_word(parser, name, sizeof(name));
+  for(i = 0; i < loader->n_textures; i++) {
+    if(strcmp(loader->textures[i].name, name) == 0)
+      return loader->textures[i].texture;
+  }
+  parse_error(parser, "unknown texture ", name);
+  return NULL;
+}
+
+/**
+ * Adds a solid with the given material to the scene being parsed.
+ */
+static SOLID* add_solid(LOADER* loader, PARSER* parser) {
+  MATERIAL* material = find_material(loader, parser);
+  SOLID* solid;
+
+  loader_grow(loader->solids, loader->n_solids, loader->c_solids);
+  solid = &loader->solids[loader->n_solids++];
+  memset(solid, 0, sizeof(SOLID));
+  solid->material = *material;
+  solid->num_points = 1;
+  return solid;
+}
+
+static void parse_texture(LOADER* loader, PARSER* parser) {
+  NAMED_TEXTURE* texture;
+  IMAGE* img;
+  size_t i;
+
+  loader_grow(loader->textures, loader->n_textures, loader->c_textures);
+  texture = &loader->textures[loader->n_textures++];
+  parse_word(parser, texture->name, sizeof(texture->name));
+  texture->path = parse_path(loader, parser);
+
+  // names given to a file already read share its texture
+  for(i = 0; i < loader->n_textures - 1; i++) {
+    if(strcmp(loader->textures[i].path, texture->path) == 0) {
+      texture->texture = loader->textures[i].texture;
+      return;
+    }
+  }
+
+  // keep the texture with the rest of the scene
+  img = image_read((char*)texture->path, image_read_ppm);
+  texture->texture = (TEXTURE*)arena_alloc(loader->arena, sizeof(TEXTURE));
+  texture_init(texture->texture, img->width, img->height,
+               (u_int*)arena_alloc(loader->arena, sizeof(u_int) * texture_size(img->width, img->height)));
+  texture_build(texture->texture, img);
+  image_free(img);
+}
+
+static void parse_material(LOADER* loader, PARSER* parser) {
+  NAMED_MATERIAL* named;
+  MATERIAL* material;
+  MATERIAL_PARAMETERS* p;
+  char shading[LOADER_NAME_SIZE];
+  float parameters[sizeof(MATERIAL_PARAMETERS)/sizeof(float)];
+  size_t n, required;
+
+  loader_grow(loader->materials, loader->n_materials, loader->c_materials);
+  named = &loader->materials[loader->n_materials++];
+  material = &named->material;
+  parse_word(parser, named->name, sizeof(named->name));
+
+  parse_word(parser, shading, sizeof(shading));
+  if(strcmp(shading, "lambert") == 0) {
+    material->kind = MATERIAL_LAMBERT;
+    required = 4;
+  } else if(strcmp(shading, "phong") == 0) {
+    material->kind = MATERIAL_PHONG;
+    required = 8;
+  } else {
+    parse_error(parser, "unknown shading ", shading);
+  }
+
+  material->reflectance = parse_float(parser);
+  for(n = 0; !parse_eol(parser) && strncmp(parser->p, "texture", 7) != 0; n++) {
+    if(n == sizeof(parameters)/sizeof(float))
+      parse_error(parser, "too many material parameters", "");
+    parameters[n] = parse_float(parser);
+  }
+  if(n < required)
+    parse_error(parser, "missing parameters of ", shading);
+
+  // the specular parameters of Lambert materials are left unused
+  p = material->parameters = (MATERIAL_PARAMETERS*)arena_alloc(loader->arena, sizeof(MATERIAL_PARAMETERS));
+  memset(p, 0, sizeof(MATERIAL_PARAMETERS));
+  v_copy(p->diffuse_color, &parameters[0]);
+  p->kd = parameters[3];
+  if(material->kind == MATERIAL_PHONG) {
+    v_copy(p->specular_color, &parameters[4]);
+    p->ks = parameters[7];
+  }
+
+  material->texture = NULL;
+  if(parse_keyword(parser, "texture"))
+    material->texture = find_texture(loader, parser);
+}
+
+static void parse_light(LOADER* loader, PARSER* parser) {
+  LIGHT* light;
+
+  loader_grow(loader->lights, loader->n_lights, loader->c_lights);
+  light = &loader->lights[loader->n_lights++];
+  if(parse_keyword(parser, "directional"))
+    light->type = DIRECTIONAL;
+  else if(parse_keyword(parser, "point"))
+    light->type = POINT;
+  else
+    parse_error(parser, "unknown light type", "");
+  parse_floats(parser, light->position, 3);
+  parse_floats(parser, light->color, 3);
+  light->intensity = parse_float(parser);
+}
+
+/**
+ * Reads the culling cutoff and the budget of the lights of the scene.
+ */
+static void parse_lighting(LOADER* loader, PARSER* parser) {
+  float budget = 0.0f;
+
+  loader->scene->light_cutoff = parse_float(parser);
+  if(!parse_eol(parser))
+    budget = parse_float(parser);
+  if(loader->scene->light_cutoff < 0.0f)
+    parse_error(parser, "negative light cutoff", "");
+  if(budget < 0.0f || budget > LIGHT_MAX_SAMPLES || budget != (size_t)budget)
+    parse_error(parser, "light budget out of range", "");
+  loader->scene->light_budget = (size_t)budget;
+}
+
+/**
+ * Reads the point the camera looks at and its field of view.
+ */
+static void parse_camera(LOADER* loader, PARSER* parser) {
+  parse_floats(parser, loader->scene->look, 3);
+  loader->scene->fov = parse_float(parser);
+  if(!(loader->scene->fov > 0.0f && loader->scene->fov < 180.0f))
+    parse_error(parser, "field of view out of range", "");
+}
+
+/**
+ * Reads the next transform of a solid or of its motion.
+ * @return A transform was read, false at the end of the line
+ */
+static bool parse_motion(PARSER* parser, MOTION* step) {
+  if(parse_eol(parser))
+    return false;
+
+  step->degrees = 0.0f;
+  if(parse_keyword(parser, "scale")) {
+    step->type = MOTION_SCALE;
+    step->v[0] = step->v[1] = step->v[2] = parse_float(parser);
+    // a single factor scales uniformly
+    if(!parse_eol(parser) && !isalpha((u_char)*parser->p)) {
+      step->v[1] = parse_float(parser);
+      step->v[2] = parse_float(parser);
+    }
+  } else if(parse_keyword(parser, "rotate")) {
+    step->type = MOTION_ROTATE;
+    parse_floats(parser, step->v, 3);
+    step->degrees = parse_float(parser);
+  } else if(parse_keyword(parser, "translate")) {
+    step->type = MOTION_TRANSLATE;
+    parse_floats(parser, step->v, 3);
+  } else {
+    parse_error(parser, "unexpected ", parser->p);
+  }
+  return true;
+}
+
+/**
+ * Reads the transforms following a solid, and applies them in order.
+ */
+static void parse_transforms(PARSER* parser, SOLID* solid) {
+  MOTION step;
+  float q[4];
+
+  while(parse_motion(parser, &step)) {
+    if(step.type == MOTION_SCALE) {
+      solid_scale(solid, step.v);
+    } else if(step.type == MOTION_ROTATE) {
+      matrix_quaternion(step.v, step.degrees, q);
+      solid_rotate(solid, q);
+    } else {
+      solid_translate(solid, step.v);
+    }
+  }
+}
+
+static void parse_obj_file(LOADER* loader, PARSER* parser) {
+  SOLID* solid = add_solid(loader, parser);
+
+  solid_load_obj(solid, parse_path(loader, parser), loader->arena);
+  parse_transforms(parser, solid);
+}
+
+/**
+ * Copies a loader array to the arena.
+ */
+static void* loader_copy(LOADER* loader, void* array, size_t size) {
+  void* copy = arena_alloc(loader->arena, size);
+  // arrays that were never grown have no storage
+  if(size > 0)
+    memcpy(copy, array, size);
+  free(array);
+  return copy;
+}
+
+/**
+ * Starts an object, the solids up to its end line are its own.
+ */
+static void parse_object(LOADER* loader, PARSER* parser) {
+  NAMED_OBJECT* named;
+
+  if(loader->object != NULL)
+    parse_error(parser, "object inside an object", "");
+  loader_grow(loader->objects, loader->n_objects, loader->c_objects);
+  named = &loader->objects[loader->n_objects++];
+  parse_word(parser, named->name, sizeof(named->name));
+  named->object = loader->object = (OBJECT*)arena_alloc(loader->arena, sizeof(OBJECT));
+  memset(loader->object, 0, sizeof(OBJECT));
+
+  loader->scene_solids = loader->solids;
+  loader->n_scene_solids = loader->n_solids;
+  loader->c_scene_solids = loader->c_solids;
+  loader->solids = NULL;
+  loader->n_solids = loader->c_solids = 0;
+}
+
+/**
+ * Ends the object being read, and goes back to the solids of the scene.
+ */
+static void parse_object_end(LOADER* loader, PARSER* parser) {
+  if(loader->object == NULL)
+    parse_error(parser, "end outside of an object", "");
+  if(loader->n_solids == 0)
+    parse_error(parser, "object without solids", "");
+  loader->object->n_solids = loader->n_solids;
+  loader->object->solids = (SOLID*)loader_copy(loader, loader->solids, sizeof(SOLID) * loader->n_solids);
+
+  loader->object = NULL;
+  loader->solids = loader->scene_solids;
+  loader->n_solids = loader->n_scene_solids;
+  loader->c_solids = loader->c_scene_solids;
+}
+
+static void parse_instance(LOADER* loader, PARSER* parser) {
+  char name[LOADER_NAME_SIZE];
+  OBJECT* object = NULL;
+  SOLID* solid;
+  size_t i;
+
+  // objects hold solids of a single level
+  if(loader->object != NULL)
+    parse_error(parser, "instance inside an object", "");
+  parse_word(parser, name, sizeof(name));
+  for(i = 0; i < loader->n_objects && object == NULL; i++) {
+    if(strcmp(loader->objects[i].name, name) == 0)
+      object = loader->objects[i].object;
+  }
+  if(object == NULL)
+    parse_error(parser, "unknown object ", name);
+
+  loader_grow(loader->solids, loader->n_solids, loader->c_solids);
+  solid = &loader->solids[loader->n_solids++];
+  memset(solid, 0, sizeof(SOLID));
+  solid_instance(solid, object, (INSTANCE*)arena_alloc(loader->arena, sizeof(INSTANCE)));
+  parse_transforms(parser, solid);
+}
+
+/**
+ * Reads the motion of the last instance, whose transform so far is the one
+ * of the first frame, or the eye position of the last frame.
+ */
+static void parse_animate(LOADER* loader, PARSER* parser) {
+  SOLID* solid = (loader->n_solids > 0) ? &loader->solids[loader->n_solids - 1] : NULL;
+  ANIMATION* animation;
+  MOTION* steps = NULL;
+  MOTION* all;
+  size_t n = 0, capacity = 0;
+
+  if(parse_keyword(parser, "eye")) {
+    parse_floats(parser, loader->scene->eye_end, 3);
+    loader->eye_end = true;
+    return;
+  }
+  if(loader->object != NULL || solid == NULL || solid->instance == NULL)
+    parse_error(parser, "animate without an instance", "");
+
+  loader_grow(steps, n, capacity);
+  while(parse_motion(parser, &steps[n])) {
+    n++;
+    loader_grow(steps, n, capacity);
+  }
+  if(n == 0)
+    parse_error(parser, "animate without transforms", "");
+
+  // the steps of several lines follow each other
+  animation = (loader->n_animations > 0) ? &loader->animations[loader->n_animations - 1] : NULL;
+  if(animation == NULL || animation->solid != loader->n_solids - 1) {
+    loader_grow(loader->animations, loader->n_animations, loader->c_animations);
+    animation = &loader->animations[loader->n_animations++];
+    animation->solid = loader->n_solids - 1;
+    m_copy(solid->instance->transform, animation->transform);
+    animation->n_steps = 0;
+    animation->steps = NULL;
+  }
+  all = (MOTION*)arena_alloc(loader->arena, sizeof(MOTION) * (animation->n_steps + n));
+  if(animation->n_steps > 0)
+    memcpy(all, animation->steps, sizeof(MOTION) * animation->n_steps);
+  memcpy(all + animation->n_steps, steps, sizeof(MOTION) * n);
+  animation->steps = all;
+  animation->n_steps += n;
+  free(steps);
+}
+
+static void parse_directive(LOADER* loader, PARSER* parser) {
+  SOLID* solid;
+
+  if(parse_keyword(parser, "background")) {
+    parse_floats(parser, loader->scene->background_color, 3);
+  } else if(parse_keyword(parser, "ambient")) {
+    parse_floats(parser, loader->scene->ambient_color, 3);
+  } else if(parse_keyword(parser, "eye")) {
+    parse_floats(parser, loader->scene->eye, 3);
+  } else if(parse_keyword(parser, "camera")) {
+    parse_camera(loader, parser);
+  } else if(parse_keyword(parser, "texture")) {
+    parse_texture(loader, parser);
+  } else if(parse_keyword(parser, "material")) {
+    parse_material(loader, parser);
+  } else if(parse_keyword(parser, "lighting")) {
+    parse_lighting(loader, parser);
+  } else if(parse_keyword(parser, "light")) {
+    parse_light(loader, parser);
+  } else if(parse_keyword(parser, "sphere")) {
+    solid = add_solid(loader, parser);
+    solid->points = (float*)arena_alloc(loader->arena, sizeof(float) * 4);
+    parse_floats(parser, solid->points, 4);
+    solid->function = SPHERE;
+  } else if(parse_keyword(parser, "plane")) {
+    solid = add_solid(loader, parser);
+    solid->points = (float*)arena_alloc(loader->arena, sizeof(float) * 6);
+    parse_floats(parser, solid->points, 6);
+    solid->function = PLANE;
+  } else if(parse_keyword(parser, "mesh")) {
+    solid = add_solid(loader, parser);
+    parse_end(parser);
+    parse_line(parser);
+    if(!parse_obj(parser, solid, loader->arena, false))
+      parse_error(parser, "mesh without an end line", "");
+  } else if(parse_keyword(parser, "obj")) {
+    parse_obj_file(loader, parser);
+  } else if(parse_keyword(parser, "object")) {
+    parse_object(loader, parser);
+  } else if(parse_keyword(parser, "end")) {
+    parse_object_end(loader, parser);
+  } else if(parse_keyword(parser, "instance")) {
+    parse_instance(loader, parser);
+  } else if(parse_keyword(parser, "animate")) {
+    parse_animate(loader, parser);
+  } else {
+    parse_error(parser, "unknown directive ", parser->p);
+  }
+  parse_end(parser);
+}
+
+SCENE* scene_load_text(const char* filename) {
+  LOADER loader;
+  PARSER parser = { filename, NULL, 1 };
+  SCENE* scene;
+  const char* slash;
+  size_t size, i;
+  bool mapped;
+  char* data;
+
+  memset(&loader, 0, sizeof(LOADER));
+  loader.arena = arena();
+  loader.scene = scene = (SCENE*)arena_alloc(loader.arena, sizeof(SCENE));
+  memset(scene, 0, sizeof(SCENE));
+  v_set(scene->eye, 0.0f, 0.0f, -1.0f);
+  scene->arena = loader.arena;
+
+  slash = strrchr(filename, '/');
+  if(slash != NULL)
+    snprintf(loader.directory, sizeof(loader.directory), "%.*s", (int)(slash - filename + 1), filename);
+  loader_grow(loader.files, loader.n_files, loader.c_files);
+  loader.files[loader.n_files++] = arena_strdup(loader.arena, filename);
+
+  data = file_map(filename, &size, &mapped);
+  parser.p = data;
+  do {
+    if(!parse_eol(&parser))
+      parse_directive(&loader, &parser);
+  } while(parse_line(&parser));
+  if(loader.object != NULL)
+    parse_error(&parser, "object without an end line", "");
+  file_unmap(data, size, mapped);
+
+  scene->n_objects = loader.n_objects;
+  scene->objects = (OBJECT**)arena_alloc(loader.arena, sizeof(OBJECT*) * (loader.n_objects + 1));
+  for(i = 0; i < loader.n_objects; i++)
+    scene->objects[i] = loader.objects[i].object;
+  scene->n_solids = loader.n_solids;
+  scene->solids = (SOLID*)loader_copy(&loader, loader.solids, sizeof(SOLID) * loader.n_solids);
+  scene->n_lights = loader.n_lights;
+  scene->lights = (LIGHT*)loader_copy(&loader, loader.lights, sizeof(LIGHT) * loader.n_lights);
+  scene->n_animations = loader.n_animations;
+  scene->animations = (ANIMATION*)loader_copy(&loader, loader.animations, sizeof(ANIMATION) * loader.n_animations);
+  if(!loader.eye_end)
+    v_copy(scene->eye_end, scene->eye);
+  scene->n_files = loader.n_files;
+  scene->files = (char**)loader_copy(&loader, loader.files, sizeof(char*) * loader.n_files);
+  free(loader.materials);
+  free(loader.textures);
+  free(loader.objects);
+  return scene;
+}
+
+SCENE* scene_load(const char* filename) {
+  SCENE* scene = scene_load_binary(filename);
+
+  if(scene == NULL) {
+    scene = scene_load_text(filename);
+    scene_save_binary(scene, filename);
+  }
+  return scene;
+}
+
+void scene_free(SCENE* scene) {
+  scene_release(scene);
+  // the scene itself lives in its arena
+  arena_free(scene->arena);
+}
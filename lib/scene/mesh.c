@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "vector.h"
+#include "simd.h"
+#include "solid.h"
+#include "mesh.h"
+#include "stats.h"
+
+#define MESH_ALIGNMENT 32
+
+/**
+ * Number of floats an array of n floats takes, keeping the next array aligned.
+ */
+#define aligned_floats(n) (((n) + MESH_ALIGNMENT/sizeof(float) - 1) & ~(MESH_ALIGNMENT/sizeof(float) - 1))
+
+MESH* mesh(SOLID* solid) {
+  size_t i, k;
+  size_t nt;
+  float *block, *p;
+  float *a, *b, *c;
+  float ab[3], ac[3], n[3];
+  float area;
+  MESH* mesh = (MESH*)malloc(sizeof(MESH));
+
+  mesh->n_triangles = nt = solid->indices[0];
+
+  // 13 triangle arrays
+  if(posix_memalign((void**)&block, MESH_ALIGNMENT, sizeof(float)*13*aligned_floats(nt)) != 0) {
+    fprintf(stderr, "Error while allocating a mesh of %zu triangles\n", nt);
+    exit(1);
+  }
+  p = block;
+  for(k = 0; k < 3; k++) {
+    mesh->a[k] = p; p += aligned_floats(nt);
+    mesh->ab[k] = p; p += aligned_floats(nt);
+    mesh->ac[k] = p; p += aligned_floats(nt);
+    mesh->normal[k] = p; p += aligned_floats(nt);
+  }
+  mesh->scale = p;
+
+  for(i = 0; i < nt; i++) {
+    a = &solid->points[solid->indices[1 + i*3]*3];
+    b = &solid->points[solid->indices[1 + i*3 + 1]*3];
+    c = &solid->points[solid->indices[1 + i*3 + 2]*3];
+    v_sub(b, a, ab);
+    v_sub(c, a, ac);
+    v_cross(ab, ac, n);
+    area = v_length(n);
+    v_normalize(n, n);
+    for(k = 0; k < 3; k++) {
+      mesh->a[k][i] = a[k];
+      mesh->ab[k][i] = ab[k];
+      mesh->ac[k][i] = ac[k];
+      mesh->normal[k][i] = n[k];
+    }
+    // the unit texture triangle covers the whole triangle
+    mesh->scale[i] = (area > 0.0f) ? 1.0f/sqrtf(area) : 0.0f;
+  }
+
+  return mesh;
+}
+
+void mesh_free(MESH* mesh) {
+  // every array lives in the block starting at the first vertices
+  free(mesh->a[0]);
+  free(mesh);
+}
+
+bool mesh_intersection(MESH* mesh, size_t i, RAY* ray, RAY_INTERSECTION* intersection) {
+  float ab[3], ac[3];
+  float ao[3], p[3], q[3];
+  float t, u, v;
+  float det;
+
+  stats_count(STATS_TRIANGLE_TESTS, 1);
+  v_set(ab, mesh->ab[0][i], mesh->ab[1][i], mesh->ab[2][i]);
+  v_set(ac, mesh->ac[0][i], mesh->ac[1][i], mesh->ac[2][i]);
+
+  /* MÖLLER-TRUMBORE RAY-TRIANGLE INTERSECTION ALGORITHM */
+  v_cross(ray->direction, ac, p);
+  det = v_dot(ab, p);
+  if(det <= 0.0f)
+    return false;
+  v_set(ao, ray->origin[0] - mesh->a[0][i], ray->origin[1] - mesh->a[1][i], ray->origin[2] - mesh->a[2][i]);
+  u = v_dot(ao, p) / det;
+  if(u < 0.0f || u > 1.0f)
+    return false;
+  v_cross(ao, ab, q);
+  v = v_dot(ray->direction, q) / det;
+  if(v < 0.0f || u + v > 1.0f)
+    return false;
+
+  t = v_dot(ac, q) / det;
+  // the triangle is behind the ray
+  if(t <= 0.0f)
+    return false;
+
+  intersection->t_in = t;
+  intersection->t_out = t;
+  intersection->barycentric[0] = u;
+  intersection->barycentric[1] = v;
+  return true;
+}
+
+SIMD_MASK mesh_packet(MESH* mesh, size_t i, RAY_PACKET* packet, SIMD_FLOAT* t_in, SIMD_FLOAT* t_out) {
+  SIMD_FLOAT ab[3], ac[3];
+  SIMD_FLOAT ao[3], p[3], q[3];
+  SIMD_FLOAT det, u, v;
+  SIMD_FLOAT zero = s_set1(0.0f);
+  SIMD_FLOAT one = s_set1(1.0f);
+  SIMD_MASK hit;
+  int k;
+
+  stats_count(STATS_TRIANGLE_TESTS, __builtin_popcount(packet->active));
+  for(k = 0; k < 3; k++) {
+    ab[k] = s_set1(mesh->ab[k][i]);
+    ac[k] = s_set1(mesh->ac[k][i]);
+  }
+
+  /* MÖLLER-TRUMBORE RAY-TRIANGLE INTERSECTION ALGORITHM */
+  s_cross(packet->direction, ac, p);
+  det = s_dot(ab, p);
+  hit = s_gt(det, zero);
+  if(s_movemask(hit) == 0) {
+    *t_in = *t_out = zero;
+    return hit;
+  }
+
+  for(k = 0; k < 3; k++)
+    ao[k] = s_sub(packet->origin[k], s_set1(mesh->a[k][i]));
+  u = s_div(s_dot(ao, p), det);
+  hit = s_and(hit, s_and(s_ge(u, zero), s_le(u, one)));
+  s_cross(ao, ab, q);
+  v = s_div(s_dot(packet->direction, q), det);
+  hit = s_and(hit, s_and(s_ge(v, zero), s_le(s_add(u, v), one)));
+
+  *t_in = s_div(s_dot(ac, q), det);
+  *t_out = *t_in;
+  return s_and(hit, s_gt(*t_in, zero));
+}
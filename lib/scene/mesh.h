@@ -0,0 +1,82 @@
+/**
+ * Defines a preprocessed triangle mesh, built once from a triangle solid
+ * so that ray tests only stream precomputed data.
+ */
+#ifndef MESH_H_
+#define MESH_H_
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "ray.h"
+#include "packet.h"
+
+struct SOLID;
+
+/**
+ * Triangle mesh stored as a structure of arrays. Each triangle keeps its
+ * first vertex and its two edges, so the Möller-Trumbore test does not
+ * need to gather vertices through the index array, and the attributes of
+ * its hits. The triangles are in
+ * the order of the solid, which scene_prepare renumbers in the order of
+ * the leaves of the hierarchy. Every array lives in a single allocation.
+ */
+typedef struct MESH {
+  size_t n_triangles;
+  float* a[3];      /**< First vertex of each triangle */
+  float* ab[3];     /**< Edge from the first to the second vertex */
+  float* ac[3];     /**< Edge from the first to the third vertex */
+  float* normal[3]; /**< Unit normal of each triangle */
+  float* scale;     /**< Texture coordinates per unit of length, 1/sqrt of the area of the parallelogram of the edges */
+} MESH;
+
+/**
+ * Builds the mesh representation of a triangle solid.
+ * @param solid Triangle solid
+ * @return Pointer to the allocated mesh
+ */
+MESH* mesh(struct SOLID* solid);
+
+/**
+ * Destroys a mesh and its arrays.
+ * @param mesh Mesh to be destroyed
+ */
+void mesh_free(MESH* mesh);
+
+/**
+ * Gets the first vertex and the edges of a triangle of a mesh.
+ * @param mesh     Mesh
+ * @param triangle Index of the triangle
+ * @param a        First vertex
+ * @param ab,ac    Edges from the first vertex
+ */
+#define mesh_edges(mesh, triangle, a, ab, ac) \
+  v_set(a, (mesh)->a[0][triangle], (mesh)->a[1][triangle], (mesh)->a[2][triangle]); \
+  v_set(ab, (mesh)->ab[0][triangle], (mesh)->ab[1][triangle], (mesh)->ab[2][triangle]); \
+  v_set(ac, (mesh)->ac[0][triangle], (mesh)->ac[1][triangle], (mesh)->ac[2][triangle])
+
+/**
+ * Tests a triangle of a mesh for the intersection with a ray. Gives the
+ * same distances and barycentric coordinates as TriangleHit on the solid
+ * the mesh was built from.
+ * @param mesh         Mesh
+ * @param triangle     Index of the triangle
+ * @param ray          Ray
+ * @param intersection Resulting intersection data
+ * @return The ray has intersected the triangle
+ */
+bool mesh_intersection(MESH* mesh, size_t triangle, RAY* ray, RAY_INTERSECTION* intersection);
+
+/**
+ * Tests a triangle of a mesh for the intersection with every lane of a
+ * ray packet.
+ * @param mesh     Mesh
+ * @param triangle Index of the triangle
+ * @param packet   Ray packet
+ * @param t_in     Resulting entry distance of each lane
+ * @param t_out    Resulting exit distance of each lane
+ * @return Mask of the lanes that intersected the triangle
+ */
+SIMD_MASK mesh_packet(MESH* mesh, size_t triangle, RAY_PACKET* packet, SIMD_FLOAT* t_in, SIMD_FLOAT* t_out);
+
+#endif
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scene.h"
+#include "bvh.h"
+#include "mesh.h"
+#include "matrix.h"
+
+/**
+ * Renumbers the triangles of the triangle solids of an array in the order
+ * the leaves of their hierarchy reference them, so that the triangles of
+ * a leaf are next to each other in the meshes built afterwards.
+ */
+static void order_triangles(BVH* bvh, SOLID* solids, size_t n) {
+  size_t i, k, total = 0;
+  size_t *first, *next, *indices;
+  BVH_PRIMITIVE* p;
+
+  // each solid gets its range of the renumbered index array
+  first = (size_t*)malloc(sizeof(size_t) * (n + 1));
+  next = (size_t*)calloc(n + 1, sizeof(size_t));
+  for(i = 0; i < n; i++) {
+    first[i] = total;
+    if(solids[i].function == TRIANGLE)
+      total += solids[i].indices[0];
+  }
+  indices = (size_t*)malloc(sizeof(size_t) * (3*total + 1));
+
+  for(p = bvh->primitives; p < bvh->primitives + bvh->n_primitives; p++) {
+    if(solids[p->solid].function != TRIANGLE)
+      continue;
+    for(k = 0; k < 3; k++)
+      indices[(first[p->solid] + next[p->solid])*3 + k] = solids[p->solid].indices[1 + p->primitive*3 + k];
+    p->primitive = next[p->solid]++;
+  }
+
+  for(i = 0; i < n; i++) {
+    if(solids[i].function == TRIANGLE)
+      memcpy(&solids[i].indices[1], &indices[first[i]*3], sizeof(size_t) * 3*next[i]);
+  }
+  free(indices);
+  free(next);
+  free(first);
+}
+
+/**
+ * Sets the occlusion functions of an array of solids, builds their
+ * hierarchy and then the preprocessed meshes in its order.
+ */
+static BVH* prepare_solids(SOLID* solids, size_t n) {
+  SOLID* s;
+  BVH* hierarchy;
+
+  for(s = solids; s < solids + n; s++) {
+    if(s->occludes == NULL)
+      s->occludes = solid_occlusion_function(s);
+  }
+  hierarchy = bvh(solids, n);
+  order_triangles(hierarchy, solids, n);
+  for(s = solids; s < solids + n; s++) {
+    if(s->function == TRIANGLE)
+      s->mesh = mesh(s);
+  }
+  return hierarchy;
+}
+
+static void release_solids(SOLID* solids, size_t n, BVH** bvh) {
+  SOLID* s;
+
+  for(s = solids; s < solids + n; s++) {
+    if(s->mesh != NULL) {
+      mesh_free(s->mesh);
+      s->mesh = NULL;
+    }
+  }
+  if(*bvh != NULL) {
+    bvh_free(*bvh);
+    *bvh = NULL;
+  }
+}
+
+/**
+ * Checks that the solids of an array have a material, except for the
+ * instances which take the ones of their object.
+ */
+static void validate_solids(SOLID* solids, size_t n, const char* owner) {
+  size_t i;
+
+  for(i = 0; i < n; i++) {
+    if(solids[i].function != INSTANCE_SOLID && solids[i].material.parameters == NULL) {
+      fprintf(stderr, "Error, solid %zu of the %s has no material\n", i, owner);
+      exit(1);
+    }
+  }
+}
+
+void scene_prepare(SCENE* scene) {
+  size_t i;
+
+  scene_release(scene);
+
+  for(i = 0; i < scene->n_lights; i++) {
+    if(!light_prepare(&scene->lights[i])) {
+      fprintf(stderr, "Error, light %zu of the scene is not valid\n", i);
+      exit(1);
+    }
+  }
+  for(i = 0; i < scene->n_objects; i++)
+    validate_solids(scene->objects[i]->solids, scene->objects[i]->n_solids, "objects");
+  validate_solids(scene->solids, scene->n_solids, "scene");
+
+  // the bounds of the instances come from the hierarchies of their objects
+  for(i = 0; i < scene->n_objects; i++)
+    scene->objects[i]->bvh = prepare_solids(scene->objects[i]->solids, scene->objects[i]->n_solids);
+  scene->bvh = prepare_solids(scene->solids, scene->n_solids);
+
+  // only the scenes which ask for it cull or sample their lights
+  if(scene->light_cutoff > 0.0f || scene->light_budget > 0)
+    scene->light_grid = light_grid(scene->lights, scene->n_lights, scene->light_cutoff,
+                                   (scene->light_budget > 0) ? scene->light_budget : LIGHT_BUDGET);
+  scene->prepared = true;
+}
+
+size_t scene_lights(SCENE* scene, const float* point, const float* normal, LIGHT_SAMPLE* samples) {
+  if(scene->light_grid != NULL)
+    return light_select(scene->light_grid, scene->lights, point, normal, samples);
+  return scene->n_lights;
+}
+
+void scene_frame(SCENE* scene, float t, float* eye) {
+  ANIMATION* animation;
+  MOTION* step;
+  SOLID* solid;
+  float M[MATRIX_SIZE];
+  float v[3], q[4];
+  size_t i;
+
+  if(!scene->prepared) {
+    fprintf(stderr, "Error, frames are only set on prepared scenes\n");
+    exit(1);
+  }
+
+  scene->time = t;
+  v_sub(scene->eye_end, scene->eye, v);
+  v_mul(t, v, v);
+  v_add(scene->eye, v, eye);
+
+  for(animation = scene->animations; animation < scene->animations + scene->n_animations; animation++) {
+    solid = &scene->solids[animation->solid];
+    m_copy(animation->transform, solid->instance->transform);
+    for(step = animation->steps; step < animation->steps + animation->n_steps; step++) {
+      if(step->type == MOTION_SCALE) {
+        for(i = 0; i < 3; i++)
+          v[i] = 1.0f + t*(step->v[i] - 1.0f);
+        matrix_scaling(v, M);
+      } else if(step->type == MOTION_ROTATE) {
+        matrix_quaternion(step->v, t*step->degrees, q);
+        matrix_rotation(q, M);
+      } else {
+        v_mul(t, step->v, v);
+        matrix_translation(v, M);
+      }
+      solid_transform(solid, M);
+    }
+  }
+  // only the instances moved, the objects keep their own hierarchies
+  if(scene->n_animations > 0 && scene->bvh != NULL)
+    bvh_refit(scene->bvh, scene->solids);
+}
+
+void scene_release(SCENE* scene) {
+  size_t i;
+
+  for(i = 0; i < scene->n_objects; i++)
+    release_solids(scene->objects[i]->solids, scene->objects[i]->n_solids, &scene->objects[i]->bvh);
+  release_solids(scene->solids, scene->n_solids, &scene->bvh);
+  if(scene->light_grid != NULL) {
+    light_grid_free(scene->light_grid);
+    scene->light_grid = NULL;
+  }
+  scene->prepared = false;
+}
@@ -1,18 +1,196 @@
+/**
+ * Defines the Scene structure, which holds every solid and light to be
+ * rendered, and its preparation for rendering.
+ */
 #ifndef SCENE_H_
 #define SCENE_H_
 
 #include "solid.h"
 #include "light.h"
 
+struct BVH;
+struct ARENA;
+struct LIGHT_GRID;
+
+/**
+ * Step of the motion of an instance over a sequence of frames, done
+ * progressively: at time t the instance is scaled by 1 + t*(s - 1),
+ * rotated by t times the angle, or translated by t times the vector.
+ */
+typedef struct {
+  enum { MOTION_SCALE, MOTION_ROTATE, MOTION_TRANSLATE } type;
+  float v[3];      /**< scale factors, rotation axis or translation */
+  float degrees;   /**< rotation angle */
+} MOTION;
+
+/**
+ * Motion of an instance of the scene, whose steps apply in order after
+ * its own transforms.
+ */
+typedef struct {
+  size_t solid;        /**< index of the instance in the solids of the scene */
+  float transform[12]; /**< transform of the instance at time 0 */
+  size_t n_steps;
+  MOTION* steps;
+} ANIMATION;
+
 typedef struct SCENE {
   size_t n_solids;
   SOLID* solids;
 
+  size_t n_objects;
+  OBJECT** objects;  /**< geometry shared by the instances of the scene */
+
   size_t n_lights;
   LIGHT* lights;
+  float light_cutoff;  /**< contribution below which point lights are culled, 0 for none */
+  size_t light_budget; /**< highest number of lights shading a hit, 0 for the default */
+  struct LIGHT_GRID* light_grid; /**< culling of the lights, built by scene_prepare when needed */
 
   float ambient_color[3];
   float background_color[3];
+  float eye[3];    /**< eye position of a loaded scene */
+  float eye_end[3];    /**< eye position at the end of a sequence of frames */
+  float look[3];   /**< point the eye looks at when the scene gives a camera */
+  float fov;       /**< vertical field of view of the camera in degrees, 0 when there is none */
+
+  size_t n_animations;
+  ANIMATION* animations; /**< moving instances of a sequence of frames */
+  float time;            /**< time of the frame set by scene_frame, 0 until then */
+
+  struct BVH* bvh; /**< acceleration structure, built by scene_prepare */
+  bool prepared;   /**< the scene was validated and prepared, and is frozen until released */
+  struct ARENA* arena; /**< memory of a loaded scene, NULL for static scenes */
+  size_t n_files;
+  char** files;        /**< files a loaded scene was read from */
 } SCENE;
 
+/**
+ * Validates a scene, computes the runtime terms of its lights, builds the
+ * acceleration structures of the scene and the preprocessed meshes of its
+ * triangle solids, and sets their occlusion functions. Exits when a light
+ * is not valid or a solid has no material. Once prepared, the scene is
+ * frozen: it may only be moved by scene_frame until scene_release. The
+ * light grid is only built when the scene culls or samples its lights
+ * with a lighting line, every light shading every hit otherwise. Each
+ * object gets its own hierarchy, which the scene hierarchy refers to
+ * through the instances of the object. Must be called once the solids of
+ * the scene are in place and before rendering it, and again whenever
+ * their points or transforms change.
+ * @param scene Scene
+ */
+void scene_prepare(SCENE* scene);
+
+/**
+ * Chooses the lights shading a hit, which scene_light then gives. Every
+ * light is chosen with a weight of 1 when the scene has no light grid,
+ * that is when it has no cutoff and no budget, whatever its number of
+ * lights: samples is then left as it is. See light_select otherwise.
+ * @param scene   Prepared scene
+ * @param point   Shaded point
+ * @param normal  Normal at the point
+ * @param samples Resulting lights, in the order of the light array, room for LIGHT_MAX_SAMPLES
+ * @return Number of lights chosen
+ */
+size_t scene_lights(SCENE* scene, const float* point, const float* normal, LIGHT_SAMPLE* samples);
+
+/**
+ * Gives the k-th light chosen by scene_lights, a LIGHT_SAMPLE.
+ * @param scene   Prepared scene
+ * @param samples Lights given to scene_lights
+ * @param k       Index of the light, below the number of lights chosen
+ */
+#define scene_light(scene, samples, k) \
+  (((scene)->light_grid != NULL) ? (samples)[k] : (LIGHT_SAMPLE){ &(scene)->lights[k], 1.0f })
+
+/**
+ * Moves a prepared scene to a time of its sequence of frames. The animated
+ * instances are placed, and the scene hierarchy is refitted to their new
+ * bounds rather than rebuilt, the hierarchies of the objects being left
+ * as they are.
+ * @param scene Scene
+ * @param t     Time, from 0 for the first frame to 1 for the last one
+ * @param eye   Resulting eye position, moved in a straight line from eye to eye_end
+ */
+void scene_frame(SCENE* scene, float t, float* eye);
+
+/**
+ * Frees the data built by scene_prepare, after which the scene may be
+ * changed again.
+ * @param scene Scene
+ */
+void scene_release(SCENE* scene);
+
+/**
+ * Loads a scene from a text scene file. The binary cache of the file
+ * (filename.bin) is used instead when it is newer than the file and every
+ * file it includes, otherwise the cache is written after parsing the
+ * text. The scene must be freed with scene_free.
+ *
+ * Scene files hold one directive per line, # starts a comment and paths
+ * are relative to the scene file:
+ *   background r g b
+ *   ambient r g b
+ *   eye x y z
+ *   camera x y z fov
+ *   texture name file.ppm
+ *   material name lambert|phong reflectance parameters... [texture name]
+ *   light directional|point x y z r g b intensity
+ *   lighting cutoff [budget]
+ *   sphere material x y z radius
+ *   plane material x y z nx ny nz
+ *   mesh material, followed by OBJ v and f lines and a closing end line
+ *   obj material file.obj [scale s] [rotate ax ay az degrees] [translate x y z]
+ *   object name, followed by solid directives and a closing end line
+ *   instance name [scale s|sx sy sz] [rotate ax ay az degrees] [translate x y z]
+ *   animate [scale s|sx sy sz] [rotate ax ay az degrees] [translate x y z]
+ *   animate eye x y z
+ * Each texture file is read once, and its mipmapped texture is shared by
+ * every material and texture name using it. The solids of an object are
+ * only rendered through its instances, which share them; the transforms
+ * of an instance apply in the order they are written. An animate line
+ * moves the instance of the line before it over a sequence of frames, its
+ * transforms being done progressively from the first frame to the last,
+ * or gives the eye position of the last frame. The camera line points
+ * the eye at x y z, with a vertical field of view of fov degrees; without
+ * it, the eye looks along z through a window of the plane z = 0 centered
+ * on the origin, 1 high. The lighting line culls
+ * the point lights whose intensity times brightest color over squared
+ * distance is below the cutoff, 0 for none, and shades each hit with at
+ * most budget lights, 16 by default and at most 64, sampled by their
+ * contribution when more of them reach the hit. Without a lighting
+ * line, every light shades every hit.
+ * @param filename Name of the scene file
+ * @return Scene pointer read
+ */
+SCENE* scene_load(const char* filename);
+
+/**
+ * Loads a scene from a text scene file, without using its binary cache.
+ * @param filename Name of the scene file
+ * @return Scene pointer read
+ */
+SCENE* scene_load_text(const char* filename);
+
+/**
+ * Writes the binary cache of a loaded scene.
+ * @param scene    Scene loaded by scene_load_text
+ * @param filename Name of the scene file
+ * @return The cache was written
+ */
+bool scene_save_binary(SCENE* scene, const char* filename);
+
+/**
+ * Loads a scene from the binary cache of a scene file.
+ * @param filename Name of the scene file
+ * @return Scene pointer read, or NULL when the cache is missing or outdated
+ */
+SCENE* scene_load_binary(const char* filename);
+
+/**
+ * Frees a scene loaded by scene_load and all of its data.
+ * @param scene Scene
+ */
+void scene_free(SCENE* scene);
+
 #endif
@@ -2,33 +2,286 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdbool.h>
+#include <float.h>
 #include "solid.h"
 #include "ray.h"
+#include "mesh.h"
+#include "bvh.h"
+#include "matrix.h"
+#include "stats.h"
+
+/**
+ * Smallest cosine between a ray and a surface used to stretch the ray
+ * footprint, which would be infinite at a grazing angle.
+ */
+#define SOLID_GRAZING 0.01f
 
 bool solid_intersection(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection)
 {
   intersection->solid = NULL;
+  intersection->instance = NULL;
   intersection->ray = ray;
   return solid->function(solid, ray, intersection);
 }
 
-void solid_translate(SOLID* solid, const float* t) {
-  size_t i;
-  for(i = 0; i < solid->num_points; i++) {
-    v_add(&solid->points[i*3], t, &solid->points[i*3]);
+/**
+ * Moves a ray to the space of an instance. The direction is not normalized,
+ * so that distances along both rays are the same.
+ * @param instance Instance
+ * @param ray      Ray, in world space
+ * @param local    Resulting ray, in object space
+ * @param origin   Storage of the origin of the resulting ray
+ */
+static void instance_ray(INSTANCE* instance, RAY* ray, RAY* local, float* origin) {
+  *local = *ray;
+  local->origin = origin;
+  m_point(instance->inverse, ray->origin, origin);
+  m_vector(instance->inverse, ray->direction, local->direction);
+}
+
+/**
+ * Computes the attributes of a hit of an instance in object space, with a
+ * unit direction, and moves them back to world space.
+ */
+static void instance_attributes(RAY_INTERSECTION* intersection) {
+  SOLID* solid = intersection->instance;
+  RAY* ray = intersection->ray;
+  float t_in = intersection->t_in;
+  float t_out = intersection->t_out;
+  float origin[3], normal[3];
+  float length;
+  RAY local;
+
+  instance_ray(solid->instance, ray, &local, origin);
+  length = v_length(local.direction);
+  v_mul(1.0f/length, local.direction, local.direction);
+  // footprints are measured in object space units
+  local.width = ray->width/solid->instance->scale;
+  local.spread = ray->spread/(solid->instance->scale*length);
+
+  intersection->ray = &local;
+  intersection->instance = NULL;
+  intersection->t_in = t_in*length;
+  intersection->t_out = t_out*length;
+  solid_hit_attributes(intersection);
+
+  intersection->ray = ray;
+  intersection->instance = solid;
+  intersection->t_in = t_in;
+  intersection->t_out = t_out;
+  v_mul(t_in, ray->direction, intersection->point);
+  v_add(ray->origin, intersection->point, intersection->point);
+  m_normal(solid->instance->inverse, intersection->normal, normal);
+  v_normalize(normal, intersection->normal);
+}
+
+void solid_hit_attributes(RAY_INTERSECTION* intersection)
+{
+  SOLID* solid = intersection->solid;
+  RAY* ray = intersection->ray;
+  float cosine;
+
+  if(intersection->instance != NULL) {
+    instance_attributes(intersection);
+    return;
   }
+
+  // intersection->point = t*direction + origin;
+  v_mul(intersection->t_in, ray->direction, intersection->point);
+  v_add(ray->origin, intersection->point, intersection->point);
+
+  if(solid->function == SPHERE)
+    SphereAttributes(solid, intersection);
+  else if(solid->function == PLANE)
+    PlaneAttributes(solid, intersection);
+  else if(solid->function == TRIANGLE)
+    TriangleAttributes(solid, intersection);
+
+  // the attributes give the texture coordinates per unit of length, the
+  // footprint is stretched on surfaces seen at grazing angles
+  cosine = fabsf(v_dot(intersection->normal, ray->direction));
+  intersection->texture[2] *= (ray->width + ray->spread*intersection->t_in)/fmaxf(cosine, SOLID_GRAZING);
 }
-void solid_scale(SOLID* solid, const float* s) {
+
+size_t solid_primitives(SOLID* solid) {
+  if(solid->function == TRIANGLE)
+    return solid->indices[0];
+  if(solid->function == PLANE)
+    return 0;
+  // instances of objects with unbounded solids are unbounded too
+  if(solid->function == INSTANCE_SOLID && solid->instance->object->bvh->n_unbounded > 0)
+    return 0;
+  return 1;
+}
+
+bool solid_bounds(SOLID* solid, size_t primitive, float* min, float* max) {
+  size_t i, k;
+  float* p;
+  float corner[3], q[3];
+  BVH_NODE* root;
+
+  if(solid->function == PLANE) {
+    return false;
+  } else if(solid->function == INSTANCE_SOLID) {
+    // bound the corners of the transformed box of the object
+    root = solid->instance->object->bvh->nodes;
+    if(solid->instance->object->bvh->n_nodes == 0)
+      return false;
+    v_set(min, FLT_MAX, FLT_MAX, FLT_MAX);
+    v_set(max, -FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for(i = 0; i < 8; i++) {
+      v_set(corner, (i & 1) ? root->max[0] : root->min[0],
+                    (i & 2) ? root->max[1] : root->min[1],
+                    (i & 4) ? root->max[2] : root->min[2]);
+      m_point(solid->instance->transform, corner, q);
+      for(k = 0; k < 3; k++) {
+        min[k] = fminf(min[k], q[k]);
+        max[k] = fmaxf(max[k], q[k]);
+      }
+    }
+  } else if(solid->function == SPHERE) {
+    v_set(min, solid->points[0], solid->points[1], solid->points[2]);
+    v_set(max, solid->points[0], solid->points[1], solid->points[2]);
+    for(k = 0; k < 3; k++) {
+      min[k] -= solid->points[3];
+      max[k] += solid->points[3];
+    }
+  } else if(solid->function == TRIANGLE) {
+    v_copy(min, &solid->points[solid->indices[1 + primitive*3]*3]);
+    v_copy(max, min);
+    for(i = 1; i < 3; i++) {
+      p = &solid->points[solid->indices[1 + primitive*3 + i]*3];
+      for(k = 0; k < 3; k++) {
+        min[k] = fminf(min[k], p[k]);
+        max[k] = fmaxf(max[k], p[k]);
+      }
+    }
+  } else {
+    // unknown solid, bound all of its points
+    v_copy(min, solid->points);
+    v_copy(max, solid->points);
+    for(i = 1; i < solid->num_points; i++) {
+      p = &solid->points[i*3];
+      for(k = 0; k < 3; k++) {
+        min[k] = fminf(min[k], p[k]);
+        max[k] = fmaxf(max[k], p[k]);
+      }
+    }
+  }
+  return true;
+}
+
+bool solid_occludes(SOLID* solid, size_t primitive, RAY* ray, float max_t) {
+  RAY_INTERSECTION i;
+  if(solid->occludes != NULL)
+    return solid->occludes(solid, primitive, ray, max_t);
+  return solid_primitive_intersection(solid, primitive, ray, &i)
+    && i.t_in < max_t && (i.t_in > ray->near || i.t_out > ray->near);
+}
+
+bool(*solid_occlusion_function(SOLID* solid))(SOLID*, size_t, RAY*, float) {
+  if(solid->function == SPHERE)
+    return SphereOccludes;
+  if(solid->function == PLANE)
+    return PlaneOccludes;
+  if(solid->function == TRIANGLE)
+    return TriangleOccludes;
+  if(solid->function == INSTANCE_SOLID)
+    return InstanceOccludes;
+  return NULL;
+}
+
+bool solid_primitive_intersection(SOLID* solid, size_t primitive, RAY* ray, RAY_INTERSECTION* intersection)
+{
+  intersection->solid = NULL;
+  intersection->instance = NULL;
+  intersection->ray = ray;
+  if(solid->function == TRIANGLE) {
+    if(solid->mesh == NULL)
+      return TriangleHit(solid, primitive, ray, intersection);
+    if(!mesh_intersection(solid->mesh, primitive, ray, intersection))
+      return false;
+    intersection->solid = solid;
+    intersection->primitive = primitive;
+    return true;
+  }
+  return solid->function(solid, ray, intersection);
+}
+
+bool solid_instance_intersection(SOLID* instance, SOLID* solid, size_t primitive, RAY* ray, RAY_INTERSECTION* intersection)
+{
+  float origin[3];
+  RAY local;
+
+  instance_ray(instance->instance, ray, &local, origin);
+  if(!solid_primitive_intersection(solid, primitive, &local, intersection))
+    return false;
+  intersection->ray = ray;
+  intersection->instance = instance;
+  return true;
+}
+
+void solid_instance(SOLID* solid, OBJECT* object, INSTANCE* instance) {
+  instance->object = object;
+  m_identity(instance->transform);
+  m_identity(instance->inverse);
+  instance->scale = 1.0f;
+  solid->instance = instance;
+  solid->function = INSTANCE_SOLID;
+  solid->num_points = 0;
+  solid->points = NULL;
+  solid->indices = NULL;
+}
+
+void solid_transform(SOLID* solid, const float* M) {
+  INSTANCE* instance = solid->instance;
+  float inverse[MATRIX_SIZE];
+  float p[3];
+  float det;
   size_t i;
+
+  if(instance != NULL) {
+    m_mulm(M, instance->transform, instance->transform);
+    det = matrix_inverse(instance->transform, instance->inverse);
+  } else {
+    det = matrix_inverse(M, inverse);
+  }
+  if(det == 0.0f) {
+    fprintf(stderr, "Error, solid transform is not invertible\n");
+    exit(1);
+  }
+  if(instance != NULL) {
+    instance->scale = cbrtf(fabsf(det));
+    return;
+  }
+
   for(i = 0; i < solid->num_points; i++) {
-    v_mulv(&solid->points[i*3], s, &solid->points[i*3]);
+    m_point(M, &solid->points[i*3], p);
+    v_copy(&solid->points[i*3], p);
   }
+  // the normal of a plane follows its surface
+  if(solid->function == PLANE) {
+    m_normal(inverse, &solid->points[3], p);
+    v_copy(&solid->points[3], p);
+  }
+}
+
+void solid_translate(SOLID* solid, const float* t) {
+  float M[MATRIX_SIZE];
+  matrix_translation(t, M);
+  solid_transform(solid, M);
+}
+void solid_scale(SOLID* solid, const float* s) {
+  float M[MATRIX_SIZE];
+  matrix_scaling(s, M);
+  solid_transform(solid, M);
 }
 void solid_rotate(SOLID* solid, const float* q) {
-  // TODO
+  float M[MATRIX_SIZE];
+  matrix_rotation(q, M);
+  solid_transform(solid, M);
 }
 
-
 bool SphereFunction(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection)
 {
   float dist[3];
@@ -40,39 +293,66 @@ bool SphereFunction(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection)
   float c = v_dot(dist, dist) - pow(radius, 2);
   float delta = b*b - 4*a*c;
 
-  float north[] = { 0.0f, 1.0f, 0.0f };
-  float equator[] = { 0.0f, 0.0f, 1.0f };
-
   float t1, t2;
 
+  stats_count(STATS_SPHERE_TESTS, 1);
   if(delta >= 0) {
     intersection->solid = solid;
+    intersection->primitive = 0;
     t1 = (-b + sqrtf(delta))/(2*a);
     t2 = (-b - sqrtf(delta))/(2*a);
     intersection->t_in = fmin(t1, t2);
     intersection->t_out = fmax(t1, t2);
+  }
 
-    // intersection->point = t*direction + origin;
-    v_mul(intersection->t_in, ray->direction, intersection->point);
-    v_add(ray->origin, intersection->point, intersection->point);
+  return (intersection->solid != NULL);
+}
 
-    v_sub(intersection->point, centre, dist);
-    v_normalize(dist, intersection->normal);
+void SphereAttributes(SOLID* solid, RAY_INTERSECTION* intersection)
+{
+  float dist[3];
+  const VECTOR centre = solid->points;
+  float north[] = { 0.0f, 1.0f, 0.0f };
+  float equator[] = { 0.0f, 0.0f, 1.0f };
 
-    float phi = acosf(-v_dot(north, intersection->normal));
-    intersection->texture[1] = phi / M_PI;
+  v_sub(intersection->point, centre, dist);
+  v_normalize(dist, intersection->normal);
 
-    float theta = acosf(v_dot(equator, intersection->normal) / sin(phi)) / (2*M_PI);
-    v_cross(north, equator, equator);
-    if(v_dot(equator, intersection->normal) > 0)
-      intersection->texture[0] = theta;
-    else
-      intersection->texture[0] = 1 - theta;
+  float phi = acosf(-v_dot(north, intersection->normal));
+  intersection->texture[1] = phi / M_PI;
 
-    v_clamp(intersection->texture, 0.0f, 1.0f, intersection->texture);
-  }
+  float theta = acosf(v_dot(equator, intersection->normal) / sin(phi)) / (2*M_PI);
+  v_cross(north, equator, equator);
+  if(v_dot(equator, intersection->normal) > 0)
+    intersection->texture[0] = theta;
+  else
+    intersection->texture[0] = 1 - theta;
 
-  return (intersection->solid != NULL);
+  v_clamp(intersection->texture, 0.0f, 1.0f, intersection->texture);
+
+  // a unit of texture area covers 2*pi^2*r^2*sin(phi) of the surface
+  intersection->texture[2] = 1.0f/(M_PI*solid->points[3]*sqrtf(2*fmaxf(sinf(phi), SOLID_GRAZING)));
+}
+
+bool SphereOccludes(SOLID* solid, size_t primitive, RAY* ray, float max_t) {
+  float dist[3];
+  float radius = solid->points[3];
+  float a, b, c, delta, root;
+  float t_in, t_out;
+
+  stats_count(STATS_SPHERE_TESTS, 1);
+  v_sub(ray->origin, solid->points, dist);
+  a = v_dot(ray->direction, ray->direction);
+  b = 2*v_dot(ray->direction, dist);
+  c = v_dot(dist, dist) - radius*radius;
+  delta = b*b - 4*a*c;
+  if(delta < 0)
+    return false;
+
+  root = sqrtf(delta);
+  t_in = fminf((-b + root)/(2*a), (-b - root)/(2*a));
+  t_out = fmaxf((-b + root)/(2*a), (-b - root)/(2*a));
+  return t_in < max_t && (t_in > ray->near || t_out > ray->near);
 }
 
 bool PlaneFunction(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection) {
@@ -86,8 +366,11 @@ bool PlaneFunction(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection) {
   t = (p0 - o)·n ÷ (d·n)
   */
   float a[3];
-  float* normal = &solid->points[3];
-  v_normalize(normal, normal);
+  float normal[3];
+
+  stats_count(STATS_PLANE_TESTS, 1);
+  // the solid is shared between threads, normalize a copy
+  v_normalize(&solid->points[3], normal);
 
   intersection->t_in = ray->far;
   intersection->t_out = ray->far;
@@ -100,20 +383,37 @@ bool PlaneFunction(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection) {
     intersection->t_out = intersection->t_in;
 
     intersection->solid = solid;
-
-    v_copy(intersection->normal, normal);
-    // intersection->point = t*direction + origin;
-    v_mul(intersection->t_in, ray->direction, intersection->point);
-    v_add(ray->origin, intersection->point, intersection->point);
+    intersection->primitive = 0;
 
     return true;
   }
   return false;
 }
 
-bool TriangleFunction(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection)
+void PlaneAttributes(SOLID* solid, RAY_INTERSECTION* intersection) {
+  v_normalize(&solid->points[3], intersection->normal);
+  // planes have no texture coordinates
+  v_set(intersection->texture, 0.0f, 0.0f, 0.0f);
+}
+
+bool PlaneOccludes(SOLID* solid, size_t primitive, RAY* ray, float max_t) {
+  float a[3];
+  float normal[3];
+  float dn, t;
+
+  stats_count(STATS_PLANE_TESTS, 1);
+  v_normalize(&solid->points[3], normal);
+  dn = v_dot(ray->direction, normal);
+  if(dn == 0.0f)
+    return false;
+  v_sub(&solid->points[0], ray->origin, a);
+  t = v_dot(a, normal) / dn;
+  return t < max_t && t > ray->near;
+}
+
+bool TriangleHit(SOLID* solid, size_t triangle, RAY* ray, RAY_INTERSECTION* intersection)
 {
-  size_t i;
+  const size_t* indices = &solid->indices[1 + triangle*3];
   float *a, *b, *c;
 
   float ab[3], ac[3];
@@ -121,52 +421,151 @@ bool TriangleFunction(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection)
   float t, u, v;
   float det;
 
-  intersection->t_in = ray->far;
-  intersection->t_out = ray->near;
+  stats_count(STATS_TRIANGLE_TESTS, 1);
+  a = &solid->points[indices[0]*3];
+  b = &solid->points[indices[1]*3];
+  c = &solid->points[indices[2]*3];
 
-  for(i = 0; i < solid->indices[0]*3;) {
-    a = &solid->points[solid->indices[++i]*3];
-    b = &solid->points[solid->indices[++i]*3];
-    c = &solid->points[solid->indices[++i]*3];
+  /* MÖLLER-TRUMBORE RAY-TRIANGLE INTERSECTION ALGORITHM */
+  v_sub(b, a, ab);
+  v_sub(c, a, ac);
 
-    /* MÖLLER-TRUMBORE RAY-TRIANGLE INTERSECTION ALGORITHM */
-    v_sub(b, a, ab);
-    v_sub(c, a, ac);
+  v_cross(ray->direction, ac, p);
+  det = v_dot(ab, p);
+  if(det <= 0.0f)
+    return false;
+  v_sub(ray->origin, a, ao);
+  u = v_dot(ao, p) / det;
+  if(u < 0.0f || u > 1.0f)
+    return false;
+  v_cross(ao, ab, q);
+  v = v_dot(ray->direction, q) / det;
+  if(v < 0.0f || u + v > 1.0f)
+    return false;
 
-    v_cross(ray->direction, ac, p);
-    det = v_dot(ab, p);
-    if(det <= 0.0f)
-      continue;
-    v_sub(ray->origin, a, ao);
-    u = v_dot(ao, p) / det;
-    if(u < 0.0f || u > 1.0f)
-      continue;
-    v_cross(ao, ab, q);
-    v = v_dot(ray->direction, q) / det;
-    if(v < 0.0f || u + v > 1.0f)
+  t = v_dot(ac, q) / det;
+  // the triangle is behind the ray
+  if(t <= 0.0f)
+    return false;
+
+  intersection->solid = solid;
+  intersection->primitive = triangle;
+  intersection->t_in = t;
+  intersection->t_out = t;
+  intersection->barycentric[0] = u;
+  intersection->barycentric[1] = v;
+  return true;
+}
+
+void TriangleAttributes(SOLID* solid, RAY_INTERSECTION* intersection)
+{
+  size_t triangle = intersection->primitive;
+  const size_t* indices;
+  float ab[3], ac[3];
+  float area; // of the parallelogram of the edges
+
+  // the mesh keeps the normal and the texture scale of each triangle
+  if(solid->mesh != NULL) {
+    v_set(intersection->normal, solid->mesh->normal[0][triangle], solid->mesh->normal[1][triangle], solid->mesh->normal[2][triangle]);
+    v_set(intersection->texture, intersection->barycentric[0], intersection->barycentric[1], solid->mesh->scale[triangle]);
+    return;
+  }
+
+  // set normal
+  indices = &solid->indices[1 + triangle*3];
+  v_sub(&solid->points[indices[1]*3], &solid->points[indices[0]*3], ab);
+  v_sub(&solid->points[indices[2]*3], &solid->points[indices[0]*3], ac);
+  v_cross(ab, ac, intersection->normal);
+  area = v_length(intersection->normal);
+  v_normalize(intersection->normal, intersection->normal);
+
+  // set texCoords, the unit texture triangle covers the whole triangle
+  v_set(intersection->texture, intersection->barycentric[0], intersection->barycentric[1],
+        (area > 0.0f) ? 1.0f/sqrtf(area) : 0.0f);
+}
+
+bool TriangleOccludes(SOLID* solid, size_t triangle, RAY* ray, float max_t)
+{
+  float a[3], ab[3], ac[3];
+  float ao[3], p[3], q[3];
+  float t, u, v;
+  float det;
+
+  stats_count(STATS_TRIANGLE_TESTS, 1);
+  if(solid->mesh != NULL) {
+    mesh_edges(solid->mesh, triangle, a, ab, ac);
+  } else {
+    const size_t* indices = &solid->indices[1 + triangle*3];
+    v_copy(a, &solid->points[indices[0]*3]);
+    v_sub(&solid->points[indices[1]*3], a, ab);
+    v_sub(&solid->points[indices[2]*3], a, ac);
+  }
+
+  v_cross(ray->direction, ac, p);
+  det = v_dot(ab, p);
+  if(det <= 0.0f)
+    return false;
+  v_sub(ray->origin, a, ao);
+  u = v_dot(ao, p) / det;
+  if(u < 0.0f || u > 1.0f)
+    return false;
+  v_cross(ao, ab, q);
+  v = v_dot(ray->direction, q) / det;
+  if(v < 0.0f || u + v > 1.0f)
+    return false;
+
+  t = v_dot(ac, q) / det;
+  return t > 0.0f && t > ray->near && t < max_t;
+}
+
+bool TriangleFunction(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection)
+{
+  size_t i;
+  RAY_INTERSECTION hit;
+
+  intersection->t_in = ray->far;
+  intersection->t_out = ray->near;
+
+  for(i = 0; i < solid->indices[0]; i++) {
+    if(solid->mesh != NULL ? !mesh_intersection(solid->mesh, i, ray, &hit) : !TriangleHit(solid, i, ray, &hit))
       continue;
 
-    t = v_dot(ac, q) / det;
-    // if ray intersects triangle
-    if(t > 0.0f) {
-      intersection->solid = solid;
-
-      if(t < intersection->t_in) {
-        intersection->t_in = t;
-        // set texCoords
-        v_set(intersection->texture, u, v, 0.0f);
-        // set normal
-        v_cross(ab, ac, intersection->normal);
-        v_normalize(intersection->normal, intersection->normal);
-        // intersection->point = t*direction + origin;
-        v_mul(intersection->t_in, ray->direction, intersection->point);
-        v_add(ray->origin, intersection->point, intersection->point);
-      }
+    intersection->solid = solid;
 
-      if(t > intersection->t_out)
-        intersection->t_out = t;
+    if(hit.t_in < intersection->t_in) {
+      intersection->t_in = hit.t_in;
+      intersection->primitive = i;
+      intersection->barycentric[0] = hit.barycentric[0];
+      intersection->barycentric[1] = hit.barycentric[1];
     }
+
+    if(hit.t_out > intersection->t_out)
+      intersection->t_out = hit.t_out;
   }
 
   return (intersection->solid != NULL);
 }
+
+bool InstanceFunction(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection)
+{
+  OBJECT* object = solid->instance->object;
+  float origin[3];
+  RAY local;
+
+  instance_ray(solid->instance, ray, &local, origin);
+  if(!bvh_intersect(object->bvh, object->solids, &local, intersection))
+    return false;
+  intersection->ray = ray;
+  intersection->instance = solid;
+  return true;
+}
+
+bool InstanceOccludes(SOLID* solid, size_t primitive, RAY* ray, float max_t)
+{
+  OBJECT* object = solid->instance->object;
+  float origin[3];
+  RAY local;
+
+  instance_ray(solid->instance, ray, &local, origin);
+  return bvh_occluded(object->bvh, object->solids, &local, max_t, NULL);
+}
@@ -7,12 +7,21 @@
 
 #include "vector.h"
 #include "ray.h"
+#include "packet.h"
 #include "light.h"
 #include "material.h"
 
+struct MESH;
+struct ARENA;
+struct BVH;
+struct INSTANCE;
+
 /**
  * Defines a generic solid composed by an array of points and indices,
  * a material, and a ray intersection test function.
+ * Intersection functions only find the hit distances, the primitive hit
+ * and its barycentric coordinates; the rest of the intersection data is
+ * computed by solid_hit_attributes for the nearest hit.
  */
 typedef struct SOLID {
   size_t num_points; /**< number of points */
@@ -22,8 +31,34 @@ typedef struct SOLID {
   MATERIAL material; /**< solid material */
 
   bool(*function)(struct SOLID*, RAY*, RAY_INTERSECTION*); /**< ray test function */
+
+  struct MESH* mesh; /**< preprocessed triangles, built by scene_prepare */
+  bool(*occludes)(struct SOLID*, size_t, RAY*, float); /**< any-hit test function, set by scene_prepare */
+  struct INSTANCE* instance; /**< shared geometry and transform of an instance, NULL for other solids */
 } SOLID;
 
+/**
+ * Geometry shared by any number of instances: solids in object space,
+ * with their own acceleration structure.
+ */
+typedef struct OBJECT {
+  size_t n_solids;
+  SOLID* solids;
+  struct BVH* bvh; /**< acceleration structure, built by scene_prepare */
+} OBJECT;
+
+/**
+ * Placement of an object in the scene. Rays are moved to object space by
+ * the inverse transform and traverse the hierarchy of the object, which
+ * forms the second level below the scene hierarchy.
+ */
+typedef struct INSTANCE {
+  OBJECT* object;
+  float transform[12]; /**< object to world affine matrix, see matrix.h */
+  float inverse[12];   /**< world to object affine matrix */
+  float scale;         /**< cubic root of the volume scale, shrinks ray footprints in object space */
+} INSTANCE;
+
 /**
  * Calls the ray intersection function of a solid.
  * @param solid        Solid
@@ -33,10 +68,135 @@ typedef struct SOLID {
  */
 bool solid_intersection(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection);
 
+/**
+ * Computes the hit point, normal and texture coordinates of an
+ * intersection found by an intersection function. Called once for the
+ * nearest intersection of a ray.
+ * @param intersection Intersection, its ray and solid must be set
+ */
+void solid_hit_attributes(RAY_INTERSECTION* intersection);
+
+/**
+ * Returns the number of primitives of a solid that can be bounded
+ * individually by an acceleration structure. Meshes have one primitive per
+ * triangle, unbounded solids (planes) have none.
+ * @param solid Solid
+ * @return Number of bounded primitives
+ */
+size_t solid_primitives(SOLID* solid);
+
+/**
+ * Calculates the axis aligned bounding box of a primitive of a solid.
+ * @param solid     Solid
+ * @param primitive Index of the primitive (triangle index for meshes)
+ * @param min,max   Resulting box corners
+ * @return The primitive has finite bounds
+ */
+bool solid_bounds(SOLID* solid, size_t primitive, float* min, float* max);
+
+/**
+ * Tests a single primitive of a solid for the intersection with a ray.
+ * For meshes only the given triangle is tested, for other solids the whole
+ * solid is tested.
+ * @param solid        Solid
+ * @param primitive    Index of the primitive
+ * @param ray          Ray
+ * @param intersection Resulting intersection data
+ * @return The ray has intersected the primitive
+ */
+bool solid_primitive_intersection(SOLID* solid, size_t primitive, RAY* ray, RAY_INTERSECTION* intersection);
+
+/**
+ * Tests whether a primitive of a solid blocks a ray before a distance.
+ * Only decides whether there is a hit, no intersection data is computed.
+ * Solids without an occlusion function use their intersection function.
+ * @param solid     Solid
+ * @param primitive Index of the primitive
+ * @param ray       Ray
+ * @param max_t     Distance along the ray after which hits do not count
+ * @return The primitive blocks the ray
+ */
+bool solid_occludes(SOLID* solid, size_t primitive, RAY* ray, float max_t);
+
+/**
+ * Returns the occlusion function matching the intersection function of
+ * a solid, or NULL when it has none.
+ * @param solid Solid
+ */
+bool(*solid_occlusion_function(SOLID* solid))(SOLID*, size_t, RAY*, float);
+
+/**
+ * Tests a single primitive of a solid for the intersection with every
+ * lane of a ray packet.
+ * @param solid     Solid
+ * @param primitive Index of the primitive
+ * @param packet    Ray packet
+ * @param t_in      Resulting entry distance of each lane
+ * @param t_out     Resulting exit distance of each lane
+ * @return Mask of the lanes that intersected the primitive
+ */
+SIMD_MASK solid_primitive_packet(SOLID* solid, size_t primitive, RAY_PACKET* packet, SIMD_FLOAT* t_in, SIMD_FLOAT* t_out);
+
+/**
+ * Reads the vertices and faces of a Wavefront OBJ file into a triangle
+ * solid. Polygons are split in triangle fans, and the right handed OBJ
+ * coordinates are mirrored along z into the scene coordinates. The arrays
+ * of the solid are allocated in an arena.
+ * @param solid    Triangle solid
+ * @param filename Name of the OBJ file
+ * @param arena    Arena
+ */
+void solid_load_obj(SOLID* solid, const char* filename, struct ARENA* arena);
+
+/**
+ * Transforms the points of a solid, and the normal of a plane, or applies
+ * an affine matrix after the transform of an instance. The radius of a
+ * sphere is kept.
+ * @param solid Solid
+ * @param M     Invertible affine matrix, see matrix.h
+ */
+void solid_transform(SOLID* solid, const float* M);
+
+/**
+ * Translates, scales or rotates a solid with solid_transform.
+ * @param solid Solid
+ * @param t     Translation vector
+ * @param s     Scale factors along each axis
+ * @param q     Unit quaternion {x, y, z, w} of a rotation around the origin
+ */
 void solid_translate(SOLID* solid, const float* t);
 void solid_scale(SOLID* solid, const float* s);
 void solid_rotate(SOLID* solid, const float* q);
 
+/**
+ * Makes a solid an instance of an object, with an identity transform.
+ * @param solid    Solid
+ * @param object   Object
+ * @param instance Instance data, which must live as long as the solid
+ */
+void solid_instance(SOLID* solid, OBJECT* object, INSTANCE* instance);
+
+/**
+ * Tests a single primitive of an object solid for the intersection with a
+ * ray, moving the ray to the space of an instance of the object.
+ * @param instance     Instance solid
+ * @param solid        Solid of the object
+ * @param primitive    Index of the primitive
+ * @param ray          Ray, in world space
+ * @param intersection Resulting intersection data, whose ray is the world ray
+ * @return The ray has intersected the primitive
+ */
+bool solid_instance_intersection(SOLID* instance, SOLID* solid, size_t primitive, RAY* ray, RAY_INTERSECTION* intersection);
+
+/**
+ * Moves the lanes of a packet to the space of an instance. Directions are
+ * not normalized, so hit distances are the same in both spaces.
+ * @param instance Instance solid
+ * @param packet   Packet, in world space
+ * @param local    Resulting packet, in object space
+ */
+void solid_instance_packet(SOLID* instance, RAY_PACKET* packet, RAY_PACKET* local);
+
 
 #define SPHERE SphereFunction
 /**
@@ -48,9 +208,33 @@ void solid_rotate(SOLID* solid, const float* q);
  * @param intersection Resulting intersection data
  */
 bool SphereFunction(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection);
+/**
+ * Packet version of the sphere test, computes the hit distances only.
+ */
+SIMD_MASK SpherePacket(SOLID* solid, RAY_PACKET* packet, SIMD_FLOAT* t_in, SIMD_FLOAT* t_out);
+/**
+ * Occlusion version of the sphere test.
+ */
+bool SphereOccludes(SOLID* solid, size_t primitive, RAY* ray, float max_t);
+/**
+ * Computes the normal and the spherical texture coordinates of a hit.
+ */
+void SphereAttributes(SOLID* solid, RAY_INTERSECTION* intersection);
 
 #define PLANE PlaneFunction
 bool PlaneFunction(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection);
+/**
+ * Packet version of the plane test, computes the hit distances only.
+ */
+SIMD_MASK PlanePacket(SOLID* solid, RAY_PACKET* packet, SIMD_FLOAT* t_in, SIMD_FLOAT* t_out);
+/**
+ * Occlusion version of the plane test.
+ */
+bool PlaneOccludes(SOLID* solid, size_t primitive, RAY* ray, float max_t);
+/**
+ * Computes the normal of a hit.
+ */
+void PlaneAttributes(SOLID* solid, RAY_INTERSECTION* intersection);
 
 
 #define TRIANGLE TriangleFunction
@@ -59,11 +243,52 @@ bool PlaneFunction(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection);
  * between a ray and a triangle
  * The point array of a triangle solid is of the form: {{[vertices]}},
  * and the index array gives the information about the connection
- * of the vertices.
+ * of the vertices. When the solid has a preprocessed mesh, the mesh
+ * triangles are tested instead.
  * @param solid        Sphere
  * @param ray          Ray
  * @param intersection Resulting intersection data
  */
 bool TriangleFunction(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection);
+/**
+ * Tests a single triangle of a triangle solid for the intersection with
+ * a ray, with the same Möller-Trumbore test as TriangleFunction.
+ * @param solid        Triangle solid
+ * @param triangle     Index of the triangle
+ * @param ray          Ray
+ * @param intersection Resulting intersection data
+ */
+bool TriangleHit(SOLID* solid, size_t triangle, RAY* ray, RAY_INTERSECTION* intersection);
+/**
+ * Packet version of the Möller-Trumbore test of a single triangle,
+ * computes the hit distances only.
+ */
+SIMD_MASK TrianglePacket(SOLID* solid, size_t triangle, RAY_PACKET* packet, SIMD_FLOAT* t_in, SIMD_FLOAT* t_out);
+/**
+ * Occlusion version of the test of a single triangle.
+ */
+bool TriangleOccludes(SOLID* solid, size_t triangle, RAY* ray, float max_t);
+/**
+ * Computes the normal of the triangle hit, its barycentric coordinates
+ * are used as texture coordinates.
+ */
+void TriangleAttributes(SOLID* solid, RAY_INTERSECTION* intersection);
+
+
+#define INSTANCE_SOLID InstanceFunction
+/**
+ * Finds the nearest hit of a ray with the object of an instance, through
+ * the hierarchy of the object. The intersection keeps the solid of the
+ * object hit, and the instance is recorded in intersection->instance.
+ * The hierarchies of the objects are built by scene_prepare.
+ * @param solid        Instance solid
+ * @param ray          Ray
+ * @param intersection Resulting intersection data
+ */
+bool InstanceFunction(SOLID* solid, RAY* ray, RAY_INTERSECTION* intersection);
+/**
+ * Occlusion version of the instance test.
+ */
+bool InstanceOccludes(SOLID* solid, size_t primitive, RAY* ray, float max_t);
 
 #endif
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include "simd.h"
+#include "solid.h"
+#include "mesh.h"
+#include "stats.h"
+
+/**
+ * Broadcasts a vector to every lane.
+ */
+#define s_vset1(r, v) \
+  (r)[0] = s_set1((v)[0]); \
+  (r)[1] = s_set1((v)[1]); \
+  (r)[2] = s_set1((v)[2])
+
+void solid_instance_packet(SOLID* instance, RAY_PACKET* packet, RAY_PACKET* local) {
+  const float* M = instance->instance->inverse;
+  float direction[3][SIMD_WIDTH];
+  int k, lane;
+
+  for(k = 0; k < 3; k++) {
+    local->origin[k] = s_add(s_add(s_mul(s_set1(M[k]), packet->origin[0]), s_mul(s_set1(M[3 + k]), packet->origin[1])),
+                             s_add(s_mul(s_set1(M[6 + k]), packet->origin[2]), s_set1(M[9 + k])));
+    local->direction[k] = s_add(s_add(s_mul(s_set1(M[k]), packet->direction[0]), s_mul(s_set1(M[3 + k]), packet->direction[1])),
+                                s_mul(s_set1(M[6 + k]), packet->direction[2]));
+    local->inverse[k] = s_div(s_set1(1.0f), local->direction[k]);
+    s_store(direction[k], local->direction[k]);
+  }
+  local->near = packet->near;
+  local->far = packet->far;
+  local->active = packet->active;
+
+  // the traversal order follows the first active lane
+  lane = (packet->active != 0) ? __builtin_ctz(packet->active) : 0;
+  for(k = 0; k < 3; k++)
+    local->sign[k] = direction[k][lane] < 0.0f;
+}
+
+SIMD_MASK solid_primitive_packet(SOLID* solid, size_t primitive, RAY_PACKET* packet, SIMD_FLOAT* t_in, SIMD_FLOAT* t_out) {
+  int lane, hits = 0;
+  float o[3];
+  float origin[3][SIMD_WIDTH], direction[3][SIMD_WIDTH];
+  float near[SIMD_WIDTH], tin[SIMD_WIDTH], tout[SIMD_WIDTH];
+  RAY ray;
+  RAY_INTERSECTION i;
+
+  if(solid->function == SPHERE)
+    return SpherePacket(solid, packet, t_in, t_out);
+  if(solid->function == PLANE)
+    return PlanePacket(solid, packet, t_in, t_out);
+  if(solid->function == TRIANGLE) {
+    if(solid->mesh != NULL)
+      return mesh_packet(solid->mesh, primitive, packet, t_in, t_out);
+    return TrianglePacket(solid, primitive, packet, t_in, t_out);
+  }
+
+  // no packet test for this solid, test lane by lane
+  s_store(origin[0], packet->origin[0]);
+  s_store(origin[1], packet->origin[1]);
+  s_store(origin[2], packet->origin[2]);
+  s_store(direction[0], packet->direction[0]);
+  s_store(direction[1], packet->direction[1]);
+  s_store(direction[2], packet->direction[2]);
+  s_store(near, packet->near);
+  s_store(tin, packet->far);
+  s_store(tout, packet->far);
+  for(lane = 0; lane < SIMD_WIDTH; lane++) {
+    if(!(packet->active & (1 << lane)))
+      continue;
+    v_set(o, origin[0][lane], origin[1][lane], origin[2][lane]);
+    v_set(ray.direction, direction[0][lane], direction[1][lane], direction[2][lane]);
+    ray.near = near[lane];
+    ray.far = tin[lane];
+    ray.origin = o;
+    if(solid_primitive_intersection(solid, primitive, &ray, &i)) {
+      tin[lane] = i.t_in;
+      tout[lane] = i.t_out;
+      hits |= 1 << lane;
+    }
+  }
+  *t_in = s_load(tin);
+  *t_out = s_load(tout);
+  return s_mask(hits);
+}
+
+SIMD_MASK SpherePacket(SOLID* solid, RAY_PACKET* packet, SIMD_FLOAT* t_in, SIMD_FLOAT* t_out) {
+  SIMD_FLOAT centre[3], dist[3];
+  SIMD_FLOAT a, b, c, delta, root, t1, t2;
+  SIMD_FLOAT radius = s_set1(solid->points[3]);
+  SIMD_FLOAT two = s_set1(2.0f);
+  SIMD_MASK hit;
+
+  stats_count(STATS_SPHERE_TESTS, __builtin_popcount(packet->active));
+  s_vset1(centre, solid->points);
+  s_vsub(packet->origin, centre, dist);
+  a = s_dot(packet->direction, packet->direction);
+  b = s_mul(two, s_dot(packet->direction, dist));
+  c = s_sub(s_dot(dist, dist), s_mul(radius, radius));
+  delta = s_sub(s_mul(b, b), s_mul(s_mul(s_set1(4.0f), a), c));
+  hit = s_ge(delta, s_set1(0.0f));
+
+  root = s_sqrt(s_max(delta, s_set1(0.0f)));
+  a = s_mul(two, a);
+  t1 = s_div(s_sub(root, b), a);
+  t2 = s_div(s_sub(s_sub(s_set1(0.0f), b), root), a);
+  *t_in = s_min(t1, t2);
+  *t_out = s_max(t1, t2);
+  return hit;
+}
+
+SIMD_MASK PlanePacket(SOLID* solid, RAY_PACKET* packet, SIMD_FLOAT* t_in, SIMD_FLOAT* t_out) {
+  float n[3];
+  SIMD_FLOAT normal[3], point[3], a[3];
+  SIMD_FLOAT dn;
+  SIMD_MASK hit;
+
+  stats_count(STATS_PLANE_TESTS, __builtin_popcount(packet->active));
+  v_normalize(&solid->points[3], n);
+  s_vset1(normal, n);
+  s_vset1(point, solid->points);
+
+  dn = s_dot(packet->direction, normal);
+  hit = s_neq(dn, s_set1(0.0f));
+  s_vsub(point, packet->origin, a);
+  *t_in = s_div(s_dot(a, normal), dn);
+  *t_out = *t_in;
+  return hit;
+}
+
+SIMD_MASK TrianglePacket(SOLID* solid, size_t triangle, RAY_PACKET* packet, SIMD_FLOAT* t_in, SIMD_FLOAT* t_out) {
+  const size_t* indices = &solid->indices[1 + triangle*3];
+  float *a, *b, *c;
+  float ab[3], ac[3];
+
+  SIMD_FLOAT A[3], AB[3], AC[3];
+  SIMD_FLOAT ao[3], p[3], q[3];
+  SIMD_FLOAT det, u, v;
+  SIMD_FLOAT zero = s_set1(0.0f);
+  SIMD_FLOAT one = s_set1(1.0f);
+  SIMD_MASK hit;
+
+  stats_count(STATS_TRIANGLE_TESTS, __builtin_popcount(packet->active));
+  a = &solid->points[indices[0]*3];
+  b = &solid->points[indices[1]*3];
+  c = &solid->points[indices[2]*3];
+  v_sub(b, a, ab);
+  v_sub(c, a, ac);
+  s_vset1(A, a);
+  s_vset1(AB, ab);
+  s_vset1(AC, ac);
+
+  /* MÖLLER-TRUMBORE RAY-TRIANGLE INTERSECTION ALGORITHM */
+  s_cross(packet->direction, AC, p);
+  det = s_dot(AB, p);
+  hit = s_gt(det, zero);
+  if(s_movemask(hit) == 0) {
+    *t_in = *t_out = zero;
+    return hit;
+  }
+
+  s_vsub(packet->origin, A, ao);
+  u = s_div(s_dot(ao, p), det);
+  hit = s_and(hit, s_and(s_ge(u, zero), s_le(u, one)));
+  s_cross(ao, AB, q);
+  v = s_div(s_dot(packet->direction, q), det);
+  hit = s_and(hit, s_and(s_ge(v, zero), s_le(s_add(u, v), one)));
+
+  *t_in = s_div(s_dot(AC, q), det);
+  *t_out = *t_in;
+  return s_and(hit, s_gt(*t_in, zero));
+}
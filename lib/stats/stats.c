@@ -0,0 +1,75 @@
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+
+__thread STATS stats_thread;
+
+static STATS total;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* counter_names[STATS_COUNTERS] = {
+  "primary_rays", "shadow_rays", "occluder_hits", "occluder_misses", "reflection_rays",
+  "sphere_tests", "plane_tests", "triangle_tests", "box_tests"
+};
+static const char* timer_names[STATS_TIMERS] = {
+  "cast", "trace", "load", "prepare", "image"
+};
+
+double stats_clock() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+void stats_merge() {
+  int k;
+
+  pthread_mutex_lock(&lock);
+  for(k = 0; k < STATS_COUNTERS; k++)
+    total.counters[k] += stats_thread.counters[k];
+  for(k = 0; k < STATS_MAX_DEPTH; k++)
+    total.depths[k] += stats_thread.depths[k];
+  for(k = 0; k < STATS_TIMERS; k++)
+    total.times[k] += stats_thread.times[k];
+  pthread_mutex_unlock(&lock);
+  memset(&stats_thread, 0, sizeof(STATS));
+}
+
+void stats_total(STATS* stats) {
+  pthread_mutex_lock(&lock);
+  *stats = total;
+  pthread_mutex_unlock(&lock);
+}
+
+void stats_reset() {
+  pthread_mutex_lock(&lock);
+  memset(&total, 0, sizeof(STATS));
+  pthread_mutex_unlock(&lock);
+  memset(&stats_thread, 0, sizeof(STATS));
+}
+
+void stats_print(FILE* file, const STATS* stats) {
+  unsigned long long tests;
+  int k;
+
+  for(k = 0; k < STATS_COUNTERS; k++)
+    fprintf(file, "%-16s %14llu\n", counter_names[k], stats->counters[k]);
+  tests = stats->counters[STATS_OCCLUDER_HITS] + stats->counters[STATS_OCCLUDER_MISSES];
+  if(tests > 0)
+    fprintf(file, "%-16s %13.1f%%\n", "occluder_rate", 100.0*stats->counters[STATS_OCCLUDER_HITS]/tests);
+  for(k = 0; k < STATS_MAX_DEPTH; k++) {
+    if(stats->depths[k] > 0)
+      fprintf(file, "depth %-10d %14llu\n", k, stats->depths[k]);
+  }
+  for(k = 0; k < STATS_TIMERS; k++)
+    fprintf(file, "%-16s %13.3fs\n", timer_names[k], stats->times[k]);
+}
+
+const char* stats_counter_name(STATS_COUNTER counter) {
+  return counter_names[counter];
+}
+
+const char* stats_timer_name(STATS_TIMER timer) {
+  return timer_names[timer];
+}
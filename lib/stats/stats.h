@@ -0,0 +1,141 @@
+/**
+ * Defines the rendering statistics: ray and intersection test counters and
+ * phase timers kept by each thread, and added up into totals when the
+ * thread is done. Counting and timing are compiled out when STATS_DISABLE
+ * is defined.
+ */
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdio.h>
+
+#define STATS_MAX_DEPTH 8
+
+/**
+ * Counted events.
+ */
+typedef enum {
+  STATS_PRIMARY_RAYS,
+  STATS_SHADOW_RAYS,
+  STATS_OCCLUDER_HITS,  /**< shadow rays blocked by the last occluder of their light */
+  STATS_OCCLUDER_MISSES,/**< shadow rays the last occluder of their light did not block */
+  STATS_REFLECTION_RAYS,
+  STATS_SPHERE_TESTS,   /**< ray-sphere tests, a packet counts one per lane */
+  STATS_PLANE_TESTS,    /**< ray-plane tests */
+  STATS_TRIANGLE_TESTS, /**< ray-triangle tests */
+  STATS_BOX_TESTS,      /**< ray-box tests of the acceleration structure */
+  STATS_COUNTERS
+} STATS_COUNTER;
+
+/**
+ * Timed phases.
+ */
+typedef enum {
+  STATS_CAST,    /**< casting rays against the scene, including shadow rays */
+  STATS_TRACE,   /**< rendering tiles, casting and shading */
+  STATS_LOAD,    /**< loading scenes */
+  STATS_PREPARE, /**< building acceleration structures */
+  STATS_IMAGE,   /**< writing images */
+  STATS_TIMERS
+} STATS_TIMER;
+
+typedef struct STATS {
+  unsigned long long counters[STATS_COUNTERS];
+  unsigned long long depths[STATS_MAX_DEPTH]; /**< rays traced at each bounce, the last one counts deeper rays too */
+  double times[STATS_TIMERS]; /**< seconds, summed over the threads */
+} STATS;
+
+/**
+ * Statistics of the calling thread, not yet added to the totals.
+ */
+extern __thread STATS stats_thread;
+
+#ifndef STATS_DISABLE
+
+#define STATS_ENABLED 1
+
+/**
+ * Counts events in the statistics of the calling thread.
+ * @param counter Counter
+ * @param n       Number of events
+ */
+#define stats_count(counter, n) (stats_thread.counters[counter] += (n))
+
+/**
+ * Counts a ray traced after a number of bounces.
+ * @param depth Number of bounces
+ */
+#define stats_depth(depth) \
+  (stats_thread.depths[((depth) < STATS_MAX_DEPTH) ? (depth) : STATS_MAX_DEPTH - 1]++)
+
+/**
+ * Returns the start time of a timed phase.
+ */
+#define stats_start() stats_clock()
+
+/**
+ * Adds the time elapsed since start to a timer of the calling thread.
+ * @param timer Timer
+ * @param start Time returned by stats_start when the phase started
+ */
+#define stats_time(timer, start) (stats_thread.times[timer] += stats_clock() - (start))
+
+/**
+ * Returns the number of tests made so far by the calling thread, used as
+ * the cost of the rays it traced.
+ */
+#define stats_cost() \
+  (stats_thread.counters[STATS_SPHERE_TESTS] + stats_thread.counters[STATS_PLANE_TESTS] + \
+   stats_thread.counters[STATS_TRIANGLE_TESTS] + stats_thread.counters[STATS_BOX_TESTS])
+
+#else
+
+#define STATS_ENABLED 0
+#define stats_count(counter, n) ((void)0)
+#define stats_depth(depth) ((void)0)
+#define stats_start() 0.0
+#define stats_time(timer, start) ((void)(start))
+#define stats_cost() 0ULL
+
+#endif
+
+/**
+ * Returns a monotonic time in seconds.
+ */
+double stats_clock();
+
+/**
+ * Adds the statistics of the calling thread to the totals and clears them.
+ * Called by every thread once it is done.
+ */
+void stats_merge();
+
+/**
+ * Copies the totals added up so far.
+ * @param stats Resulting statistics
+ */
+void stats_total(STATS* stats);
+
+/**
+ * Clears the totals and the statistics of the calling thread.
+ */
+void stats_reset();
+
+/**
+ * Prints a report of statistics.
+ * @param file  File pointer
+ * @param stats Statistics
+ */
+void stats_print(FILE* file, const STATS* stats);
+
+/**
+ * Returns the name of a counter, for reports.
+ */
+const char* stats_counter_name(STATS_COUNTER counter);
+
+/**
+ * Returns the name of a timer, for reports.
+ */
+const char* stats_timer_name(STATS_TIMER timer);
+
+#endif
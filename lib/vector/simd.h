@@ -0,0 +1,153 @@
+/**
+ * Defines a portable SIMD float type and its arithmetic, used to process
+ * several rays at once. Uses AVX2 (8 lanes) or SSE (4 lanes) when the
+ * compiler targets them, and a scalar 4 lane fallback otherwise or when
+ * SIMD_DISABLE is defined.
+ * As in vector.h, the s_ prefixed names are the ones to be used.
+ */
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include <math.h>
+
+#if defined(__AVX2__) && !defined(SIMD_DISABLE)
+  #include <immintrin.h>
+  #define SIMD_AVX2
+  #define SIMD_WIDTH 8
+#elif defined(__SSE2__) && !defined(SIMD_DISABLE)
+  #include <emmintrin.h>
+  #define SIMD_SSE
+  #define SIMD_WIDTH 4
+#else
+  #define SIMD_SCALAR
+  #define SIMD_WIDTH 4
+#endif
+
+/**
+ * Mask with every lane set.
+ */
+#define SIMD_ALL ((1 << SIMD_WIDTH) - 1)
+
+#if defined(SIMD_AVX2)
+
+typedef __m256 SIMD_FLOAT;  /**< SIMD_WIDTH floats */
+typedef __m256 SIMD_MASK;   /**< Lane mask, result of a comparison */
+
+#define s_set1(x)      _mm256_set1_ps(x)
+#define s_load(p)      _mm256_loadu_ps(p)
+#define s_store(p, a)  _mm256_storeu_ps(p, a)
+#define s_add(a, b)    _mm256_add_ps(a, b)
+#define s_sub(a, b)    _mm256_sub_ps(a, b)
+#define s_mul(a, b)    _mm256_mul_ps(a, b)
+#define s_div(a, b)    _mm256_div_ps(a, b)
+#define s_min(a, b)    _mm256_min_ps(a, b)
+#define s_max(a, b)    _mm256_max_ps(a, b)
+#define s_sqrt(a)      _mm256_sqrt_ps(a)
+#define s_lt(a, b)     _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define s_le(a, b)     _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define s_gt(a, b)     _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define s_ge(a, b)     _mm256_cmp_ps(a, b, _CMP_GE_OQ)
+#define s_neq(a, b)    _mm256_cmp_ps(a, b, _CMP_NEQ_OQ)
+#define s_and(a, b)    _mm256_and_ps(a, b)
+#define s_or(a, b)     _mm256_or_ps(a, b)
+#define s_andnot(a, b) _mm256_andnot_ps(a, b)
+#define s_select(m, a, b) _mm256_blendv_ps(b, a, m)
+#define s_movemask(m)  _mm256_movemask_ps(m)
+
+static inline SIMD_MASK s_mask(int bits) {
+  __m256i lanes = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+  __m256i set = _mm256_and_si256(_mm256_set1_epi32(bits), lanes);
+  return _mm256_castsi256_ps(_mm256_cmpeq_epi32(set, lanes));
+}
+
+#elif defined(SIMD_SSE)
+
+typedef __m128 SIMD_FLOAT;  /**< SIMD_WIDTH floats */
+typedef __m128 SIMD_MASK;   /**< Lane mask, result of a comparison */
+
+#define s_set1(x)      _mm_set1_ps(x)
+#define s_load(p)      _mm_loadu_ps(p)
+#define s_store(p, a)  _mm_storeu_ps(p, a)
+#define s_add(a, b)    _mm_add_ps(a, b)
+#define s_sub(a, b)    _mm_sub_ps(a, b)
+#define s_mul(a, b)    _mm_mul_ps(a, b)
+#define s_div(a, b)    _mm_div_ps(a, b)
+#define s_min(a, b)    _mm_min_ps(a, b)
+#define s_max(a, b)    _mm_max_ps(a, b)
+#define s_sqrt(a)      _mm_sqrt_ps(a)
+#define s_lt(a, b)     _mm_cmplt_ps(a, b)
+#define s_le(a, b)     _mm_cmple_ps(a, b)
+#define s_gt(a, b)     _mm_cmpgt_ps(a, b)
+#define s_ge(a, b)     _mm_cmpge_ps(a, b)
+#define s_neq(a, b)    _mm_cmpneq_ps(a, b)
+#define s_and(a, b)    _mm_and_ps(a, b)
+#define s_or(a, b)     _mm_or_ps(a, b)
+#define s_andnot(a, b) _mm_andnot_ps(a, b)
+#define s_select(m, a, b) _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+#define s_movemask(m)  _mm_movemask_ps(m)
+
+static inline SIMD_MASK s_mask(int bits) {
+  __m128i lanes = _mm_set_epi32(8, 4, 2, 1);
+  __m128i set = _mm_and_si128(_mm_set1_epi32(bits), lanes);
+  return _mm_castsi128_ps(_mm_cmpeq_epi32(set, lanes));
+}
+
+#else
+
+typedef struct { float v[SIMD_WIDTH]; } SIMD_FLOAT; /**< SIMD_WIDTH floats */
+typedef struct { int v[SIMD_WIDTH]; } SIMD_MASK;    /**< Lane mask, result of a comparison */
+
+#define SIMD_LANES(r, expression) { int _i; for(_i = 0; _i < SIMD_WIDTH; _i++) r.v[_i] = (expression); }
+
+static inline SIMD_FLOAT s_set1(float x) { SIMD_FLOAT r; SIMD_LANES(r, x); return r; }
+static inline SIMD_FLOAT s_load(const float* p) { SIMD_FLOAT r; SIMD_LANES(r, p[_i]); return r; }
+static inline void s_store(float* p, SIMD_FLOAT a) { int i; for(i = 0; i < SIMD_WIDTH; i++) p[i] = a.v[i]; }
+static inline SIMD_FLOAT s_add(SIMD_FLOAT a, SIMD_FLOAT b) { SIMD_FLOAT r; SIMD_LANES(r, a.v[_i] + b.v[_i]); return r; }
+static inline SIMD_FLOAT s_sub(SIMD_FLOAT a, SIMD_FLOAT b) { SIMD_FLOAT r; SIMD_LANES(r, a.v[_i] - b.v[_i]); return r; }
+static inline SIMD_FLOAT s_mul(SIMD_FLOAT a, SIMD_FLOAT b) { SIMD_FLOAT r; SIMD_LANES(r, a.v[_i] * b.v[_i]); return r; }
+static inline SIMD_FLOAT s_div(SIMD_FLOAT a, SIMD_FLOAT b) { SIMD_FLOAT r; SIMD_LANES(r, a.v[_i] / b.v[_i]); return r; }
+static inline SIMD_FLOAT s_min(SIMD_FLOAT a, SIMD_FLOAT b) { SIMD_FLOAT r; SIMD_LANES(r, a.v[_i] < b.v[_i] ? a.v[_i] : b.v[_i]); return r; }
+static inline SIMD_FLOAT s_max(SIMD_FLOAT a, SIMD_FLOAT b) { SIMD_FLOAT r; SIMD_LANES(r, a.v[_i] > b.v[_i] ? a.v[_i] : b.v[_i]); return r; }
+static inline SIMD_FLOAT s_sqrt(SIMD_FLOAT a) { SIMD_FLOAT r; SIMD_LANES(r, sqrtf(a.v[_i])); return r; }
+static inline SIMD_MASK s_lt(SIMD_FLOAT a, SIMD_FLOAT b) { SIMD_MASK r; SIMD_LANES(r, -(a.v[_i] < b.v[_i])); return r; }
+static inline SIMD_MASK s_le(SIMD_FLOAT a, SIMD_FLOAT b) { SIMD_MASK r; SIMD_LANES(r, -(a.v[_i] <= b.v[_i])); return r; }
+static inline SIMD_MASK s_gt(SIMD_FLOAT a, SIMD_FLOAT b) { SIMD_MASK r; SIMD_LANES(r, -(a.v[_i] > b.v[_i])); return r; }
+static inline SIMD_MASK s_ge(SIMD_FLOAT a, SIMD_FLOAT b) { SIMD_MASK r; SIMD_LANES(r, -(a.v[_i] >= b.v[_i])); return r; }
+static inline SIMD_MASK s_neq(SIMD_FLOAT a, SIMD_FLOAT b) { SIMD_MASK r; SIMD_LANES(r, -(a.v[_i] != b.v[_i])); return r; }
+static inline SIMD_MASK s_and(SIMD_MASK a, SIMD_MASK b) { SIMD_MASK r; SIMD_LANES(r, a.v[_i] & b.v[_i]); return r; }
+static inline SIMD_MASK s_or(SIMD_MASK a, SIMD_MASK b) { SIMD_MASK r; SIMD_LANES(r, a.v[_i] | b.v[_i]); return r; }
+static inline SIMD_MASK s_andnot(SIMD_MASK a, SIMD_MASK b) { SIMD_MASK r; SIMD_LANES(r, ~a.v[_i] & b.v[_i]); return r; }
+static inline SIMD_FLOAT s_select(SIMD_MASK m, SIMD_FLOAT a, SIMD_FLOAT b) { SIMD_FLOAT r; SIMD_LANES(r, m.v[_i] ? a.v[_i] : b.v[_i]); return r; }
+static inline int s_movemask(SIMD_MASK m) { int i, bits = 0; for(i = 0; i < SIMD_WIDTH; i++) bits |= (m.v[i] != 0) << i; return bits; }
+static inline SIMD_MASK s_mask(int bits) { SIMD_MASK r; SIMD_LANES(r, -((bits >> _i) & 1)); return r; }
+
+#endif
+
+/**
+ * Dot product of two vectors of SIMD lanes.
+ * @param u,v Input vectors, arrays of 3 SIMD_FLOAT
+ */
+#define s_dot(u, v) \
+  s_add(s_add(s_mul((u)[0], (v)[0]), s_mul((u)[1], (v)[1])), s_mul((u)[2], (v)[2]))
+
+/**
+ * Cross product of two vectors of SIMD lanes.
+ * @param u,v Input vectors, arrays of 3 SIMD_FLOAT
+ * @param r   Result vector
+ */
+#define s_cross(u, v, r) \
+  (r)[0] = s_sub(s_mul((u)[1], (v)[2]), s_mul((u)[2], (v)[1])); \
+  (r)[1] = s_sub(s_mul((u)[2], (v)[0]), s_mul((u)[0], (v)[2])); \
+  (r)[2] = s_sub(s_mul((u)[0], (v)[1]), s_mul((u)[1], (v)[0]))
+
+/**
+ * Subtracts two vectors of SIMD lanes.
+ * @param u,v Input vectors, arrays of 3 SIMD_FLOAT
+ * @param r   Result vector
+ */
+#define s_vsub(u, v, r) \
+  (r)[0] = s_sub((u)[0], (v)[0]); \
+  (r)[1] = s_sub((u)[1], (v)[1]); \
+  (r)[2] = s_sub((u)[2], (v)[2])
+
+#endif
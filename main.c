@@ -1,178 +1,287 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <unistd.h>
 #include "image.h"
 #include "vector.h"
 #include "scene.h"
 #include "ray.h"
 #include "material.h"
+#include "render.h"
+#include "checkpoint.h"
+#include "distribute.h"
+#include "stats.h"
 
-#define WIDTH  400
-#define HEIGHT WIDTH
+#define SIZE 400
 
 #define RESOLUTION 1
 #define ANTIALIAS  2
+#define THRESHOLD  0.05f
 
-static float material1[] = {
-  //0.9f, 0.5f, 0.7f, // diffuse color
-  0.7f, 0.7f, 0.7f, // diffuse color
-  6.0f,             // diffuse coefficient
-  0.5f, 0.5f, 0.5f, // specular color
-  300.0f            // specular coefficient
-};
-static float material2[] = {
-  1.0f, 0.0f, 0.0f, // diffuse color
-  2.0f,             // diffuse coefficient
-  0.5f, 0.5f, 0.5f, // specular color
-  400.0f            // specular coefficient
-};
-static float material3[] = {
-  0.75f, 0.8f, 0.6f,// diffuse color
-  //1.0f, 1.0f, 1.0f,// diffuse color
-  5.0f,             // diffuse coefficient
-};
-static float plane_material[] = {
-  0.88f, 0.88f, 1.0f, // diffuse color
-  1.5f,               // diffuse coefficient
-};
-
-static float sphere1_points[] = {
-  0.4f, -0.1f, 0.8f,
-  0.4f
-};
-static float sphere2_points[] = {
-  -0.25f, -0.3f, 0.5f,
-  0.2f
-};
-
-static float tethraedron_points[] = {
-  -1.5f,  2.5f, 5.0f,
-  -0.5f, -0.5f, 0.2f,
-  -5.5f, -0.5f, 10.5f,
-  -0.2f, -0.5f, 1.7f
-};
-static size_t tethraedron_indices[] = {
-  4,
-  0, 1, 2,
-  0, 2, 3,
-  0, 3, 1,
-  1, 3, 2
-};
-
-static float cube_points[] = {
-  -1.0f, -0.5f, 9.0f,
-   1.0f, -0.5f, 9.0f,
-   1.0f,  1.5f, 9.0f,
-  -1.0f,  1.5f, 9.0f,
-  -1.0f, -0.5f, 7.0f,
-   1.0f, -0.5f, 7.0f,
-   1.0f,  1.5f, 7.0f,
-  -1.0f,  1.5f, 7.0f
-};
-static size_t cube_indices[] = {
-  12,
-  0, 1, 2,  0, 2, 3, // back
-  0, 5, 1,  1, 4, 5, // top
-  4, 6, 5,  4, 7, 6, // front
-  7, 2, 6,  7, 3, 2, // bottom
-  0, 7, 4,  0, 3, 7, // left
-  5, 2, 1,  5, 6, 2 // right,
-};
-
-static float plane_points[] = {
-   0.0f, -0.5f, 0.0f, /**< plane origin */
-   0.0f,  1.0f, 0.0f  /**< plane normal vector */
-};
-
-
-static SOLID solids[] = {
-  { 1, sphere1_points, NULL, NULL, {0.5f, material1, NULL, LAMBERT}, SPHERE },
-  { 1, sphere2_points, NULL, NULL, {0.12f, material2, NULL, PHONG}, SPHERE },
-  { 4, tethraedron_points, NULL, tethraedron_indices, {0.1f, material3, NULL, LAMBERT}, TRIANGLE },
-  { 6, cube_points, NULL, cube_indices, {0.12f, material3, NULL, LAMBERT}, TRIANGLE },
-  { 1, plane_points, NULL, NULL, {0.1f, plane_material, NULL, LAMBERT}, PLANE }
-};
-
-static LIGHT lights[] = {
-  { DIRECTIONAL, { 0.1f, -1.0f,  1.0f}, {1.0f, 1.0f, 1.0f}, 1.2f },
-  //{ DIRECTIONAL, { 0.5f, -2.0f, -1.0f}, {1.0f, 1.0f, 1.0f}, 0.7f },
-  { DIRECTIONAL, {-0.5f, -2.5f, -3.0f}, {0.75f, 0.8f, 1.0f}, 1.8f }
-  //{ POINT, { -0.5f,  2.0f,  1.0f}, {1.0f, 1.0f, 1.0f}, 0.0f },
-  //{ POINT, { -0.1f,  1.0f, -1.0f}, {1.0f, 1.0f, 1.0f}, 1.0f },
-  //{ POINT, { -1.0f,  2.5f,  6.0f}, {0.75f, 0.8f, 1.0f}, 1.8f }
-};
-
-
-static SCENE scene = {
-  5,      /* number of solids */
-  solids, /* list of solids */
-  2,      /* number of lights */
-  lights, /* list of lights */
-  { 0.1f, 0.1f, 0.1f },  /* ambient color */
-  { 0.55f, 0.55f, 0.7f } /* background color */
-};
+/**
+ * Name of the output image of the i-th of n scenes, the index being
+ * inserted before the extension when there are several scenes. Indices
+ * are padded with zeros so that the names sort in order.
+ */
+static void output_name(char* filename, size_t size, const char* output, int i, int n) {
+  const char* extension = strrchr(output, '.');
+  int length = extension ? (int)(extension - output) : (int)strlen(output);
+  int digits = snprintf(NULL, 0, "%d", n - 1);
+
+  if(n == 1)
+    snprintf(filename, size, "%s", output);
+  else
+    snprintf(filename, size, "%.*s_%0*d%s", length, output, digits, i, extension ? extension : "");
+}
 
 /**
- * 
+ * Name of the output image of a frame of the i-th of n scenes.
+ */
+static void frame_name(char* filename, size_t size, const char* output, int i, int n, int frame, int n_frames) {
+  char name[1024];
+
+  output_name(name, sizeof(name), output, i, n);
+  output_name(filename, size, name, frame, n_frames);
+}
+
+/**
+ * Usage: raytracer [-t threads] [-s] [-b] [-a threshold] [-w width[xheight]] [-p] [-c checkpoint] [-i seconds] [-r]
+ *                  [-d workers] [-T first:last] [-W] [-f frames] [-o output] [-m heatmap] [-v] [scene...]
+ * -s traces one ray at a time instead of SIMD packets
+ * -b traces the samples of each tile breadth first, depth by depth, shading
+ *    hits by material
+ * -w sets the size of the images, 400 by 400 by default, their height being
+ *    their width unless it is given
+ * -p streams each image to its output band by band as it is rendered, for
+ *    images too large to be held in memory
+ * -c saves the completed tiles to a checkpoint file every 60 seconds, or
+ *    every -i seconds, which is removed once the image is written
+ * -r resumes the render from the checkpoint file, if there is one
+ * -d renders each image with local worker processes, -t being the number of
+ *    threads of each worker
+ * -T renders only the tiles first to last - 1 of the image, numbered row by
+ *    row, to a tile file instead of an image, to be assembled with the
+ *    tiles of other renders by raytracer_merge
+ * -W works for a coordinator: reads ranges of tiles from the standard input,
+ *    one "first last" line each, and writes their tiles to the standard
+ *    output as a tile file
+ * -f renders a sequence of frames of each scene, moving its animated eye
+ *    and instances from the first frame to the last one, and numbers the
+ *    images of the frames. The scene is loaded and prepared once, its
+ *    hierarchy being refitted to the moved instances of each frame
+ * -m draws the intersection tests of each pixel to a heatmap image
+ * -v prints the ray and intersection test counts of each scene
+ * Renders each scene file in turn, scenes/default.scene by default. When
+ * several scenes are given, the index of each scene is appended to the
+ * name of its output image.
  */
 int main(int argc, char** argv)
 {
-  int x, y;
-  int xx, yy;
+  int opt, i, n;
+  char* output = "img/test.ppm";
+  char* heatmap = NULL;
+  int verbose = 0;
+  int width = SIZE, height = 0;
+  float eye[3];
+  int streaming = 0;
+  char* checkpoints = NULL;
+  double interval = CHECKPOINT_INTERVAL;
+  int resume = 0;
+  size_t n_workers = 0;
+  size_t first = 0, last = 0;
+  int range = 0;
+  int worker = 0;
+  int frame, n_frames = 1;
+  FILE* file;
+  char* default_scene = "scenes/default.scene";
+  char** scenes = &default_scene;
+  char filename[1024];
+  char checkpoint_name[1024];
+  SCENE* scene;
+  STATS stats;
 
-  float color[3];
-
-  float origin[3] = { 0.0f, 0.0f, -1.0f };
-  float fragment[6] = {
-    0.0f, 0.0f, 0.0f, // position
-    0.0f, 0.0f, 0.0f  // color
+  RENDER settings = {
+    NULL, NULL,
+    { { 0.0f } }, // camera, set for each frame
+    RESOLUTION, ANTIALIAS, THRESHOLD, 1, 0,
+    RENDER_TILE_SIZE, 0,
+    NULL,
+    NULL, 0, 0,
+    NULL
   };
 
-  // initialize rays with near and far values
-  RAY ray = { 0.001f, 1000.0f };
+  while((opt = getopt(argc, argv, "t:sba:w:pc:i:rd:T:Wf:o:m:v")) != -1) {
+    switch(opt) {
+      case 't':
+        settings.n_threads = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        settings.packets = 0;
+        break;
+      case 'b':
+        settings.batch = 1;
+        break;
+      case 'a':
+        settings.threshold = strtof(optarg, NULL);
+        break;
+      case 'w':
+        if(sscanf(optarg, "%dx%d", &width, &height) < 1)
+          width = 0;
+        break;
+      case 'p':
+        streaming = 1;
+        break;
+      case 'c':
+        checkpoints = optarg;
+        break;
+      case 'i':
+        interval = strtod(optarg, NULL);
+        break;
+      case 'r':
+        resume = 1;
+        break;
+      case 'd':
+        n_workers = strtoul(optarg, NULL, 10);
+        break;
+      case 'T':
+        if(sscanf(optarg, "%zu:%zu", &first, &last) != 2) {
+          fprintf(stderr, "Invalid tile range '%s', expected first:last\n", optarg);
+          return 1;
+        }
+        range = 1;
+        break;
+      case 'W':
+        worker = 1;
+        break;
+      case 'f':
+        n_frames = atoi(optarg);
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      case 'm':
+        heatmap = optarg;
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-t threads] [-s] [-b] [-a threshold] [-w width[xheight]] [-p] [-c checkpoint] [-i seconds] [-r] [-d workers] [-T first:last] [-W] [-f frames] [-o output] [-m heatmap] [-v] [scene...]\n", argv[0]);
+        return 1;
+    }
+  }
+  n = 1;
+  if(optind < argc) {
+    scenes = &argv[optind];
+    n = argc - optind;
+  }
+  if(height == 0)
+    height = width;
+  if(width <= 0 || height <= 0) {
+    fprintf(stderr, "Invalid image size %dx%d\n", width, height);
+    return 1;
+  }
+  if(streaming && (heatmap != NULL || checkpoints != NULL)) {
+    fprintf(stderr, "Heatmaps and checkpoints need the whole image and cannot be streamed\n");
+    return 1;
+  }
+  if((n_workers > 0 || range || worker) && (streaming || heatmap != NULL || checkpoints != NULL)) {
+    fprintf(stderr, "Heatmaps, checkpoints and streams cannot be used with distributed renders\n");
+    return 1;
+  }
+  if(n_frames <= 0) {
+    fprintf(stderr, "Invalid number of frames %d\n", n_frames);
+    return 1;
+  }
+  if(worker && (n > 1 || n_frames > 1)) {
+    fprintf(stderr, "A worker renders a single image\n");
+    return 1;
+  }
+  if(resume && checkpoints == NULL) {
+    fprintf(stderr, "Resuming needs a checkpoint file\n");
+    return 1;
+  }
+  if((heatmap != NULL || verbose) && !STATS_ENABLED)
+    fprintf(stderr, "Warning: statistics are disabled in this build, counts will be 0\n");
 
-  IMAGE* img = image(WIDTH, HEIGHT);
+  for(i = 0; i < n; i++) {
+    stats_reset();
+    scene = scene_load(scenes[i]);
+    scene_prepare(scene);
 
-  IMAGE* tile_texture = image_read("img/tiles.ppm", image_read_ppm);
-  solids[0].material.texture = tile_texture;
+    settings.scene = scene;
 
-  //const float translation[3] = { 0.0f, 1.0f, 8.0f };
-  //solid_translate(&solids[3], translation);
+    for(frame = 0; frame < n_frames; frame++) {
+      // the instances move and the hierarchy is refitted, the rest of the
+      // scene is kept from one frame to the next
+      scene_frame(scene, (n_frames > 1) ? (float)frame/(n_frames - 1) : 0.0f, eye);
+      camera_scene(&settings.camera, scene, eye);
+      // save the images, numbered when rendering several scenes or frames
+      frame_name(filename, sizeof(filename), output, i, n, frame, n_frames);
 
-  // do the raytracing
-  for(x = 0; x < WIDTH; x += RESOLUTION)
-  for(y = 0; y < HEIGHT; y += RESOLUTION) {
+      if(worker) {
+        // the tiles are the only output
+        render_worker(&settings, width, height, stdin, stdout);
+      } else if(range) {
+        file = fopen(filename, "wb");
+        if(file == NULL) {
+          fprintf(stderr, "Error while opening file '%s'\n", filename);
+          return 1;
+        }
+        image_write_tiles(file, width, height);
+        render_range(&settings, width, height, first, last, file);
+        if(fclose(file) != 0) {
+          fprintf(stderr, "Error while writing file '%s'\n", filename);
+          return 1;
+        }
+      } else if(streaming) {
+        // the rows are written while the raytracing goes on
+        settings.stream = image_stream(filename, width, height);
+        render(&settings);
+        image_stream_close(settings.stream);
+        settings.stream = NULL;
+      } else {
+        settings.image = image(width, height);
+        image_accumulation(settings.image);
+        if(heatmap != NULL)
+          settings.heatmap = image(width, height);
+        if(checkpoints != NULL) {
+          frame_name(checkpoint_name, sizeof(checkpoint_name), checkpoints, i, n, frame, n_frames);
+          settings.checkpoint = checkpoint(checkpoint_name, interval, resume);
+        }
 
-    v_set(color, 0, 0, 0);
+        // do the raytracing
+        if(n_workers > 0)
+          render_distribute(&settings, n_workers);
+        else
+          render(&settings);
 
-    // anti-aliasing iteration
-    for(xx = 0; xx < ANTIALIAS; xx++)
-    for(yy = 0; yy < ANTIALIAS; yy++) {
-      // calculate ray
-      fragment[0] = (x + (float)xx/ANTIALIAS)/WIDTH - 0.5f;
-      fragment[1] = 0.5f - (y + (float)yy/ANTIALIAS)/HEIGHT;
-      fragment[2] = 0.0f;
-      ray_calculate(&ray, origin, fragment, false);
-      
-      ray_trace(&ray, &scene, &fragment[3]);
-      v_add(color, &fragment[3], color);
+        image_write(settings.image, filename, image_write_ppm);
+        image_free(settings.image);
+        // the image is safe, its progress is not needed anymore
+        if(settings.checkpoint != NULL) {
+          remove(checkpoint_name);
+          checkpoint_free(settings.checkpoint);
+          settings.checkpoint = NULL;
+        }
+      }
+      if(heatmap != NULL) {
+        frame_name(filename, sizeof(filename), heatmap, i, n, frame, n_frames);
+        image_write(settings.heatmap, filename, image_write_ppm);
+        image_free(settings.heatmap);
+      }
     }
 
-    // converts color to the [0, 255] range
-    v_mul(255.0f*powf(ANTIALIAS, -2), color, color);
-    v_clamp(color, 0, 255, color);
-
-    // write to the image
-    #if RESOLUTION == 1
-    image_setpixel(img, x, y, color[0], color[1], color[2]);
-    #else
-    image_setpixels_square(img, x, y, RESOLUTION, color[0], color[1], color[2]);
-    #endif
+    // the standard output of a worker holds its tiles
+    if(verbose) {
+      stats_merge();
+      stats_total(&stats);
+      fprintf(worker ? stderr : stdout, "%s\n", scenes[i]);
+      stats_print(worker ? stderr : stdout, &stats);
+    }
+    scene_free(scene);
   }
 
-  // save the image
-  image_write(img, argv[1] != NULL ? argv[1] : "img/test.ppm", image_write_ppm);
-  image_free(img);
-
   return 0;
 }
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image.h"
+
+/**
+ * Usage: raytracer_merge [-o output] tiles...
+ * Assembles the tile files rendered separately by raytracer -T or -W into
+ * the whole image. Every pixel of the image must be covered by a tile.
+ */
+int main(int argc, char** argv)
+{
+  int opt, i;
+  char* output = "img/test.ppm";
+  IMAGE* img = NULL;
+  u_char* covered = NULL;
+  size_t n_covered = 0, n_pixels = 0;
+  int width, height, x, y, w, h, xx, yy;
+  FILE* file;
+
+  while((opt = getopt(argc, argv, "o:")) != -1) {
+    switch(opt) {
+      case 'o':
+        output = optarg;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-o output] tiles...\n", argv[0]);
+        return 1;
+    }
+  }
+  if(optind >= argc) {
+    fprintf(stderr, "Usage: %s [-o output] tiles...\n", argv[0]);
+    return 1;
+  }
+
+  for(i = optind; i < argc; i++) {
+    file = fopen(argv[i], "rb");
+    if(file == NULL) {
+      fprintf(stderr, "Error while opening file '%s'\n", argv[i]);
+      return 1;
+    }
+    image_read_tiles(file, &width, &height);
+    if(img == NULL) {
+      img = image(width, height);
+      n_pixels = (size_t)width*height;
+      covered = (u_char*)calloc(n_pixels, 1);
+    } else if(width != img->width || height != img->height) {
+      fprintf(stderr, "Error, tile file '%s' holds a %dx%d image instead of %dx%d\n",
+              argv[i], width, height, img->width, img->height);
+      return 1;
+    }
+
+    while(image_read_tile(file, img, &x, &y, &w, &h)) {
+      for(yy = y; yy < y + h; yy++)
+      for(xx = x; xx < x + w; xx++) {
+        n_covered += !covered[(size_t)yy*width + xx];
+        covered[(size_t)yy*width + xx] = 1;
+      }
+    }
+    fclose(file);
+  }
+
+  if(n_covered != n_pixels) {
+    fprintf(stderr, "Error, the tiles cover %zu of the %zu pixels of the image\n", n_covered, n_pixels);
+    return 1;
+  }
+  image_write(img, output, image_write_ppm);
+  image_free(img);
+  free(covered);
+
+  return 0;
+}